@@ -0,0 +1,73 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Hands out objects of type T carved from a few large blocks and destroys them
+// all together when the arena goes away. Objects never move, so pointers to
+// them stay valid for the lifetime of the arena, including across moves of the
+// arena itself. Block sizes double from FIRST_BLOCK up to LAST_BLOCK objects.
+template <typename T> class Arena {
+  public:
+    Arena() = default;
+
+    Arena(const Arena &) = delete;
+
+    auto operator=(const Arena &) -> Arena & = delete;
+
+    Arena(Arena &&other) noexcept
+        : blocks(std::exchange(other.blocks, {})),
+          used(std::exchange(other.used, 0)) {}
+
+    auto operator=(Arena &&other) noexcept -> Arena & {
+        if (this != &other) {
+            release();
+            blocks = std::exchange(other.blocks, {});
+            used = std::exchange(other.used, 0);
+        }
+        return *this;
+    }
+
+    ~Arena() { release(); }
+
+    template <typename... Args> auto make(Args &&...args) -> T * {
+        if (blocks.empty() || used == blocks.back().capacity) {
+            const auto capacity =
+                blocks.empty()
+                    ? FIRST_BLOCK
+                    : std::min(blocks.back().capacity * 2, LAST_BLOCK);
+            blocks.push_back(
+                {std::allocator<T>().allocate(capacity), capacity});
+            used = 0;
+        }
+        auto object = std::construct_at(blocks.back().elements + used,
+                                        std::forward<Args>(args)...);
+        used++;
+        return object;
+    }
+
+  private:
+    static constexpr std::size_t FIRST_BLOCK = 16;
+    static constexpr std::size_t LAST_BLOCK = 1024;
+
+    struct Block {
+        T *elements;
+        std::size_t capacity;
+    };
+
+    std::vector<Block> blocks;
+    // Objects constructed in the last block; every earlier block is full
+    std::size_t used = 0;
+
+    void release() {
+        for (auto &block : blocks) {
+            std::destroy_n(block.elements,
+                           &block == &blocks.back() ? used : block.capacity);
+            std::allocator<T>().deallocate(block.elements, block.capacity);
+        }
+        blocks.clear();
+        used = 0;
+    }
+};
@@ -0,0 +1,141 @@
+// Heap allocations and time of the parser's stacks as std::stack over
+// std::deque, with std::vector for the temporaries, against SmallStack.
+//
+// Each body gets stacks of its own, as the Parser that parses a body does, and
+// then runs through statements that push and pop operands a few deep inside
+// nested ifs and whiles, and declarations that collect names in the
+// temporaries.
+//
+//   g++ -std=c++20 -O2 -I.. small_stack.cpp -o small_stack
+//   ./small_stack [bodies] [statements per body]
+#include "small_stack.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <new>
+#include <optional>
+#include <stack>
+#include <string>
+#include <variant>
+#include <vector>
+
+static std::uint64_t allocations = 0;
+
+auto operator new(const std::size_t size) -> void * {
+    allocations++;
+    if (void *p = std::malloc(size != 0 ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+// As Parser::VarValue
+struct Value {
+    std::uint8_t type;
+    std::optional<std::variant<std::int32_t, float, bool>> literal;
+};
+
+// The parser's stacks as they were
+struct StdStacks {
+    std::stack<Value> values;
+    std::vector<std::string> temporaries;
+    std::stack<std::uint64_t> conditional_stack;
+    std::stack<std::uint64_t> loop_stack;
+};
+
+// And as they are
+struct SmallStacks {
+    SmallStack<Value, 16> values;
+    SmallStack<std::string, 8> temporaries;
+    SmallStack<std::uint64_t, 16> conditional_stack;
+    SmallStack<std::uint64_t, 16> loop_stack;
+};
+
+void declare(std::vector<std::string> &names, const char *name) {
+    names.push_back(name);
+}
+
+template <std::size_t N>
+void declare(SmallStack<std::string, N> &names, const char *name) {
+    names.push(name);
+}
+
+template <typename Stacks>
+auto parse_body(const std::uint64_t statements) -> std::uint64_t {
+    Stacks stacks;
+    std::uint64_t sum = 0;
+    for (std::uint64_t i = 0; i < statements; ++i) {
+        if (i % 16 == 0) {
+            // var alpha, beta, gamma : integer;
+            for (const auto *name : {"alpha", "beta", "gamma"}) {
+                declare(stacks.temporaries, name);
+            }
+            sum += stacks.temporaries.size();
+            stacks.temporaries.clear();
+        }
+        const auto depth = i % 5;
+        for (std::uint64_t d = 0; d < depth; ++d) {
+            (d % 2 == 0 ? stacks.conditional_stack : stacks.loop_stack)
+                .push(i + d);
+        }
+        // An expression of two to eight operands, each binary operator
+        // popping two values and pushing its result
+        const auto operands = 2 + i % 7;
+        for (std::uint64_t k = 0; k < operands; ++k) {
+            stacks.values.push({static_cast<std::uint8_t>(k % 4),
+                                static_cast<std::int32_t>(i + k)});
+        }
+        for (std::uint64_t k = 1; k < operands; ++k) {
+            stacks.values.pop();
+            stacks.values.top().type ^= 1;
+        }
+        sum += stacks.values.top().type;
+        stacks.values.pop();
+        for (std::uint64_t d = depth; d-- > 0;) {
+            auto &stack =
+                d % 2 == 0 ? stacks.conditional_stack : stacks.loop_stack;
+            sum += stack.top();
+            stack.pop();
+        }
+    }
+    return sum;
+}
+
+template <typename Stacks>
+void run(const char *name, const std::uint64_t bodies,
+         const std::uint64_t statements) {
+    const auto before = allocations;
+    const auto start = std::chrono::steady_clock::now();
+    std::uint64_t sum = 0;
+    for (std::uint64_t b = 0; b < bodies; ++b) {
+        sum += parse_body<Stacks>(statements);
+    }
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::printf("%-11s %10llu allocations %9.1f ms (%llu)\n", name,
+                static_cast<unsigned long long>(allocations - before),
+                elapsed.count(), static_cast<unsigned long long>(sum));
+}
+
+} // namespace
+
+auto main(const int argc, char **argv) -> int {
+    const std::uint64_t bodies =
+        argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    const std::uint64_t statements =
+        argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 20;
+    std::printf("%llu bodies of %llu statements\n",
+                static_cast<unsigned long long>(bodies),
+                static_cast<unsigned long long>(statements));
+    run<StdStacks>("std::stack", bodies, statements);
+    run<SmallStacks>("SmallStack", bodies, statements);
+    return 0;
+}
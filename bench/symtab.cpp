@@ -0,0 +1,152 @@
+// Declaring and looking up a million distinct names.
+//
+// First the scope table alone: std::unordered_map used the way SymbolTable
+// used it, checking contains() before operator[] and building a std::string
+// for every query, against FlatMap with one probe per query. Then
+// SymbolTable itself, declaring the names as globals and resolving each of
+// them, and as many names that are not declared, from inside a procedure.
+//
+//   g++ -std=c++20 -O2 -I.. symtab.cpp ../{symtab,types,interface}.cpp -o symtab
+//   ./symtab [names]
+#include "flat_map.hpp"
+#include "symtab.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+namespace {
+
+using Data = std::variant<VarData, ProcData, FuncData>;
+
+class Stopwatch {
+  public:
+    // Milliseconds since the last call, or since the stopwatch was made
+    auto lap() -> double {
+        const auto now = std::chrono::steady_clock::now();
+        const std::chrono::duration<double, std::milli> elapsed = now - last;
+        last = now;
+        return elapsed.count();
+    }
+
+  private:
+    std::chrono::steady_clock::time_point last =
+        std::chrono::steady_clock::now();
+};
+
+auto variable(const std::uint64_t order) -> VarData {
+    return VarData{.type = TypeTable::scalar(VarType::Integer),
+                   .pass_by_ref = false,
+                   .is_param = false,
+                   .size = 4,
+                   .offset = order * 4,
+                   .order = order};
+}
+
+// What the lookups found, so that none of them can be left out
+std::uint64_t checksum = 0;
+
+void unordered(const std::vector<std::string> &names,
+               const std::vector<std::string> &missing) {
+    std::unordered_map<std::string, Data> table;
+    Stopwatch watch;
+    for (std::uint64_t i = 0; i < names.size(); ++i) {
+        const std::string_view name = names[i];
+        if (!table.contains(std::string(name))) {
+            table[std::string(name)] = variable(i);
+        }
+    }
+    const auto declared = watch.lap();
+    for (const std::string_view name : names) {
+        const auto key = std::string(name);
+        if (table.contains(key) &&
+            std::holds_alternative<VarData>(table[key])) {
+            checksum += std::get<VarData>(table[key]).offset;
+        }
+    }
+    const auto hits = watch.lap();
+    for (const std::string_view name : missing) {
+        checksum += table.contains(std::string(name)) ? 1 : 0;
+    }
+    std::printf("std::unordered_map  declare %7.1f ms  hit %7.1f ms  "
+                "miss %7.1f ms\n",
+                declared, hits, watch.lap());
+}
+
+void flat(const std::vector<std::string> &names,
+          const std::vector<std::string> &missing) {
+    FlatMap<Data> table;
+    Stopwatch watch;
+    for (std::uint64_t i = 0; i < names.size(); ++i) {
+        table.try_emplace(names[i], variable(i));
+    }
+    const auto declared = watch.lap();
+    for (const auto &name : names) {
+        const auto found = table.find(name);
+        if (const auto *var = std::get_if<VarData>(&found->second)) {
+            checksum += var->offset;
+        }
+    }
+    const auto hits = watch.lap();
+    for (const auto &name : missing) {
+        checksum += table.contains(name) ? 1 : 0;
+    }
+    std::printf("FlatMap             declare %7.1f ms  hit %7.1f ms  "
+                "miss %7.1f ms\n",
+                declared, hits, watch.lap());
+}
+
+void symbol_table(const std::vector<std::string> &names,
+                  const std::vector<std::string> &missing) {
+    SymbolTable symtab;
+    const auto integer = TypeTable::scalar(VarType::Integer);
+    Stopwatch watch;
+    for (const auto &name : names) {
+        if (!symtab.add_variable(name, integer)) {
+            std::abort();
+        }
+    }
+    const auto declared = watch.lap();
+    // Globals are resolved from procedure bodies too, past their scopes.
+    if (!symtab.enter_proc_scope("body") ||
+        !symtab.add_variable("local", integer)) {
+        std::abort();
+    }
+    watch.lap();
+    for (const auto &name : names) {
+        checksum += symtab.resolve(name)->var().offset;
+    }
+    const auto hits = watch.lap();
+    for (const auto &name : missing) {
+        checksum += symtab.resolve(name) ? 1 : 0;
+    }
+    std::printf("SymbolTable         declare %7.1f ms  hit %7.1f ms  "
+                "miss %7.1f ms\n",
+                declared, hits, watch.lap());
+    symtab.leave_scope();
+}
+
+} // namespace
+
+auto main(const int argc, char **argv) -> int {
+    const std::uint64_t count =
+        argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    // Identifiers of the lengths programs use, not declared in order
+    std::vector<std::string> names;
+    std::vector<std::string> missing;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        names.push_back("ident_" + std::to_string(i * 7919 % 1000003));
+        missing.push_back("other_" + std::to_string(i));
+    }
+    std::printf("%llu names\n", static_cast<unsigned long long>(count));
+    unordered(names, missing);
+    flat(names, missing);
+    symbol_table(names, missing);
+    std::printf("(%llu)\n", static_cast<unsigned long long>(checksum));
+    return 0;
+}
@@ -0,0 +1,358 @@
+#include "cfg.hpp"
+#include "constants.hpp"
+#include "liveness.hpp"
+#include "numbering.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+static auto key(const Label label) -> std::uint64_t {
+    return static_cast<std::uint64_t>(label.kind) << 32 | label.number;
+}
+
+static auto operand(const Label target) -> Operand {
+    return label(target.kind, target.number);
+}
+
+// The instruction sets the flags, but not as a comparison.
+static auto sets_flags(const Opcode opcode) -> bool {
+    switch (opcode) {
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::Imul:
+    case Opcode::Neg:
+    case Opcode::Divide:
+    case Opcode::Call:
+        return true;
+    default:
+        return false;
+    }
+}
+
+auto FlowGraph::reads_flags(const std::size_t b) const -> bool {
+    if (b == EXIT || !blocks[b].branch) {
+        return false;
+    }
+    for (auto i = blocks[b].first; i < blocks[b].last; ++i) {
+        if (code[i].opcode == Opcode::Cmp) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto FlowGraph::flag_setter(const std::size_t b) const -> std::size_t {
+    const auto &block = blocks[b];
+    if (!block.branch && !reads_flags(block.next)) {
+        return EXIT;
+    }
+    for (auto p = block.last; p-- > block.first;) {
+        if (code[p].opcode == Opcode::Cmp) {
+            return EXIT;
+        }
+        if (sets_flags(code[p].opcode)) {
+            return p;
+        }
+    }
+    return EXIT;
+}
+
+namespace {
+
+class ControlFlow : FlowGraph {
+  public:
+    ControlFlow(Routine &routine, const std::size_t begin,
+                const std::optional<Operand> &result, FlowStats &stats)
+        : FlowGraph(routine.code, begin), routine(routine), result(result),
+          stats(stats) {}
+
+    void run() {
+        if (!split()) {
+            return;
+        }
+        for (auto &block : blocks) {
+            thread(block);
+        }
+        propagate_constants(*this);
+        stats.reused += number_values(*this);
+        stats.dead_stores += eliminate_dead_code(*this, result);
+        for (auto &block : blocks) {
+            thread(block);
+        }
+        find_reachable();
+        join();
+        write(layout());
+    }
+
+  private:
+    Routine &routine;
+    const std::optional<Operand> &result;
+    FlowStats &stats;
+
+    // Starts a block at `position`.
+    void open(const std::size_t position) {
+        Block block;
+        block.labels = block.first = block.last = position;
+        block.tail = blocks.size();
+        blocks.push_back(block);
+    }
+
+    // Cuts the code into blocks; returns false if it jumps somewhere outside
+    // the body.
+    auto split() -> bool {
+        // The labels by key, with the block of each
+        std::vector<std::pair<std::uint64_t, std::size_t>> labels;
+        // The block, whether its conditional jump or its last one names it,
+        // and the label
+        struct Jump {
+            std::size_t block;
+            bool taken;
+            Label label;
+        };
+        std::vector<Jump> jumps;
+        // The block each virtual register was first named in
+        std::vector<std::size_t> home;
+        open(begin);
+        bool ended = false;
+        for (auto i = begin; i < code.size(); ++i) {
+            const auto &instruction = code[i];
+            if (instruction.opcode == Opcode::Label) {
+                if (ended || blocks.back().size != 0) {
+                    if (!ended) {
+                        blocks.back().next = blocks.size();
+                    }
+                    open(i);
+                    ended = false;
+                }
+                blocks.back().first = blocks.back().last = i + 1;
+                labels.emplace_back(key(instruction.operands[0].label),
+                                    blocks.size() - 1);
+                continue;
+            }
+            if (ended) {
+                open(i);
+                ended = false;
+            }
+            if (instruction.opcode == Opcode::Jmp) {
+                jumps.push_back({blocks.size() - 1, false,
+                                 instruction.operands[0].label});
+                ended = true;
+                continue;
+            }
+            if (is_conditional(instruction.opcode)) {
+                blocks.back().branch = instruction.opcode;
+                blocks.back().next = blocks.size();
+                jumps.push_back(
+                    {blocks.size() - 1, true, instruction.operands[0].label});
+                open(i + 1);
+                continue;
+            }
+            each_virtual(instruction, [&](const Register r) {
+                if (number(r) >= home.size()) {
+                    home.resize(number(r) + 1, EXIT);
+                    shared.resize(number(r) + 1, false);
+                }
+                if (home[number(r)] == EXIT) {
+                    home[number(r)] = blocks.size() - 1;
+                } else if (home[number(r)] != blocks.size() - 1) {
+                    shared[number(r)] = true;
+                    crossing = true;
+                }
+            });
+            blocks.back().last = i + 1;
+            blocks.back().size++;
+        }
+        std::ranges::sort(labels);
+        for (const auto &jump : jumps) {
+            const auto found = std::ranges::lower_bound(
+                labels, std::pair{key(jump.label), std::size_t{0}});
+            if (found == labels.end() || found->first != key(jump.label)) {
+                return false;
+            }
+            (jump.taken ? blocks[jump.block].taken : blocks[jump.block].next) =
+                found->second;
+        }
+        return true;
+    }
+
+    // Past any blocks that only jump on, or where a cycle of them starts. The
+    // last one before the end of the body stays, for its label.
+    [[nodiscard]] auto destination(std::size_t b) const -> std::size_t {
+        for (std::size_t steps = 0; b != EXIT && blocks[b].empty() &&
+                                    blocks[b].next != EXIT &&
+                                    steps < blocks.size();
+             ++steps) {
+            b = blocks[b].next;
+        }
+        return b;
+    }
+
+    void thread(Block &block) {
+        block.next = destination(block.next);
+        if (block.branch) {
+            block.taken = destination(block.taken);
+        }
+    }
+
+    void find_reachable() {
+        std::vector<std::size_t> work = {0};
+        blocks[0].reachable = true;
+        while (!work.empty()) {
+            const auto b = work.back();
+            work.pop_back();
+            for (const auto s : {blocks[b].next, blocks[b].taken}) {
+                if (s == EXIT) {
+                    continue;
+                }
+                blocks[s].predecessors++;
+                if (!blocks[s].reachable) {
+                    blocks[s].reachable = true;
+                    work.push_back(s);
+                }
+            }
+        }
+    }
+
+    // Joins each block onto the one block that leads to it, when that block
+    // has no branch of its own.
+    void join() {
+        for (std::size_t b = 0; b < blocks.size(); ++b) {
+            auto &block = blocks[b];
+            while (block.reachable && !block.branch && block.next != EXIT &&
+                   block.next != 0 && block.next != b &&
+                   blocks[block.next].predecessors == 1 &&
+                   (!crossing || block.next > b)) {
+                auto &next = blocks[block.next];
+                blocks[block.tail].joined = block.next;
+                block.tail = next.tail;
+                block.size += next.size;
+                next.reachable = false;
+                block.branch = next.branch;
+                block.taken = next.taken;
+                block.next = next.next;
+            }
+        }
+    }
+
+    // The order to write the blocks out in. Each block is followed by the
+    // block it leads to when that comes next in the code anyway, or when
+    // nothing else leads there and it does not end the body.
+    [[nodiscard]] auto layout() const -> std::vector<std::size_t> {
+        std::vector<std::size_t> following(blocks.size(), EXIT);
+        for (std::size_t b = blocks.size(), after = EXIT; b-- > 0;) {
+            following[b] = after;
+            if (blocks[b].reachable) {
+                after = b;
+            }
+        }
+        std::vector<std::size_t> order;
+        std::vector<bool> placed(blocks.size(), false);
+        for (std::size_t first = 0; first < blocks.size(); ++first) {
+            if (!blocks[first].reachable || placed[first]) {
+                continue;
+            }
+            for (auto b = first; b != EXIT;) {
+                order.push_back(b);
+                placed[b] = true;
+                const auto &block = blocks[b];
+                const auto successors = {block.next, block.taken};
+                auto chosen = EXIT;
+                for (const auto s : successors) {
+                    if (s != EXIT && !placed[s] && s == following[b]) {
+                        chosen = s;
+                        break;
+                    }
+                }
+                for (const auto s : successors) {
+                    if (chosen == EXIT && !crossing && s != EXIT &&
+                        !placed[s] && s > b && blocks[s].predecessors == 1 &&
+                        blocks[s].next != EXIT) {
+                        chosen = s;
+                    }
+                }
+                b = chosen;
+            }
+        }
+        return order;
+    }
+
+    // Calls `jump(opcode, block)` for each jump that ends block `order[i]`.
+    template <typename F>
+    void ends(const std::vector<std::size_t> &order, const std::size_t i,
+              F &&jump) const {
+        const auto &block = blocks[order[i]];
+        const auto after = i + 1 < order.size() ? order[i + 1] : EXIT;
+        if (block.branch && block.taken != block.next) {
+            if (block.next == after) {
+                jump(*block.branch, block.taken);
+            } else if (block.taken == after) {
+                jump(inverse(*block.branch), block.next);
+            } else {
+                jump(*block.branch, block.taken);
+                jump(Opcode::Jmp, block.next);
+            }
+        } else if (block.next != after) {
+            jump(Opcode::Jmp, block.next);
+        }
+    }
+
+    void write(const std::vector<std::size_t> &order) {
+        // The label each block is jumped to by, and the one after the body
+        std::vector<std::optional<Label>> targets(blocks.size());
+        std::optional<Label> exit;
+        const auto target = [&](const Opcode, const std::size_t b) {
+            auto &label = b == EXIT ? exit : targets[b];
+            if (!label) {
+                label = b == EXIT || blocks[b].labels == blocks[b].first
+                            ? routine.block().label
+                            : code[blocks[b].first - 1].operands[0].label;
+            }
+        };
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            ends(order, i, target);
+        }
+
+        // Written next to the code rather than over it, as the blocks move
+        Code out;
+        out.reserve(code.size());
+        out.insert(out.end(), code.cbegin(),
+                   code.cbegin() + static_cast<std::ptrdiff_t>(begin));
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            const auto b = order[i];
+            for (auto l = blocks[b].labels; l < blocks[b].first; ++l) {
+                const auto own = code[l].operands[0].label;
+                if (own.kind == LabelKind::Named ||
+                    (targets[b] && *targets[b] == own)) {
+                    out.push_back(code[l]);
+                }
+            }
+            if (targets[b] && blocks[b].labels == blocks[b].first) {
+                out.push_back({Opcode::Label, {operand(*targets[b])}});
+            }
+            for (auto c = b; c != EXIT; c = blocks[c].joined) {
+                for (auto p = blocks[c].first; p < blocks[c].last; ++p) {
+                    if (!removed[p - begin]) {
+                        out.push_back(code[p]);
+                    }
+                }
+            }
+            ends(order, i, [&](const Opcode opcode, const std::size_t to) {
+                out.push_back(
+                    {opcode, {operand(to == EXIT ? *exit : *targets[to])}});
+            });
+        }
+        if (exit) {
+            out.push_back({Opcode::Label, {operand(*exit)}});
+        }
+        code.swap(out);
+    }
+};
+
+} // namespace
+
+void simplify_control_flow(Routine &routine, const std::size_t begin,
+                           const std::optional<Operand> &result,
+                           FlowStats &stats) {
+    ControlFlow(routine, begin, result, stats).run();
+}
@@ -0,0 +1,161 @@
+#pragma once
+#include "ir.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+// Where the code falls off the end of the body
+inline constexpr std::size_t EXIT = std::numeric_limits<std::size_t>::max();
+
+// A basic block, as positions in the routine's code
+struct Block {
+    // The labels the block starts with, and the instructions after them
+    std::size_t labels = 0;
+    std::size_t first = 0;
+    std::size_t last = 0;
+    // The block whose instructions follow these once the two are joined, and
+    // the last block of that chain
+    std::size_t joined = EXIT;
+    std::size_t tail = EXIT;
+    // Instructions the block is left with, joined blocks included
+    std::size_t size = 0;
+    // The conditional jump that ends the block, if one does, and the block it
+    // goes to
+    std::optional<Opcode> branch;
+    std::size_t taken = EXIT;
+    // Where the block goes otherwise, by jumping or falling through
+    std::size_t next = EXIT;
+    bool reachable = false;
+    std::uint32_t predecessors = 0;
+
+    // Nothing happens in the block before it goes on to `next`.
+    [[nodiscard]] auto empty() const -> bool { return size == 0 && !branch; }
+};
+
+// The blocks of one body, from `begin` to the end of the code. Passes over the
+// graph rewrite instructions where they stand and mark the ones they drop as
+// removed; the code only changes shape once the blocks are written out.
+struct FlowGraph {
+    Code &code;
+    const std::size_t begin;
+    std::vector<Block> blocks;
+    // Instructions of the body left out, by position from `begin`
+    std::vector<bool> removed;
+    // Whether each virtual register is named in more than one block
+    std::vector<bool> shared;
+    // Some virtual register is shared, so the blocks must keep their order
+    // for its lifetime to stay in one piece.
+    bool crossing = false;
+
+    FlowGraph(Code &code, const std::size_t begin)
+        : code(code), begin(begin), removed(code.size() - begin, false) {}
+
+    // Block `b` starts with a jump that reads the flags some block before it
+    // set.
+    [[nodiscard]] auto reads_flags(std::size_t b) const -> bool;
+
+    // The last instruction of block `b` to set the flags other than by a
+    // comparison, if a jump may read what it set, or else EXIT
+    [[nodiscard]] auto flag_setter(std::size_t b) const -> std::size_t;
+
+    void remove(Block &block, const std::size_t position) {
+        removed[position - begin] = true;
+        block.size--;
+    }
+};
+
+// A memory operand that names a scalar of the frame or the data segment by a
+// fixed offset
+[[nodiscard]] inline auto is_slot(const Operand &operand) -> bool {
+    return (operand.kind == OperandKind::Memory ||
+            operand.kind == OperandKind::BytePointer) &&
+           operand.index == Register::None &&
+           (operand.reg == Register::EBP || operand.reg == Register::EDI);
+}
+
+// The signed offset of a memory operand
+[[nodiscard]] inline auto offset(const Operand &operand) -> std::int64_t {
+    return operand.sign == '-' ? -operand.value
+           : operand.sign      ? operand.value
+                               : 0;
+}
+
+// A slot as one number, which sorts by base and then offset
+[[nodiscard]] inline auto slot_key(const Register base,
+                                   const std::int64_t offset)
+    -> std::uint64_t {
+    return static_cast<std::uint64_t>(base) << 32 |
+           static_cast<std::uint32_t>(offset + (std::int64_t{1} << 31));
+}
+
+// Calls `visit` with each virtual register the operand names, as the register
+// itself or the base or index of a memory operand.
+template <typename F> void each_virtual(const Operand &operand, F &&visit) {
+    switch (operand.kind) {
+    case OperandKind::Register:
+    case OperandKind::LowByte:
+        if (is_virtual(operand.reg)) {
+            visit(operand.reg);
+        }
+        break;
+    case OperandKind::Memory:
+    case OperandKind::BytePointer:
+        if (is_virtual(operand.reg)) {
+            visit(operand.reg);
+        }
+        if (is_virtual(operand.index)) {
+            visit(operand.index);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// The same for every operand of the instruction
+template <typename F>
+void each_virtual(const Instruction &instruction, F &&visit) {
+    for (const auto &operand : instruction.operands) {
+        each_virtual(operand, visit);
+    }
+}
+
+// What simplifying the control flow of the bodies came to
+struct FlowStats {
+    // Instructions left out, or made copies, because a register already held
+    // their value
+    std::uint64_t reused = 0;
+    // Stores to variables that nothing read again, left out
+    std::uint64_t dead_stores = 0;
+
+    void merge(const FlowStats &other) {
+        reused += other.reused;
+        dead_stores += other.dead_stores;
+    }
+};
+
+// Splits the code of one body, from `begin` to the end of the routine's code,
+// into basic blocks and writes it out again with less control flow:
+//
+// - Constants are propagated through the body, which decides the branches on
+//   comparisons they settle (see constants.hpp).
+// - Jumps to a block that only jumps on go straight to where it leads.
+// - Values a register of the block already holds are not computed again (see
+//   numbering.hpp).
+// - Stores, and what computes a register, that nothing reads again are left
+//   out (see liveness.hpp).
+// - Blocks nothing reaches from the first are dropped.
+// - A block that only one other block leads to, by jumping or falling into
+//   it, is joined onto that one.
+// - The blocks are laid out so that as many as possible fall into the block
+//   they lead to, which saves their jump.
+//
+// The first block stays first, and the code still falls off the last one into
+// whatever follows the body. Labels no jump names any more are left out,
+// except named ones. `result` is the variable a function body leaves its
+// value in.
+void simplify_control_flow(Routine &routine, std::size_t begin,
+                           const std::optional<Operand> &result,
+                           FlowStats &stats);
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+# Writes random programs that always terminate, over a fixed set of globals
+# that interp.py knows how to lay out. Their results do not depend on how
+# registers are assigned. Programs from DivisionGen also divide by literals
+# and by expressions, and negate.
+#
+#   python3 generate.py seed [depth] [--division]
+import random
+import sys
+
+
+class Gen:
+    def __init__(self, seed, depth=3, procs=3, stmts=6):
+        self.rnd = random.Random(seed)
+        self.depth = depth
+        self.nprocs = procs
+        self.nstmts = stmts
+
+    def leaf(self, scope):
+        r = self.rnd
+        c = r.random()
+        if c < 0.25:
+            return str(r.randint(0, 9))
+        if c < 0.35:
+            return 'a[%d]' % r.randint(0, 9)
+        if c < 0.42 and scope['loops']:
+            return 'a[%s]' % r.choice(scope['loops'])
+        if c < 0.48:
+            if scope['loops'] and r.random() < .5:
+                i = r.choice(scope['loops'])
+            else:
+                i = str(r.randint(0, 3))
+            return 'm[%s, %d]' % (i, r.randint(0, 3))
+        if c < 0.55:
+            return 'rec.' + r.choice('xy')
+        return r.choice(scope['ints'])
+
+    def expr(self, scope, depth):
+        r = self.rnd
+        if depth <= 0 or r.random() < 0.25:
+            return self.leaf(scope)
+        op = r.choice('+-*+-')
+        shape = r.random()
+        if shape < 0.4:
+            lhs, rhs = self.expr(scope, depth - 1), self.expr(scope, depth - 1)
+        elif shape < 0.7:
+            lhs, rhs = self.leaf(scope), self.expr(scope, depth - 1)
+        else:
+            lhs, rhs = self.expr(scope, depth - 1), self.leaf(scope)
+        text = '%s %s %s' % (lhs, op, rhs)
+        return '(%s)' % text if r.random() < 0.6 else text
+
+    def target(self, scope):
+        r = self.rnd
+        c = r.random()
+        if c < 0.2:
+            return 'a[%d]' % r.randint(0, 9)
+        if c < 0.3 and scope['loops']:
+            return 'a[%s]' % r.choice(scope['loops'])
+        if c < 0.35:
+            return 'm[%d, %d]' % (r.randint(0, 3), r.randint(0, 3))
+        if c < 0.4:
+            return 'rec.' + r.choice('xy')
+        return r.choice(scope['targets'])
+
+    def cond(self, scope):
+        r = self.rnd
+        one = lambda: '%s %s %s' % (self.expr(scope, 2), r.choice('<>='),
+                                    self.expr(scope, 2))
+        c = r.random()
+        if c < 0.15:
+            return '(%s) and (%s)' % (one(), one())
+        if c < 0.3:
+            return '(%s) or (%s)' % (one(), one())
+        return one()
+
+    def stmt(self, scope, depth):
+        r = self.rnd
+        c = r.random()
+        if depth > 0 and c < 0.15:
+            return 'if %s then %s else %s' % (self.cond(scope),
+                                             self.stmt(scope, depth - 1),
+                                             self.stmt(scope, depth - 1))
+        if depth > 0 and c < 0.25 and scope['free_loops']:
+            k = scope['free_loops'].pop(0)
+            scope['loops'].append(k)
+            body = [self.stmt(scope, depth - 1)
+                    for _ in range(r.randint(1, 3))]
+            scope['loops'].pop()
+            scope['free_loops'].insert(0, k)
+            return ('begin %s := 0; while %s < %d do '
+                    'begin %s; %s := %s + 1 end end' % (
+                        k, k, r.randint(1, 3), '; '.join(body), k, k))
+        if depth > 0 and c < 0.32:
+            return 'begin %s end' % '; '.join(
+                self.stmt(scope, depth - 1) for _ in range(r.randint(1, 3)))
+        if c < 0.42 and scope['callable']:
+            p = r.choice(scope['callable'])
+            return '%s(%s, %s)' % (p, self.expr(scope, 2),
+                                   self.target(scope))
+        if c < 0.45:
+            return r.choice(['ch := rec.c', 'rec.c := ch', 'ch := ch'])
+        return '%s := %s' % (self.target(scope),
+                             self.expr(scope, self.depth))
+
+    def program(self):
+        out = ['program sem;',
+               'var g0, g1, g2, g3, g4, g5, i0, i1 : integer;',
+               'var a : array[0..9] of integer;',
+               'var m : array[0..3, 0..3] of integer;',
+               'var rec : record x : integer; c : char; y : integer end;',
+               'var ch : char;']
+        names = []
+        globals_ = ['g%d' % i for i in range(6)]
+        for p in range(self.nprocs):
+            name = 'p%d' % p
+            scope = {'ints': globals_ + ['q', 'w', 'l0', 'l1'],
+                     'targets': globals_ + ['w', 'l0', 'l1', 'q'],
+                     'loops': [], 'free_loops': ['k0', 'k1'],
+                     'callable': list(names)}
+            out.append('procedure %s(q : integer; var w : integer);' % name)
+            out.append('var l0, l1, k0, k1 : integer;')
+            body = ['l0 := q', 'l1 := w'] + [
+                self.stmt(scope, 2) for _ in range(self.rnd.randint(1, 4))]
+            out.append('begin\n  %s\nend;' % ';\n  '.join(body))
+            names.append(name)
+        scope = {'ints': globals_, 'targets': globals_, 'loops': [],
+                 'free_loops': ['i0', 'i1'], 'callable': names}
+        body = ['%s := %d' % (g, self.rnd.randint(0, 20)) for g in globals_]
+        body += ['a[%d] := %d' % (i, self.rnd.randint(0, 20))
+                 for i in range(10)]
+        body += ['rec.x := 3', 'rec.y := 4']
+        body += [self.stmt(scope, 3) for _ in range(self.nstmts)]
+        out.append('begin\n  %s\nend.' % ';\n  '.join(body))
+        return '\n'.join(out) + '\n'
+
+
+class DivisionGen(Gen):
+    def expr(self, scope, depth):
+        r = self.rnd
+        e = super().expr(scope, depth)
+        c = r.random()
+        if c < 0.15:
+            return '(%s) / (%d)' % (e, r.choice([1, 2, 3, -2, 7]))
+        if c < 0.25:
+            return '-(%s)' % e
+        if c < 0.3:
+            return '%s / (%s)' % (r.randint(-9, 99), e)
+        return e
+
+
+if __name__ == '__main__':
+    args = [a for a in sys.argv[1:] if a != '--division']
+    generator = DivisionGen if '--division' in sys.argv else Gen
+    seed = int(args[0])
+    depth = int(args[1]) if len(args) > 1 else 3
+    sys.stdout.write(generator(seed, depth).program())
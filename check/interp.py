@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+# Interprets the programs generate.py writes, and lays their globals out the
+# way the compiler does so that a listing's data segment can be checked
+# against what the program should compute. Raises RuntimeError for programs
+# that divide by zero or run for too long.
+#
+#   python3 interp.py program.txt
+import re
+import struct
+import sys
+
+M32 = 0xffffffff
+
+
+def divide(x, y):
+    if y == 0:
+        raise RuntimeError('divide by zero')
+    q = abs(x) // abs(y)
+    return wrap(q if (x < 0) == (y < 0) else -q)
+
+
+def wrap(v):
+    v &= M32
+    return v - (1 << 32) if v & 0x80000000 else v
+
+
+OPERATORS = {'+': lambda x, y: wrap(x + y), '-': lambda x, y: wrap(x - y),
+             '*': lambda x, y: wrap(x * y), '/': divide}
+
+
+def binary(operator, a, b):
+    return lambda env: operator(a(env), b(env))
+
+
+class Box:
+    __slots__ = ['v']
+
+    def __init__(self, v=0):
+        self.v = v
+
+
+def tokenize(src):
+    return re.findall(r'\d+|[A-Za-z_]\w*|:=|[^\s\w]', src)
+
+
+class Interp:
+    def __init__(self, src):
+        self.toks = tokenize(src)
+        self.procs = {}
+        self.g = {n: Box() for n in
+                  ['g0', 'g1', 'g2', 'g3', 'g4', 'g5', 'i0', 'i1', 'ch']}
+        self.g['a'] = [Box() for _ in range(10)]
+        self.g['m'] = [[Box() for _ in range(4)] for _ in range(4)]
+        self.g['rec'] = {'x': Box(), 'c': Box(), 'y': Box()}
+        self.steps = 0
+
+    # Parsing into closures keeps the interpreter simple.
+    def peek(self):
+        return self.toks[self.p] if self.p < len(self.toks) else None
+
+    def take(self, want=None):
+        t = self.toks[self.p]
+        if want is not None and t != want:
+            raise SyntaxError('want %s got %s at %d' % (want, t, self.p))
+        self.p += 1
+        return t
+
+    def run(self):
+        self.p = 0
+        self.take('program'); self.take(); self.take(';')
+        while self.peek() not in ('procedure', 'begin'):
+            self.take()
+        while self.peek() == 'procedure':
+            self.procedure()
+        body = self.compound()
+        self.take('.')
+        body(self.g)
+        return self
+
+    def procedure(self):
+        self.take('procedure')
+        name = self.take()
+        while self.take() != ';':
+            pass
+        while self.peek() != 'begin':
+            self.take()
+        body = self.compound()
+        self.take(';')
+        self.procs[name] = body
+
+    def compound(self):
+        self.take('begin')
+        stmts = [self.statement()]
+        while self.peek() == ';':
+            self.take(';')
+            stmts.append(self.statement())
+        self.take('end')
+
+        def run(env):
+            for s in stmts:
+                s(env)
+        return run
+
+    def statement(self):
+        t = self.peek()
+        if t == 'begin':
+            return self.compound()
+        if t == 'if':
+            self.take()
+            c = self.cond()
+            self.take('then')
+            a = self.statement()
+            self.take('else')
+            b = self.statement()
+            return lambda env: a(env) if c(env) else b(env)
+        if t == 'while':
+            self.take()
+            c = self.cond()
+            self.take('do')
+            s = self.statement()
+
+            def loop(env):
+                while c(env):
+                    self.steps += 1
+                    if self.steps > 10 ** 6:
+                        raise RuntimeError('steps')
+                    s(env)
+            return loop
+        if t in self.procs:
+            self.take()
+            self.take('(')
+            q = self.expr()
+            self.take(',')
+            w = self.ref()
+            self.take(')')
+            proc = self.procs[t]
+
+            def call(env):
+                local = dict(self.g)
+                local.update({'q': Box(q(env)), 'w': w(env), 'l0': Box(),
+                              'l1': Box(), 'k0': Box(), 'k1': Box()})
+                proc(local)
+            return call
+        target = self.ref()
+        self.take(':=')
+        e = self.expr()
+
+        def assign(env):
+            v = e(env)
+            target(env).v = v
+        return assign
+
+    def ref(self):
+        name = self.take()
+        if self.peek() == '[':
+            self.take('[')
+            i = self.expr()
+            if self.peek() == ',':
+                self.take(',')
+                j = self.expr()
+                self.take(']')
+                return lambda env: env[name][i(env)][j(env)]
+            self.take(']')
+            return lambda env: env[name][i(env)]
+        if self.peek() == '.':
+            self.take('.')
+            field = self.take()
+            return lambda env: env[name][field]
+        return lambda env: env[name]
+
+    def cond(self):
+        if self.peek() == '(':
+            # (c) and (c) / (c) or (c)
+            save = self.p
+            try:
+                self.take('(')
+                a = self.compare()
+                self.take(')')
+                op = self.take()
+                if op not in ('and', 'or'):
+                    raise SyntaxError
+                self.take('(')
+                b = self.compare()
+                self.take(')')
+                if op == 'and':
+                    return lambda env: a(env) and b(env)
+                return lambda env: a(env) or b(env)
+            except (SyntaxError, KeyError):
+                self.p = save
+        return self.compare()
+
+    def compare(self):
+        a = self.expr()
+        op = self.take()
+        b = self.expr()
+        if op not in '<>=':
+            raise SyntaxError(op)
+        return {'<': lambda env: a(env) < b(env),
+                '>': lambda env: a(env) > b(env),
+                '=': lambda env: a(env) == b(env)}[op]
+
+    def expr(self):
+        a = self.term()
+        while self.peek() in ('+', '-'):
+            a = binary(OPERATORS[self.take()], a, self.term())
+        return a
+
+    def term(self):
+        a = self.factor()
+        while self.peek() in ('*', '/'):
+            a = binary(OPERATORS[self.take()], a, self.factor())
+        return a
+
+    def factor(self):
+        t = self.peek()
+        if t == '(':
+            self.take()
+            e = self.expr()
+            self.take(')')
+            return e
+        if t == '-':
+            self.take()
+            e = self.term()
+            return lambda env: wrap(-e(env))
+        if t.isdigit():
+            self.take()
+            v = int(t)
+            return lambda env: v
+        r = self.ref()
+        return lambda env: r(env).v
+
+    def segment(self):
+        g = self.g
+        ints = [g[n].v for n in ['g0', 'g1', 'g2', 'g3', 'g4', 'g5', 'i0',
+                                  'i1']]
+        ints += [b.v for b in g['a']]
+        ints += [b.v for row in g['m'] for b in row]
+        out = struct.pack('<%di' % len(ints), *ints)
+        out += struct.pack('<iBxxxiB', g['rec']['x'].v, g['rec']['c'].v,
+                           g['rec']['y'].v, g['ch'].v)
+        return out
+
+
+if __name__ == '__main__':
+    print(Interp(open(sys.argv[1]).read()).run().segment().hex())
@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+# Runs the assembly block of a listing the compiler writes on a small model
+# of the x86 registers and memory, and hands back the data segment it leaves
+# behind. Only the instructions the compiler emits are known.
+#
+#   python3 listing.py code.lst
+import re
+import struct
+import sys
+
+DATA = 0x1000
+DATA_SIZE = 0x1000
+MEMORY_SIZE = 0x100000
+REGISTERS = ['EAX', 'EBX', 'ECX', 'EDX', 'ESI', 'EDI', 'EBP', 'ESP']
+LOW_BYTES = {'AL': 'EAX', 'BL': 'EBX', 'CL': 'ECX', 'DL': 'EDX'}
+M32 = 0xffffffff
+
+
+class Fault(Exception):
+    pass
+
+
+def signed(v):
+    v &= M32
+    return v - (1 << 32) if v & 0x80000000 else v
+
+
+def parse(text):
+    lines = [line.rstrip('\r') for line in text.split('\n')]
+    code, labels = [], {}
+    for line in lines[lines.index('_asm {') + 1:]:
+        if line == '}':
+            break
+        if line.endswith(':'):
+            labels[line[:-1]] = len(code)
+            continue
+        op, _, rest = line.partition(' ')
+        args = [a.strip() for a in rest.split(', ')] if rest else []
+        code.append((op.upper(), args))
+    return code, labels
+
+
+def run(text, max_steps=5_000_000):
+    """Returns the data segment and the number of instructions executed."""
+    code, labels = parse(text)
+    memory = bytearray(MEMORY_SIZE)
+    r = {name: 0 for name in REGISTERS}
+    r['ESP'] = MEMORY_SIZE - 0x10000
+    # The sign of the last comparison
+    compared = 0
+
+    def address(operand):
+        operand = operand.replace('BYTE PTR ', '')
+        total = 0
+        for sign, term in re.findall(r'([+-]?)\s*([^+-]+)', operand[1:-1]):
+            term = term.strip()
+            if '*' in term:
+                name, scale = term.split('*')
+                v = r[name] * int(scale)
+            elif term in r:
+                v = r[term]
+            else:
+                v = int(term)
+            total += -v if sign == '-' else v
+        return total & M32
+
+    def load(operand, size=4):
+        p = address(operand)
+        if p + size > MEMORY_SIZE:
+            raise Fault('address %x' % p)
+        return int.from_bytes(memory[p:p + size], 'little')
+
+    def store(operand, v, size=4):
+        p = address(operand)
+        if p + size > MEMORY_SIZE:
+            raise Fault('address %x' % p)
+        memory[p:p + size] = (v & ((1 << (8 * size)) - 1)).to_bytes(
+            size, 'little')
+
+    def value(operand):
+        if operand in r:
+            return r[operand]
+        if operand in LOW_BYTES:
+            return r[LOW_BYTES[operand]] & 0xff
+        if operand.startswith('BYTE PTR'):
+            return load(operand, 1)
+        if operand.startswith('['):
+            return load(operand)
+        if operand == 'data_segment':
+            return DATA
+        try:
+            return int(operand) & M32
+        except ValueError:
+            return struct.unpack('<I', struct.pack('<f', float(operand)))[0]
+
+    def assign(operand, v):
+        if operand in r:
+            r[operand] = v & M32
+        elif operand.startswith('BYTE PTR'):
+            store(operand, v, 1)
+        elif operand.startswith('['):
+            store(operand, v)
+        else:
+            raise Fault('cannot write ' + operand)
+
+    def push(v):
+        r['ESP'] = (r['ESP'] - 4) & M32
+        store('[ESP]', v)
+
+    def pop():
+        v = load('[ESP]')
+        r['ESP'] = (r['ESP'] + 4) & M32
+        return v
+
+    pc = 0
+    steps = 0
+    while pc < len(code):
+        steps += 1
+        if steps > max_steps:
+            raise Fault('more than %d steps' % max_steps)
+        op, args = code[pc]
+        pc += 1
+        if op in ('MOV', 'LEA', 'MOVZX'):
+            destination, source = args
+            if op == 'LEA':
+                v = DATA if source == 'data_segment' else address(source)
+            else:
+                v = value(source)
+            if destination.startswith('[') and source in LOW_BYTES:
+                store(destination, v, 1)
+            else:
+                assign(destination, v)
+        elif op in ('ADD', 'SUB', 'IMUL'):
+            # Two operands, or a destination and two sources
+            a, b = args[-2:]
+            x, y = signed(value(a)), signed(value(b))
+            assign(args[0], x + y if op == 'ADD' else
+                   x - y if op == 'SUB' else x * y)
+        elif op == 'NEG':
+            assign(args[0], -signed(value(args[0])))
+        elif op == 'CMP':
+            x, y = signed(value(args[0])), signed(value(args[1]))
+            compared = (x > y) - (x < y)
+        elif op == 'CDQ':
+            r['EDX'] = M32 if r['EAX'] & 0x80000000 else 0
+        elif op == 'IDIV':
+            divisor = signed(value(args[0]))
+            if divisor == 0:
+                raise Fault('divide by zero')
+            dividend = (r['EDX'] << 32) | r['EAX']
+            if dividend & (1 << 63):
+                dividend -= 1 << 64
+            quotient = abs(dividend) // abs(divisor)
+            if (dividend < 0) != (divisor < 0):
+                quotient = -quotient
+            r['EAX'] = quotient & M32
+            r['EDX'] = (dividend - quotient * divisor) & M32
+        elif op == 'PUSH':
+            push(value(args[0]))
+        elif op == 'POP':
+            assign(args[0], pop())
+        elif op == 'PUSHAD':
+            esp = r['ESP']
+            for name in ['EAX', 'ECX', 'EDX', 'EBX']:
+                push(r[name])
+            push(esp)
+            for name in ['EBP', 'ESI', 'EDI']:
+                push(r[name])
+        elif op == 'POPAD':
+            for name in ['EDI', 'ESI', 'EBP']:
+                r[name] = pop()
+            pop()
+            for name in ['EBX', 'EDX', 'ECX', 'EAX']:
+                r[name] = pop()
+        elif op == 'CALL':
+            push(pc)
+            pc = labels[args[0]]
+        elif op == 'RET':
+            pc = pop()
+            if args:
+                r['ESP'] = (r['ESP'] + int(args[0])) & M32
+        elif op == 'JMP':
+            pc = labels[args[0]]
+        elif op in ('JL', 'JG', 'JE', 'JGE', 'JLE', 'JNE'):
+            taken = {'JL': compared < 0, 'JG': compared > 0,
+                     'JE': compared == 0, 'JGE': compared >= 0,
+                     'JLE': compared <= 0, 'JNE': compared != 0}[op]
+            if taken:
+                pc = labels[args[0]]
+        else:
+            raise Fault('unknown instruction ' + op)
+    return bytes(memory[DATA:DATA + DATA_SIZE]), steps
+
+
+if __name__ == '__main__':
+    for path in sys.argv[1:]:
+        try:
+            segment, steps = run(open(path).read())
+        except Fault as e:
+            print('%s: fault: %s' % (path, e))
+            continue
+        used = len(segment.rstrip(b'\0'))
+        print('%s: %d instructions, data %s' % (
+            path, steps, segment[:(used + 3) // 4 * 4].hex()))
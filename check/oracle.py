@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+# Compiles generated programs and checks that what each listing leaves in the
+# data segment is what interp.py says the program computes. Programs that
+# the interpreter gives up on are skipped. Failing programs are kept in the
+# working directory as wrong<seed>.txt.
+#
+#   python3 oracle.py compiler [--first N] [--count N] [--depth N]
+#                              [--division] [-- compiler options...]
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+import generate
+import interp
+import listing
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('compiler')
+    parser.add_argument('--first', type=int, default=1)
+    parser.add_argument('--count', type=int, default=150)
+    parser.add_argument('--depth', type=int, default=3)
+    parser.add_argument('--division', action='store_true')
+    argv = sys.argv[1:]
+    split = argv.index('--') if '--' in argv else len(argv)
+    args = parser.parse_args(argv[:split])
+    options = argv[split + 1:]
+    generator = generate.DivisionGen if args.division else generate.Gen
+    compiler = os.path.abspath(args.compiler)
+
+    counts = {'ok': 0, 'wrong': 0, 'rejected': 0, 'fault': 0, 'skipped': 0}
+    executed = 0
+    with tempfile.TemporaryDirectory() as work:
+        source = os.path.join(work, 'program.txt')
+        for seed in range(args.first, args.first + args.count):
+            program = generator(seed, args.depth).program()
+            try:
+                want = interp.Interp(program).run().segment()
+            except RuntimeError:
+                counts['skipped'] += 1
+                continue
+            with open(source, 'w') as out:
+                out.write(program)
+            result = subprocess.run([compiler] + options + [source],
+                                    capture_output=True, text=True,
+                                    timeout=60)
+            if 'Good code' not in result.stdout + result.stderr:
+                counts['rejected'] += 1
+                print('rejected', seed)
+                continue
+            with open(os.path.join(work, 'program.lst')) as lst:
+                text = lst.read()
+            try:
+                segment, steps = listing.run(text)
+            except listing.Fault as e:
+                counts['fault'] += 1
+                print('fault', seed, e)
+                continue
+            executed += steps
+            if segment[:len(want)] == want:
+                counts['ok'] += 1
+            else:
+                counts['wrong'] += 1
+                print('wrong', seed)
+                with open('wrong%d.txt' % seed, 'w') as out:
+                    out.write(program)
+    print(' '.join('%s %d' % item for item in counts.items()),
+          'executed', executed)
+    return 0 if counts['ok'] + counts['skipped'] == args.count else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# Compiles the sample programs next to this script and checks the values
+# their listings leave in the globals. Each sample.txt comes with a
+# sample.expected that lists its globals in declaration order as
+# `name = value`. Samples only declare integer globals, so the nth of them
+# is the nth 4-byte word of the data segment. A line `instructions <= n`
+# also bounds how many instructions the listing may execute, for samples
+# that check code is left out rather than what it computes.
+#
+#   python3 samples.py compiler [sample...] [-- compiler options...]
+import glob
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+import listing
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def expected(path):
+    values, bound = [], None
+    with open(path) as lines:
+        for line in lines:
+            if line.startswith('instructions'):
+                bound = int(line.partition('<=')[2])
+            elif line.strip():
+                name, _, value = line.partition('=')
+                values.append((name.strip(), int(value)))
+    return values, bound
+
+
+def check(compiler, options, name, work):
+    source = os.path.join(work, name + '.txt')
+    shutil.copy(os.path.join(HERE, name + '.txt'), source)
+    result = subprocess.run([compiler] + options + [source],
+                            capture_output=True, text=True, timeout=60)
+    if 'Good code' not in result.stdout + result.stderr:
+        print('%s: rejected' % name)
+        print(result.stdout + result.stderr, end='')
+        return False
+    with open(os.path.join(work, name + '.lst')) as lst:
+        text = lst.read()
+    try:
+        segment, steps = listing.run(text)
+    except listing.Fault as e:
+        print('%s: fault: %s' % (name, e))
+        return False
+    want, bound = expected(os.path.join(HERE, name + '.expected'))
+    got = struct.unpack('<%di' % len(want), segment[:4 * len(want)])
+    wrong = [(variable, value, actual)
+             for (variable, value), actual in zip(want, got)
+             if value != actual]
+    for variable, value, actual in wrong:
+        print('%s: %s is %d, expected %d' % (name, variable, actual, value))
+    if bound is not None and steps > bound:
+        print('%s: %d instructions, expected at most %d' % (name, steps,
+                                                            bound))
+        return False
+    if not wrong:
+        print('%s: ok, %d instructions' % (name, steps))
+    return not wrong
+
+
+def main():
+    argv = sys.argv[1:]
+    split = argv.index('--') if '--' in argv else len(argv)
+    compiler = os.path.abspath(argv[0])
+    names = argv[1:split] or sorted(
+        os.path.basename(path)[:-len('.expected')]
+        for path in glob.glob(os.path.join(HERE, '*.expected')))
+    options = argv[split + 1:]
+    with tempfile.TemporaryDirectory() as work:
+        passed = [check(compiler, options, name, work) for name in names]
+    return 0 if all(passed) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,495 @@
+#include "constants.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// The two sides of a comparison
+using Comparison = std::pair<std::int64_t, std::int64_t>;
+
+// A result as the machine leaves it in 32 bits
+static auto wrapped(const std::int64_t value) -> std::int64_t {
+    return static_cast<std::int32_t>(static_cast<std::uint32_t>(value));
+}
+
+// Whether the jump is taken after `comparison`
+static auto jumps(const Opcode jump, const Comparison comparison) -> bool {
+    const auto [x, y] = comparison;
+    switch (jump) {
+    case Opcode::Jl:
+        return x < y;
+    case Opcode::Jg:
+        return x > y;
+    case Opcode::Je:
+        return x == y;
+    case Opcode::Jge:
+        return x >= y;
+    case Opcode::Jle:
+        return x <= y;
+    default:
+        return x != y;
+    }
+}
+
+static auto same(const Operand &x, const Operand &y) -> bool {
+    if (x.kind != y.kind) {
+        return false;
+    }
+    return x.kind == OperandKind::Real
+               ? std::bit_cast<std::uint32_t>(x.real) ==
+                     std::bit_cast<std::uint32_t>(y.real)
+               : x.value == y.value;
+}
+
+static auto integer(const std::optional<Operand> &value) -> bool {
+    return value && value->kind == OperandKind::Immediate;
+}
+
+// What arithmetic instruction `opcode` computes from `x` and `y`, if both are
+// known integers. A division the machine would fault on is left to fault.
+static auto evaluate(const Opcode opcode, const std::optional<Operand> &x,
+                     const std::optional<Operand> &y)
+    -> std::optional<Operand> {
+    if (!integer(x) || (opcode != Opcode::Neg && !integer(y))) {
+        return std::nullopt;
+    }
+    const auto a = x->value;
+    const auto b = opcode == Opcode::Neg ? 0 : y->value;
+    switch (opcode) {
+    case Opcode::Add:
+        return imm(wrapped(a + b));
+    case Opcode::Sub:
+        return imm(wrapped(a - b));
+    case Opcode::Imul:
+        return imm(wrapped(a * b));
+    case Opcode::Neg:
+        return imm(wrapped(-a));
+    case Opcode::Divide:
+        if (b == 0 || (a == std::numeric_limits<std::int32_t>::min() &&
+                       b == -1)) {
+            return std::nullopt;
+        }
+        return imm(a / b);
+    default:
+        return std::nullopt;
+    }
+}
+
+// Sets the offset of memory operand `operand` to `displacement`.
+static void displace(Operand &operand, const std::int64_t displacement) {
+    operand.sign = displacement < 0 ? '-' : displacement > 0 ? '+' : 0;
+    operand.value = displacement < 0 ? -displacement : displacement;
+}
+
+namespace {
+
+// What is known where a block starts: the cells that hold a constant, sorted,
+// and the comparison the flags were set by, if both its sides are known
+struct State {
+    bool reached = false;
+    std::vector<std::pair<std::uint32_t, Operand>> constants;
+    std::optional<Comparison> flags;
+};
+
+// Cells are the virtual registers, by number, and after them the slots.
+class Propagation {
+  public:
+    explicit Propagation(FlowGraph &graph)
+        : graph(graph), code(graph.code),
+          registers(static_cast<std::uint32_t>(graph.shared.size())) {}
+
+    void run() {
+        values.resize(registers);
+        stamps.resize(registers, 0);
+        solve();
+        for (std::size_t b = 0; b < graph.blocks.size(); ++b) {
+            if (states[b].reached && informed[b]) {
+                fold(b);
+            }
+        }
+    }
+
+  private:
+    FlowGraph &graph;
+    Code &code;
+    const std::uint32_t registers;
+    // The slots met so far, by base and offset, with the cell of each
+    using Slot = std::pair<std::uint64_t, std::uint32_t>;
+    std::vector<Slot> slots;
+    std::vector<State> states;
+    // Whether anything was known anywhere in each block the last time it was
+    // walked; nothing in the others can be folded.
+    std::vector<bool> informed;
+    // The value of each cell while a block is walked. It holds while the
+    // stamp of the cell is past `start`, and for a slot past `clobbered`
+    // too, which moves on whenever memory may change behind the analysis.
+    std::vector<Operand> values;
+    std::vector<std::uint64_t> stamps;
+    std::uint64_t clock = 0;
+    std::uint64_t start = 0;
+    std::uint64_t clobbered = 0;
+    // The cells given a value in the block that can outlive it
+    std::vector<std::uint32_t> touched;
+    std::optional<Comparison> flags;
+
+    // The cell of a slot, which it is given the first time it is met
+    auto slot(const Operand &operand) -> std::optional<std::uint32_t> {
+        if (!is_slot(operand)) {
+            return std::nullopt;
+        }
+        const auto wanted = slot_key(operand.reg, offset(operand));
+        const auto found =
+            std::ranges::lower_bound(slots, wanted, {}, &Slot::first);
+        if (found != slots.end() && found->first == wanted) {
+            return found->second;
+        }
+        const auto cell = static_cast<std::uint32_t>(values.size());
+        slots.insert(found, {wanted, cell});
+        values.emplace_back();
+        stamps.push_back(0);
+        return cell;
+    }
+
+    [[nodiscard]] auto get(const std::uint32_t cell) const
+        -> std::optional<Operand> {
+        if (stamps[cell] <= start ||
+            (cell >= registers && stamps[cell] <= clobbered)) {
+            return std::nullopt;
+        }
+        return values[cell];
+    }
+
+    void set(const std::uint32_t cell, const std::optional<Operand> &value) {
+        if (!value) {
+            stamps[cell] = 0;
+            return;
+        }
+        values[cell] = *value;
+        stamps[cell] = ++clock;
+        if (cell >= registers || graph.shared[cell]) {
+            touched.push_back(cell);
+        }
+    }
+
+    // The memory operand with its index folded into the offset, if the index
+    // is a known integer
+    [[nodiscard]] auto resolved(Operand operand) const -> Operand {
+        if ((operand.kind != OperandKind::Memory &&
+             operand.kind != OperandKind::BytePointer) ||
+            !is_virtual(operand.index)) {
+            return operand;
+        }
+        const auto index = get(number(operand.index));
+        if (!integer(index)) {
+            return operand;
+        }
+        displace(operand, offset(operand) + index->value * operand.scale);
+        operand.index = Register::None;
+        operand.scale = 1;
+        return operand;
+    }
+
+    [[nodiscard]] auto value(const Operand &operand)
+        -> std::optional<Operand> {
+        switch (operand.kind) {
+        case OperandKind::Immediate:
+        case OperandKind::Real:
+            return operand;
+        case OperandKind::Register:
+            if (is_virtual(operand.reg)) {
+                return get(number(operand.reg));
+            }
+            return std::nullopt;
+        case OperandKind::Memory:
+            if (const auto cell = slot(resolved(operand))) {
+                return get(*cell);
+            }
+            return std::nullopt;
+        default:
+            return std::nullopt;
+        }
+    }
+
+    // Writes `value` over `width` bytes at memory operand `operand`.
+    void store(const Operand &operand, const std::optional<Operand> &value,
+               const std::int64_t width) {
+        // A reference points into the data segment or into the frame of a
+        // caller, never into this one.
+        const auto reference =
+            operand.reg != Register::EBP && operand.reg != Register::EDI;
+        const auto base = reference ? Register::EBP : operand.reg;
+        using Offsets = std::numeric_limits<std::int32_t>;
+        auto low = slot_key(base, Offsets::min());
+        auto high = slot_key(base, Offsets::max()) + 1;
+        if (!reference && operand.index == Register::None) {
+            // The slots that overlap the bytes written
+            low = slot_key(base, offset(operand) - 3);
+            high = slot_key(base, offset(operand) + width);
+        }
+        for (auto it = std::ranges::lower_bound(slots, low, {}, &Slot::first);
+             it != slots.end() && it->first < high; ++it) {
+            stamps[it->second] = 0;
+        }
+        if (!reference && width == 4) {
+            if (const auto cell = slot(operand)) {
+                set(*cell, value);
+            }
+        }
+    }
+
+    // Gives the destination of an instruction its new value.
+    void define(const Operand &destination,
+                const std::optional<Operand> &value) {
+        if (destination.kind == OperandKind::Register &&
+            is_virtual(destination.reg)) {
+            set(number(destination.reg), value);
+        } else if (destination.kind == OperandKind::LowByte &&
+                   is_virtual(destination.reg)) {
+            set(number(destination.reg), std::nullopt);
+        } else if (destination.kind == OperandKind::Memory ||
+                   destination.kind == OperandKind::BytePointer) {
+            store(resolved(destination), std::nullopt, 4);
+        }
+    }
+
+    // Carries what is known past the instruction.
+    void step(const Instruction &instruction) {
+        const auto &[a, b, c] = instruction.operands;
+        switch (instruction.opcode) {
+        case Opcode::Li:
+            define(a, b);
+            break;
+        case Opcode::Mov:
+            if (a.kind == OperandKind::Memory ||
+                a.kind == OperandKind::BytePointer) {
+                const auto bytes = b.kind == OperandKind::LowByte ||
+                                   a.kind == OperandKind::BytePointer;
+                store(resolved(a),
+                      bytes ? std::nullopt : value(b), bytes ? 1 : 4);
+            } else {
+                define(a, value(b));
+            }
+            break;
+        case Opcode::Add:
+        case Opcode::Sub:
+        case Opcode::Imul:
+            flags.reset();
+            define(a, c.kind == OperandKind::None
+                          ? evaluate(instruction.opcode, value(a), value(b))
+                          : evaluate(instruction.opcode, value(b), value(c)));
+            break;
+        case Opcode::Neg:
+            flags.reset();
+            define(a, evaluate(Opcode::Neg, value(a), std::nullopt));
+            break;
+        case Opcode::Divide:
+            flags.reset();
+            define(a, evaluate(Opcode::Divide, value(a), value(b)));
+            break;
+        case Opcode::Cmp: {
+            const auto x = value(a);
+            const auto y = value(b);
+            if (integer(x) && integer(y)) {
+                flags = Comparison{x->value, y->value};
+            } else {
+                flags.reset();
+            }
+            break;
+        }
+        case Opcode::Call:
+            // The callee may write any variable and leaves the flags as it
+            // likes.
+            flags.reset();
+            clobbered = clock;
+            break;
+        default:
+            if (writes_first(instruction.opcode)) {
+                define(a, std::nullopt);
+            }
+            break;
+        }
+    }
+
+    // Starts walking a block from what is known where it starts.
+    void enter(const State &state) {
+        start = clobbered = clock;
+        touched.clear();
+        for (const auto &[cell, constant] : state.constants) {
+            set(cell, constant);
+        }
+        flags = state.flags;
+    }
+
+    // What is known where the walk of the block has got to, for the blocks
+    // it leads to
+    [[nodiscard]] auto leave() -> State {
+        State state;
+        state.reached = true;
+        std::ranges::sort(touched);
+        const auto [first, last] = std::ranges::unique(touched);
+        touched.erase(first, last);
+        for (const auto cell : touched) {
+            if (const auto constant = get(cell)) {
+                state.constants.emplace_back(cell, *constant);
+            }
+        }
+        state.flags = flags;
+        return state;
+    }
+
+    // Keeps only what `into` and `from` agree on; returns whether that is
+    // less than `into` knew.
+    static auto merge(State &into, const State &from) -> bool {
+        if (!into.reached) {
+            into = from;
+            return true;
+        }
+        std::size_t kept = 0;
+        auto other = from.constants.cbegin();
+        for (const auto &entry : into.constants) {
+            while (other != from.constants.cend() &&
+                   other->first < entry.first) {
+                ++other;
+            }
+            if (other != from.constants.cend() &&
+                other->first == entry.first &&
+                same(other->second, entry.second)) {
+                into.constants[kept++] = entry;
+            }
+        }
+        auto changed = kept != into.constants.size();
+        into.constants.resize(kept);
+        if (into.flags && into.flags != from.flags) {
+            into.flags.reset();
+            changed = true;
+        }
+        return changed;
+    }
+
+    // The blocks that block `b` goes on to, given the flags it ends with
+    [[nodiscard]] auto successors(const std::size_t b) const
+        -> std::array<std::size_t, 2> {
+        const auto &block = graph.blocks[b];
+        if (!block.branch) {
+            return {block.next, EXIT};
+        }
+        if (!flags) {
+            return {block.next, block.taken};
+        }
+        return {jumps(*block.branch, *flags) ? block.taken : block.next, EXIT};
+    }
+
+    void walk(const std::size_t b) {
+        const auto &block = graph.blocks[b];
+        enter(states[b]);
+        for (auto p = block.first; p < block.last; ++p) {
+            if (!graph.removed[p - graph.begin]) {
+                step(code[p]);
+            }
+        }
+    }
+
+    // Finds what is known where each block starts, following only the
+    // branches that can be taken. What is known only shrinks as more ways
+    // into a block are found, so this ends.
+    void solve() {
+        states.resize(graph.blocks.size());
+        informed.resize(graph.blocks.size(), false);
+        states[0].reached = true;
+        std::vector<std::size_t> work = {0};
+        std::vector<bool> queued(graph.blocks.size(), false);
+        queued[0] = true;
+        while (!work.empty()) {
+            const auto b = work.back();
+            work.pop_back();
+            queued[b] = false;
+            walk(b);
+            informed[b] = clock != start || states[b].flags;
+            const auto out = leave();
+            for (const auto s : successors(b)) {
+                if (s != EXIT && merge(states[s], out) && !queued[s]) {
+                    queued[s] = true;
+                    work.push_back(s);
+                }
+            }
+        }
+    }
+
+    // Replaces registers holding a known integer where an immediate can
+    // stand.
+    void substitute(Instruction &instruction) const {
+        for (auto &operand : instruction.operands) {
+            operand = resolved(operand);
+        }
+        const auto replace = [&](Operand &operand) {
+            if (operand.kind == OperandKind::Register &&
+                is_virtual(operand.reg)) {
+                if (const auto known = get(number(operand.reg));
+                    integer(known)) {
+                    operand = *known;
+                }
+            }
+        };
+        auto &[a, b, c] = instruction.operands;
+        switch (instruction.opcode) {
+        case Opcode::Add:
+        case Opcode::Sub:
+        case Opcode::Imul:
+            replace(c.kind == OperandKind::None ? b : c);
+            break;
+        case Opcode::Cmp:
+            replace(b);
+            break;
+        case Opcode::Push:
+            replace(a);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Puts what is known into the instructions of block `b` and decides its
+    // branch if the flags are known.
+    void fold(const std::size_t b) {
+        auto &block = graph.blocks[b];
+        const auto setter = graph.flag_setter(b);
+        enter(states[b]);
+        for (auto p = block.first; p < block.last; ++p) {
+            auto &instruction = code[p];
+            substitute(instruction);
+            step(instruction);
+            const auto &destination = instruction.operands[0];
+            if (instruction.opcode == Opcode::Li ||
+                !writes_first(instruction.opcode) ||
+                destination.kind != OperandKind::Register ||
+                !is_virtual(destination.reg) || p == setter) {
+                continue;
+            }
+            if (const auto known = get(number(destination.reg))) {
+                instruction = {Opcode::Li, {destination, *known}};
+            }
+        }
+        if (block.branch && flags) {
+            // A block after this one may still branch on the comparison.
+            const auto keep = graph.reads_flags(block.next) ||
+                              graph.reads_flags(block.taken);
+            if (jumps(*block.branch, *flags)) {
+                block.next = block.taken;
+            }
+            block.branch.reset();
+            block.taken = EXIT;
+            if (!keep && block.size != 0 &&
+                code[block.last - 1].opcode == Opcode::Cmp) {
+                graph.remove(block, block.last - 1);
+            }
+        }
+    }
+};
+
+} // namespace
+
+void propagate_constants(FlowGraph &graph) { Propagation(graph).run(); }
@@ -0,0 +1,15 @@
+#pragma once
+#include "cfg.hpp"
+
+// Conditional constant propagation over the blocks of a body. Where each block
+// starts, every virtual register and every scalar variable of the frame or the
+// data segment either holds a known constant or not; only the branches that
+// the constants leave open are followed to find out. Then:
+//
+// - A branch on a comparison of two constants becomes a jump, or nothing.
+// - An instruction whose result is known becomes an LI of it.
+// - A register known to hold an integer is replaced by the integer wherever
+//   an immediate can stand, and so is the index of a memory operand.
+//
+// Reals are carried through registers and variables but never computed with.
+void propagate_constants(FlowGraph &graph);
@@ -0,0 +1,190 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLAT_MAP_SSE2 1
+#endif
+
+// An open-addressing hash map from names to V in the style of a Swiss table.
+// Entries live in one vector in insertion order, which is also the order they
+// are iterated in. A separate index of one control byte and one entry number
+// per slot is probed a group of 16 slots at a time: the control byte holds
+// seven bits of the hash, so a lookup usually compares a single key and never
+// chases a pointer. Lookups take a string_view, and nothing is ever erased.
+template <typename V> class FlatMap {
+  public:
+    using value_type = std::pair<std::string, V>;
+    using iterator = typename std::vector<value_type>::iterator;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+
+    FlatMap() = default;
+
+    [[nodiscard]] inline auto size() const -> std::size_t {
+        return entries.size();
+    }
+
+    [[nodiscard]] inline auto empty() const -> bool { return entries.empty(); }
+
+    [[nodiscard]] inline auto begin() -> iterator { return entries.begin(); }
+
+    [[nodiscard]] inline auto end() -> iterator { return entries.end(); }
+
+    [[nodiscard]] inline auto begin() const -> const_iterator {
+        return entries.begin();
+    }
+
+    [[nodiscard]] inline auto end() const -> const_iterator {
+        return entries.end();
+    }
+
+    [[nodiscard]] auto find(const std::string_view key) -> iterator {
+        const auto found = probe(key, hash_of(key));
+        return found.present ? entries.begin() + found.entry : entries.end();
+    }
+
+    [[nodiscard]] auto find(const std::string_view key) const
+        -> const_iterator {
+        const auto found = probe(key, hash_of(key));
+        return found.present ? entries.begin() + found.entry : entries.end();
+    }
+
+    [[nodiscard]] inline auto contains(const std::string_view key) const
+        -> bool {
+        return find(key) != end();
+    }
+
+    // Inserts `value` under `key` unless the key is already there. Either way
+    // returns the entry for `key` and whether it was inserted.
+    auto try_emplace(const std::string_view key, V value)
+        -> std::pair<iterator, bool> {
+        if ((entries.size() + 1) * 8 > capacity() * 7) {
+            rehash(capacity() == 0 ? GROUP : capacity() * 2);
+        }
+        const auto hash = hash_of(key);
+        const auto found = probe(key, hash);
+        if (found.present) {
+            return {entries.begin() + found.entry, false};
+        }
+        control[found.slot] = static_cast<std::int8_t>(hash & 0x7f);
+        slots[found.slot] = static_cast<std::uint32_t>(entries.size());
+        entries.emplace_back(std::string(key), std::move(value));
+        return {entries.end() - 1, true};
+    }
+
+    // Entries per slot, or zero before the first insertion
+    [[nodiscard]] inline auto load_factor() const -> double {
+        return capacity() == 0 ? 0.0
+                               : static_cast<double>(entries.size()) /
+                                     static_cast<double>(capacity());
+    }
+
+    // Number of groups a lookup of `key` probes
+    [[nodiscard]] inline auto probe_length(const std::string_view key) const
+        -> std::size_t {
+        return probe(key, hash_of(key)).groups;
+    }
+
+    void reserve(const std::size_t count) {
+        entries.reserve(count);
+        auto wanted = std::bit_ceil(std::max<std::size_t>(GROUP, count));
+        while (count * 8 > wanted * 7) {
+            wanted *= 2;
+        }
+        if (wanted > capacity()) {
+            rehash(wanted);
+        }
+    }
+
+  private:
+    static constexpr std::size_t GROUP = 16;
+    static constexpr std::int8_t EMPTY = -128;
+
+    std::vector<value_type> entries;
+    // One control byte and one entry number per slot; the capacity is a power
+    // of two and a multiple of GROUP.
+    std::vector<std::int8_t> control;
+    std::vector<std::uint32_t> slots;
+
+    struct Probe {
+        bool present;
+        // The matching entry if present
+        std::size_t entry;
+        // Otherwise the free slot the key would go in
+        std::size_t slot;
+        // Groups looked at to find either
+        std::size_t groups;
+    };
+
+    [[nodiscard]] inline auto capacity() const -> std::size_t {
+        return control.size();
+    }
+
+    [[nodiscard]] static inline auto hash_of(const std::string_view key)
+        -> std::size_t {
+        return std::hash<std::string_view>{}(key);
+    }
+
+    // Bit i is set if control byte i of the group equals `byte`.
+    [[nodiscard]] static inline auto match(const std::int8_t *group,
+                                           const std::int8_t byte)
+        -> std::uint32_t {
+#ifdef FLAT_MAP_SSE2
+        const auto bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return static_cast<std::uint32_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(byte))));
+#else
+        std::uint32_t mask = 0;
+        for (std::size_t i = 0; i < GROUP; ++i) {
+            mask |= static_cast<std::uint32_t>(group[i] == byte) << i;
+        }
+        return mask;
+#endif
+    }
+
+    [[nodiscard]] auto probe(const std::string_view key,
+                             const std::size_t hash) const -> Probe {
+        if (capacity() == 0) {
+            return {false, 0, 0, 0};
+        }
+        const auto groups = capacity() / GROUP;
+        const auto h2 = static_cast<std::int8_t>(hash & 0x7f);
+        // Triangular steps visit every group once the table is a power of
+        // two groups wide.
+        auto group = (hash >> 7) & (groups - 1);
+        for (std::size_t step = 1;; ++step) {
+            const auto *bytes = control.data() + group * GROUP;
+            for (auto hits = match(bytes, h2); hits != 0; hits &= hits - 1) {
+                const auto slot = group * GROUP + std::countr_zero(hits);
+                if (entries[slots[slot]].first == key) {
+                    return {true, slots[slot], slot, step};
+                }
+            }
+            if (const auto free = match(bytes, EMPTY); free != 0) {
+                return {false, 0, group * GROUP + std::countr_zero(free),
+                        step};
+            }
+            group = (group + step) & (groups - 1);
+        }
+    }
+
+    void rehash(const std::size_t new_capacity) {
+        control.assign(new_capacity, EMPTY);
+        slots.assign(new_capacity, 0);
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            const auto hash = hash_of(entries[i].first);
+            const auto slot = probe(entries[i].first, hash).slot;
+            control[slot] = static_cast<std::int8_t>(hash & 0x7f);
+            slots[slot] = static_cast<std::uint32_t>(i);
+        }
+    }
+};
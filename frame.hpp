@@ -0,0 +1,101 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+
+// Where the variables of one scope live, kept up to date as they are declared
+// so that nothing has to walk the scope to size it.
+//
+// Globals go in the data segment that EBP points at, each at the next offset
+// aligned to its size. Procedures and functions get a frame around EDI, which
+// holds the saved EDI. Parameters sit above it, past the return address, one
+// 4-byte stack slot each, just as the caller pushed them. Locals sit below it.
+// They are only counted by alignment as they are declared; once all of them
+// are known, `place` hands out slots largest alignment first, so every slot is
+// naturally aligned with no padding in between.
+class FrameLayout {
+  public:
+    static constexpr std::uint64_t SLOT = 4;
+
+    // Returns the offset of a new parameter above EDI.
+    auto add_parameter(const std::uint64_t size) -> std::uint64_t {
+        const auto offset = 2 * SLOT + parameter_bytes;
+        parameter_bytes += align_up(size, SLOT);
+        return offset;
+    }
+
+    // Returns the offset of a new global above EBP.
+    auto add_global(const std::uint64_t size) -> std::uint64_t {
+        const auto offset = align_up(global_bytes, alignment(size));
+        global_bytes = offset + size;
+        return offset;
+    }
+
+    // Keeps the first `size` bytes above EBP for globals laid out elsewhere.
+    // Only valid before any global is added.
+    void reserve(const std::uint64_t size) {
+        global_bytes = std::max(global_bytes, size);
+    }
+
+    void add_local(const std::uint64_t size) {
+        local_bytes[size_class(size)] += size;
+    }
+
+    // Returns the offset below EDI of the next local of `size` bytes. Only
+    // valid once every local has been added, and each local is placed once.
+    auto place(const std::uint64_t size) -> std::uint64_t {
+        const auto cls = size_class(size);
+        // Bigger alignments come first, nearest EDI.
+        const auto base =
+            std::accumulate(local_bytes.cbegin() + cls + 1, local_bytes.cend(),
+                            std::uint64_t{0});
+        placed[cls] += size;
+        return base + placed[cls];
+    }
+
+    // Bytes of arguments the callee pops on return
+    [[nodiscard]] inline auto parameters_size() const -> std::uint64_t {
+        return parameter_bytes;
+    }
+
+    // Bytes of data segment taken by the globals
+    [[nodiscard]] inline auto globals_size() const -> std::uint64_t {
+        return global_bytes;
+    }
+
+    // Bytes to reserve below EDI for the locals, keeping ESP slot-aligned
+    [[nodiscard]] inline auto locals_size() const -> std::uint64_t {
+        return align_up(std::accumulate(local_bytes.cbegin(),
+                                        local_bytes.cend(), std::uint64_t{0}),
+                        SLOT);
+    }
+
+  private:
+    static constexpr std::size_t CLASSES = 4;
+
+    std::uint64_t parameter_bytes = 0;
+    std::uint64_t global_bytes = 0;
+    // Bytes of locals by alignment: 1, 2, 4 and 8
+    std::array<std::uint64_t, CLASSES> local_bytes{};
+    std::array<std::uint64_t, CLASSES> placed{};
+
+    [[nodiscard]] static inline auto align_up(const std::uint64_t value,
+                                              const std::uint64_t alignment)
+        -> std::uint64_t {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // The largest power of two up to 8 that divides `size`
+    [[nodiscard]] static inline auto alignment(const std::uint64_t size)
+        -> std::uint64_t {
+        return size == 0 ? 1 : std::min<std::uint64_t>(size & -size, 8);
+    }
+
+    [[nodiscard]] static inline auto size_class(const std::uint64_t size)
+        -> std::size_t {
+        const auto align = alignment(size);
+        return align == 1 ? 0 : align == 2 ? 1 : align == 4 ? 2 : 3;
+    }
+};
@@ -0,0 +1,426 @@
+#include "interface.hpp"
+#include "symtab.hpp"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert(std::endian::native == std::endian::little,
+              "unit interfaces are read in place as little-endian");
+
+MappedFile::MappedFile(const std::string &path) {
+#ifdef _WIN32
+    const auto handle =
+        CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER length;
+    if (handle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Bad code: cannot read " + path);
+    }
+    if (!GetFileSizeEx(handle, &length)) {
+        CloseHandle(handle);
+        throw std::runtime_error("Bad code: cannot read " + path);
+    }
+    size = static_cast<std::size_t>(length.QuadPart);
+    // An empty file cannot be mapped, and has nothing to read anyway.
+    if (size != 0) {
+        mapping =
+            CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) {
+            data = static_cast<const std::byte *>(
+                MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+    }
+    CloseHandle(handle);
+    if (size != 0 && !data) {
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        throw std::runtime_error("Bad code: cannot map " + path);
+    }
+#else
+    const auto fd = open(path.c_str(), O_RDONLY);
+    struct stat status {};
+    if (fd < 0) {
+        throw std::runtime_error("Bad code: cannot read " + path);
+    }
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        throw std::runtime_error("Bad code: cannot read " + path);
+    }
+    size = static_cast<std::size_t>(status.st_size);
+    // An empty file cannot be mapped, and has nothing to read anyway.
+    if (size != 0) {
+        const auto address =
+            mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Bad code: cannot map " + path);
+        }
+        data = static_cast<const std::byte *>(address);
+    }
+    // The mapping keeps the file open for as long as it needs to.
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+    }
+#else
+    if (data) {
+        munmap(const_cast<std::byte *>(data), size);
+    }
+#endif
+}
+
+void write_file(const std::string &path, const std::string_view data) {
+#ifdef _WIN32
+    const auto handle =
+        CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Bad code: cannot write " + path);
+    }
+    auto remaining = data;
+    while (!remaining.empty()) {
+        DWORD written = 0;
+        const auto chunk = static_cast<DWORD>(
+            std::min<std::size_t>(remaining.size(), 1U << 30));
+        if (!WriteFile(handle, remaining.data(), chunk, &written, nullptr)) {
+            CloseHandle(handle);
+            throw std::runtime_error("Bad code: cannot write " + path);
+        }
+        remaining.remove_prefix(written);
+    }
+    CloseHandle(handle);
+#else
+    const auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        throw std::runtime_error("Bad code: cannot write " + path);
+    }
+    auto remaining = data;
+    // A write may take less than it was given.
+    while (!remaining.empty()) {
+        const auto written = write(fd, remaining.data(), remaining.size());
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            close(fd);
+            throw std::runtime_error("Bad code: cannot write " + path);
+        }
+        remaining.remove_prefix(static_cast<std::size_t>(written));
+    }
+    if (close(fd) != 0) {
+        throw std::runtime_error("Bad code: cannot write " + path);
+    }
+#endif
+}
+
+// Whether `count` records of type T fit in the file at `offset`, aligned
+template <typename T>
+static auto fits(const std::uint64_t offset, const std::uint64_t count,
+                 const std::uint64_t file_size) -> bool {
+    return offset % alignof(T) == 0 && offset <= file_size &&
+           count <= (file_size - offset) / sizeof(T);
+}
+
+UnitInterface::UnitInterface(const std::string &path)
+    : file(path), file_path(path) {
+    const auto bytes = file.bytes();
+    const auto *base = bytes.data();
+    header = reinterpret_cast<const Header *>(base);
+    // Check what every lookup relies on, but nothing that would mean reading
+    // the whole file.
+    if (bytes.size() < sizeof(Header) ||
+        std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        header->file_size != bytes.size() ||
+        !std::has_single_bit(header->bucket_count) ||
+        !fits<std::uint32_t>(header->buckets, header->bucket_count,
+                             bytes.size()) ||
+        !fits<Symbol>(header->symbols, header->symbol_count, bytes.size()) ||
+        !fits<Parameter>(header->parameters, header->parameter_count,
+                         bytes.size()) ||
+        !fits<TypeRecord>(header->types, header->type_count, bytes.size()) ||
+        !fits<FieldRecord>(header->fields, header->field_count,
+                           bytes.size()) ||
+        header->names > bytes.size()) {
+        throw std::runtime_error("Bad code: " + path +
+                                 " is not a unit interface");
+    }
+    buckets = {reinterpret_cast<const std::uint32_t *>(base + header->buckets),
+               header->bucket_count};
+    symbols = {reinterpret_cast<const Symbol *>(base + header->symbols),
+               header->symbol_count};
+    all_parameters = {
+        reinterpret_cast<const Parameter *>(base + header->parameters),
+        header->parameter_count};
+    types = {reinterpret_cast<const TypeRecord *>(base + header->types),
+             header->type_count};
+    fields = {reinterpret_cast<const FieldRecord *>(base + header->fields),
+              header->field_count};
+}
+
+void UnitInterface::damaged() const {
+    throw std::runtime_error("Bad code: " + file_path + " is damaged");
+}
+
+auto UnitInterface::hash(const std::string_view name) -> std::uint32_t {
+    // FNV-1a, which is fixed, unlike std::hash
+    std::uint32_t hash = 2166136261u;
+    for (const auto c : name) {
+        hash = (hash ^ static_cast<std::uint8_t>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+auto UnitInterface::find(const std::string_view name) const
+    -> const Symbol * {
+    const auto wanted = hash(name);
+    auto next = buckets[wanted & (buckets.size() - 1)];
+    // A damaged file could chain round in a loop; no chain is longer than
+    // the number of symbols.
+    for (std::size_t steps = 0;
+         next != 0 && next <= symbols.size() && steps < symbols.size();
+         ++steps) {
+        const auto &symbol = symbols[next - 1];
+        if (symbol.hash == wanted && text(symbol.name) == name) {
+            return &symbol;
+        }
+        next = symbol.next;
+    }
+    return nullptr;
+}
+
+auto UnitInterface::parameters(const Symbol &symbol) const
+    -> std::span<const Parameter> {
+    if (symbol.first_parameter > all_parameters.size() ||
+        symbol.parameter_count >
+            all_parameters.size() - symbol.first_parameter) {
+        damaged();
+    }
+    return all_parameters.subspan(symbol.first_parameter,
+                                  symbol.parameter_count);
+}
+
+auto UnitInterface::text(const String &string) const -> std::string_view {
+    const auto bytes = file.bytes();
+    if (string.offset < header->names || string.offset > bytes.size() ||
+        string.length > bytes.size() - string.offset) {
+        damaged();
+    }
+    return {reinterpret_cast<const char *>(bytes.data() + string.offset),
+            string.length};
+}
+
+auto UnitInterface::import_type(const std::uint32_t type,
+                                TypeTable &table) const -> TypeId {
+    if (type < TypeTable::SCALARS) {
+        return type;
+    }
+    if (type - TypeTable::SCALARS >= types.size()) {
+        damaged();
+    }
+    const auto &record = types[type - TypeTable::SCALARS];
+    // Only ever looking back keeps a damaged file from sending this round in
+    // circles.
+    const auto part = [&](const std::uint32_t id) {
+        if (id >= type) {
+            damaged();
+        }
+        return import_type(id, table);
+    };
+    switch (static_cast<TypeKind>(record.kind)) {
+    case TypeKind::Subrange:
+        if (record.scalar > static_cast<std::uint8_t>(VarType::Real) ||
+            record.low > record.high) {
+            damaged();
+        }
+        return table.subrange(record.scalar, record.low, record.high);
+    case TypeKind::Array: {
+        const auto index = part(record.index);
+        if (table[index].kind != TypeKind::Subrange) {
+            damaged();
+        }
+        return table.array(index, part(record.element));
+    }
+    case TypeKind::Record: {
+        if (record.first_field > fields.size() ||
+            record.field_count > fields.size() - record.first_field) {
+            damaged();
+        }
+        std::vector<Field> members;
+        for (const auto &field :
+             fields.subspan(record.first_field, record.field_count)) {
+            members.push_back({.name = std::string(text(field.name)),
+                               .type = part(field.type),
+                               .offset = 0});
+        }
+        return table.record(std::move(members));
+    }
+    default:
+        damaged();
+    }
+}
+
+void write_unit_interface(const std::string &path, const Scope &global,
+                          const TypeTable &table) {
+    using Header = UnitInterface::Header;
+    using Symbol = UnitInterface::Symbol;
+    using Parameter = UnitInterface::Parameter;
+    using TypeRecord = UnitInterface::TypeRecord;
+    using FieldRecord = UnitInterface::FieldRecord;
+
+    std::vector<Symbol> symbols;
+    std::vector<Parameter> parameters;
+    std::vector<TypeRecord> types;
+    std::vector<FieldRecord> fields;
+    std::string names;
+    symbols.reserve(global.table.size());
+    // Offsets into `names` for now; the header size and the sections before
+    // it are added once they are known.
+    const auto name_of = [&](const std::string_view name) {
+        const auto string = UnitInterface::String{
+            static_cast<std::uint32_t>(names.size()),
+            static_cast<std::uint32_t>(name.size())};
+        names += name;
+        return string;
+    };
+    // Ids in the file of the types written so far
+    std::unordered_map<TypeId, std::uint32_t> written;
+    const std::function<std::uint32_t(TypeId)> type_of =
+        [&](const TypeId id) -> std::uint32_t {
+        if (id < TypeTable::SCALARS) {
+            return id;
+        }
+        if (const auto found = written.find(id); found != written.end()) {
+            return found->second;
+        }
+        const auto &type = table[id];
+        TypeRecord record{};
+        record.kind = static_cast<std::uint8_t>(type.kind);
+        if (type.kind == TypeKind::Subrange) {
+            record.scalar = static_cast<std::uint8_t>(*type.scalar);
+            record.low = static_cast<std::int32_t>(type.low);
+            record.high = static_cast<std::int32_t>(type.high);
+        } else if (type.kind == TypeKind::Array) {
+            record.index = type_of(type.index);
+            record.element = type_of(type.element);
+        } else {
+            std::vector<FieldRecord> members;
+            for (const auto &field : type.fields) {
+                members.push_back(
+                    {.name = name_of(field.name), .type = type_of(field.type)});
+            }
+            record.first_field = static_cast<std::uint32_t>(fields.size());
+            record.field_count = static_cast<std::uint32_t>(members.size());
+            fields.insert(fields.end(), members.cbegin(), members.cend());
+        }
+        const auto number =
+            static_cast<std::uint32_t>(TypeTable::SCALARS + types.size());
+        types.push_back(record);
+        written.emplace(id, number);
+        return number;
+    };
+    const auto add_signature = [&](Symbol &symbol,
+                                   const std::vector<::Parameter> &signature) {
+        symbol.first_parameter = static_cast<std::uint32_t>(parameters.size());
+        symbol.parameter_count = static_cast<std::uint32_t>(signature.size());
+        for (const auto &parameter : signature) {
+            auto &record = parameters.emplace_back();
+            record.name = name_of(parameter.name);
+            record.type = type_of(parameter.type);
+            record.pass_by_ref = parameter.pass_by_ref;
+            record.offset = static_cast<std::uint32_t>(parameter.offset);
+        }
+    };
+    for (const auto &[name, entry] : global.table) {
+        auto &symbol = symbols.emplace_back();
+        symbol.name = name_of(name);
+        symbol.hash = UnitInterface::hash(name);
+        symbol.kind = static_cast<std::uint8_t>(entry.index());
+        if (const auto var = std::get_if<VarData>(&entry)) {
+            symbol.type = type_of(var->type);
+            symbol.pass_by_ref = var->pass_by_ref;
+            symbol.size = static_cast<std::uint32_t>(var->size);
+            symbol.offset = static_cast<std::uint32_t>(var->offset);
+        } else if (const auto proc = std::get_if<ProcData>(&entry)) {
+            add_signature(symbol, proc->signature);
+        } else {
+            const auto &func = std::get<FuncData>(entry);
+            add_signature(symbol, func.signature);
+            symbol.result = static_cast<std::uint8_t>(func.result);
+        }
+    }
+
+    Header header{};
+    std::memcpy(header.magic, UnitInterface::MAGIC, sizeof(header.magic));
+    header.symbol_count = static_cast<std::uint32_t>(symbols.size());
+    header.bucket_count = static_cast<std::uint32_t>(
+        std::bit_ceil(std::max<std::size_t>(symbols.size(), 1)));
+    header.parameter_count = static_cast<std::uint32_t>(parameters.size());
+    header.type_count = static_cast<std::uint32_t>(types.size());
+    header.field_count = static_cast<std::uint32_t>(fields.size());
+    header.data_size = static_cast<std::uint32_t>(global.frame.globals_size());
+    header.buckets = sizeof(Header);
+    header.symbols = static_cast<std::uint32_t>(
+        header.buckets + header.bucket_count * sizeof(std::uint32_t));
+    header.parameters = static_cast<std::uint32_t>(
+        header.symbols + symbols.size() * sizeof(Symbol));
+    header.types = static_cast<std::uint32_t>(
+        header.parameters + parameters.size() * sizeof(Parameter));
+    header.fields = static_cast<std::uint32_t>(
+        header.types + types.size() * sizeof(TypeRecord));
+    header.names = static_cast<std::uint32_t>(
+        header.fields + fields.size() * sizeof(FieldRecord));
+    header.file_size = static_cast<std::uint32_t>(header.names + names.size());
+
+    std::vector<std::uint32_t> buckets(header.bucket_count, 0);
+    const auto relocate = [&](UnitInterface::String &string) {
+        string.offset += header.names;
+    };
+    for (std::uint32_t i = 0; i < symbols.size(); ++i) {
+        relocate(symbols[i].name);
+        auto &bucket = buckets[symbols[i].hash & (header.bucket_count - 1)];
+        symbols[i].next = bucket;
+        bucket = i + 1;
+    }
+    for (auto &parameter : parameters) {
+        relocate(parameter.name);
+    }
+    for (auto &field : fields) {
+        relocate(field.name);
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    out.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+    const auto write = [&](const auto *records, const std::size_t count) {
+        out.write(reinterpret_cast<const char *>(records),
+                  static_cast<std::streamsize>(count * sizeof(*records)));
+    };
+    write(&header, 1);
+    write(buckets.data(), buckets.size());
+    write(symbols.data(), symbols.size());
+    write(parameters.data(), parameters.size());
+    write(types.data(), types.size());
+    write(fields.data(), fields.size());
+    write(names.data(), names.size());
+}
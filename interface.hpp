@@ -0,0 +1,176 @@
+#pragma once
+#include "types.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+struct Scope;
+
+// A read-only view of a whole file mapped into memory
+class MappedFile {
+  public:
+    // Throws if the file cannot be opened or mapped.
+    explicit MappedFile(const std::string &path);
+    MappedFile(const MappedFile &) = delete;
+    auto operator=(const MappedFile &) -> MappedFile & = delete;
+    ~MappedFile();
+
+    [[nodiscard]] inline auto bytes() const -> std::span<const std::byte> {
+        return {data, size};
+    }
+
+  private:
+    const std::byte *data = nullptr;
+    std::size_t size = 0;
+#ifdef _WIN32
+    void *mapping = nullptr;
+#endif
+};
+
+// Replaces the file at `path` with `data`, handing all of it to the system
+// at once rather than through a stream buffer. Throws if it cannot.
+void write_file(const std::string &path, const std::string_view data);
+
+// The interface of a unit: the globals, procedures and functions declared at
+// the top level of a program, written by `--emit-interface` and read back by
+// the programs that use the unit.
+//
+// The file is its own index. Every reference in it is an offset from the start
+// of the file and every field a little-endian integer at its natural
+// alignment, so the mapped file is queried where it lies: a lookup hashes the
+// name, walks one bucket chain and returns a pointer into the mapping. Nothing
+// is read before it is asked for.
+//
+//   Header | buckets | symbols | parameters | types | fields | names
+//
+// A bucket holds one plus the index of the first symbol whose hash falls in
+// it, and each symbol one plus the index of the next; zero ends the chain.
+// Types are numbered as in a TypeTable: the scalars first, then the types in
+// the file in order, each after the types it is made of.
+class UnitInterface {
+  public:
+    static constexpr char MAGIC[4] = {'P', 'I', 'F', '2'};
+
+    struct Header {
+        char magic[4];
+        std::uint32_t symbol_count;
+        std::uint32_t bucket_count;
+        std::uint32_t parameter_count;
+        std::uint32_t type_count;
+        std::uint32_t field_count;
+        // Bytes of data segment taken by the unit's globals
+        std::uint32_t data_size;
+        std::uint32_t buckets;
+        std::uint32_t symbols;
+        std::uint32_t parameters;
+        std::uint32_t types;
+        std::uint32_t fields;
+        std::uint32_t names;
+        std::uint32_t file_size;
+    };
+
+    struct String {
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    // `kind` is an EntityKind and `result` a VarType. Variables have a
+    // `type`, a `size` and an `offset`, procedures and functions their
+    // parameters, and functions a `result`.
+    struct Symbol {
+        String name;
+        std::uint32_t hash;
+        std::uint32_t next;
+        std::uint8_t kind;
+        std::uint8_t pass_by_ref;
+        std::uint8_t result;
+        std::uint8_t reserved;
+        std::uint32_t type;
+        std::uint32_t size;
+        std::uint32_t offset;
+        std::uint32_t first_parameter;
+        std::uint32_t parameter_count;
+    };
+
+    struct Parameter {
+        String name;
+        std::uint32_t type;
+        std::uint8_t pass_by_ref;
+        std::uint8_t reserved[3];
+        std::uint32_t offset;
+    };
+
+    // A type other than a scalar. `kind` is a TypeKind. Subranges have a
+    // `scalar`, which is a VarType, and bounds; arrays an `index` and an
+    // `element`; records their fields.
+    struct TypeRecord {
+        std::uint8_t kind;
+        std::uint8_t scalar;
+        std::uint16_t reserved;
+        std::int32_t low;
+        std::int32_t high;
+        std::uint32_t index;
+        std::uint32_t element;
+        std::uint32_t first_field;
+        std::uint32_t field_count;
+    };
+
+    struct FieldRecord {
+        String name;
+        std::uint32_t type;
+    };
+
+    // Maps the interface at `path`. Throws if it cannot be read or is not a
+    // unit interface.
+    explicit UnitInterface(const std::string &path);
+
+    [[nodiscard]] inline auto path() const -> const std::string & {
+        return file_path;
+    }
+
+    [[nodiscard]] inline auto data_size() const -> std::uint64_t {
+        return header->data_size;
+    }
+
+    // Every symbol in the file, in no particular order
+    [[nodiscard]] inline auto declarations() const
+        -> std::span<const Symbol> {
+        return symbols;
+    }
+
+    // The symbol declared as `name`, or nullptr
+    [[nodiscard]] auto find(const std::string_view name) const
+        -> const Symbol *;
+
+    [[nodiscard]] auto parameters(const Symbol &symbol) const
+        -> std::span<const Parameter>;
+
+    [[nodiscard]] auto text(const String &string) const -> std::string_view;
+
+    // Makes type `type` of the file in `types`, along with the types it is
+    // made of, and returns its id there.
+    [[nodiscard]] auto import_type(const std::uint32_t type,
+                                   TypeTable &types) const -> TypeId;
+
+    [[nodiscard]] static auto hash(const std::string_view name)
+        -> std::uint32_t;
+
+  private:
+    MappedFile file;
+    std::string file_path;
+    const Header *header = nullptr;
+    std::span<const std::uint32_t> buckets;
+    std::span<const Symbol> symbols;
+    std::span<const Parameter> all_parameters;
+    std::span<const TypeRecord> types;
+    std::span<const FieldRecord> fields;
+
+    [[noreturn]] void damaged() const;
+};
+
+// Writes the declarations in `global`, the global scope of a program whose
+// types are in `types`, to `path` as a unit interface.
+void write_unit_interface(const std::string &path, const Scope &global,
+                          const TypeTable &types);
@@ -0,0 +1,185 @@
+#include "ir.hpp"
+#include <array>
+#include <charconv>
+#include <concepts>
+#include <string_view>
+
+auto Routine::named(const std::string &name) -> Operand {
+    names.push_back(name);
+    return label(LabelKind::Named, names.size() - 1);
+}
+
+auto Routine::block() -> Operand {
+    return label(LabelKind::Block, blocks++);
+}
+
+static constexpr std::array<std::string_view, 9> REGISTERS = {
+    "EAX", "EBX", "ECX", "EDX", "ESI", "EDI", "EBP", "ESP", ""};
+
+// In the order of Opcode
+static constexpr std::array<std::string_view, 26> MNEMONICS = {
+    "", "MOV", "mov", "MOVZX", "LEA", "ADD", "SUB", "IMUL", "NEG",
+    "CDQ", "IDIV", "DIVIDE", "CMP", "PUSH", "POP", "PUSHAD", "POPAD",
+    "CALL", "RET", "JMP", "JL", "JG", "JE", "JGE", "JLE", "JNE"};
+
+auto inverse(const Opcode jump) -> Opcode {
+    switch (jump) {
+    case Opcode::Jl:
+        return Opcode::Jge;
+    case Opcode::Jg:
+        return Opcode::Jle;
+    case Opcode::Je:
+        return Opcode::Jne;
+    case Opcode::Jge:
+        return Opcode::Jl;
+    case Opcode::Jle:
+        return Opcode::Jg;
+    case Opcode::Jne:
+        return Opcode::Je;
+    default:
+        return jump;
+    }
+}
+
+// Appends `value` as the listing writes numbers.
+template <typename T> static void append(std::string &out, const T value) {
+    char digits[32];
+    std::to_chars_result result;
+    if constexpr (std::floating_point<T>) {
+        result = std::to_chars(digits, digits + sizeof(digits), value,
+                               std::chars_format::general, 6);
+    } else {
+        result = std::to_chars(digits, digits + sizeof(digits), value);
+    }
+    out.append(digits, result.ptr);
+}
+
+static void print_label(std::string &out, const Routine &routine,
+                        const Label label) {
+    static constexpr std::array<std::string_view, 8> GENERATED = {
+        "if", "else", "endif", "while", "while", "endwhile", "or", "block"};
+    if (label.kind == LabelKind::Named) {
+        out += routine.names[label.number];
+        return;
+    }
+    out += routine.prefix;
+    out += GENERATED[static_cast<std::size_t>(label.kind)];
+    append(out, label.number);
+    if (label.kind == LabelKind::WhileBody) {
+        out += "inner";
+    }
+}
+
+static void print_register(std::string &out, const Register reg) {
+    // Only a listing printed before allocation has virtual registers.
+    if (is_virtual(reg)) {
+        out += 'V';
+        append(out, static_cast<std::uint32_t>(reg) -
+                        static_cast<std::uint32_t>(virtual_register(0)));
+        return;
+    }
+    out += REGISTERS[static_cast<std::size_t>(reg)];
+}
+
+static void print_operand(std::string &out, const Routine &routine,
+                          const Operand &operand) {
+    switch (operand.kind) {
+    case OperandKind::None:
+        break;
+    case OperandKind::Register:
+        print_register(out, operand.reg);
+        break;
+    case OperandKind::LowByte:
+        if (is_virtual(operand.reg)) {
+            print_register(out, operand.reg);
+            out += 'L';
+        } else if (operand.reg != Register::None) {
+            out += REGISTERS[static_cast<std::size_t>(operand.reg)][1];
+            out += 'L';
+        }
+        break;
+    case OperandKind::Immediate:
+        append(out, operand.value);
+        break;
+    case OperandKind::Real:
+        append(out, operand.real);
+        break;
+    case OperandKind::BytePointer:
+        out += "BYTE PTR ";
+        [[fallthrough]];
+    case OperandKind::Memory:
+        out += '[';
+        print_register(out, operand.reg);
+        if (operand.index != Register::None) {
+            out += " + ";
+            print_register(out, operand.index);
+            if (operand.scale != 1) {
+                out += '*';
+                append(out, operand.scale);
+            }
+        }
+        if (operand.sign) {
+            out += ' ';
+            out += operand.sign;
+            out += ' ';
+            append(out, operand.value);
+        }
+        out += ']';
+        break;
+    case OperandKind::Label:
+        print_label(out, routine, operand.label);
+        break;
+    }
+}
+
+void print(std::string &out, const Routine &routine) {
+    for (const auto &instruction : routine.code) {
+        if (instruction.opcode == Opcode::Label) {
+            print_label(out, routine, instruction.operands[0].label);
+            out += ":\n";
+            continue;
+        }
+        out += MNEMONICS[static_cast<std::size_t>(instruction.opcode)];
+        for (std::size_t i = 0;
+             i < 3 && instruction.operands[i].kind != OperandKind::None; ++i) {
+            out += i == 0 ? " " : ", ";
+            print_operand(out, routine, instruction.operands[i]);
+        }
+        out += '\n';
+    }
+}
+
+void print(std::string &out, const Listing &listing) {
+    const auto include = [&] {
+        for (const auto &unit : listing.uses) {
+            out += "#include \"" + unit + ".lst\"\n";
+        }
+    };
+    const auto main =
+        listing.main != 0 ? listing.main : listing.routines.size();
+    if (!listing.unit.empty()) {
+        // Included once however many units use the unit
+        out += "#ifndef PASCAL_UNIT_" + listing.unit + "\n" +
+               "#define PASCAL_UNIT_" + listing.unit + "\n";
+        include();
+        for (std::size_t i = 1; i < main; ++i) {
+            print(out, listing.routines[i]);
+        }
+        out += "#endif\n";
+        return;
+    }
+    out += "char data_segment[65536] = {0};\n"
+           "int main() {\n"
+           "_asm {\n";
+    for (std::size_t i = 0; i < listing.routines.size(); ++i) {
+        print(out, listing.routines[i]);
+        if (i == 0) {
+            include();
+        }
+    }
+    if (listing.complete) {
+        out += "}\n"
+               "return 0;\n"
+               "}\n";
+    }
+}
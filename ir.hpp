@@ -0,0 +1,243 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The code the parser generates, kept as instructions rather than text so
+// that later passes can look at it and rewrite it. Nothing is formatted until
+// the listing is printed.
+
+enum class Register : std::uint32_t {
+    EAX,
+    EBX,
+    ECX,
+    EDX,
+    ESI,
+    EDI,
+    EBP,
+    ESP,
+    None,
+};
+
+// Registers past the machine ones are virtual. Codegen takes a new one for
+// every value it computes, and allocate_registers replaces them all with
+// machine registers or spill slots before the listing is printed.
+[[nodiscard]] inline auto virtual_register(const std::uint32_t number)
+    -> Register {
+    return static_cast<Register>(static_cast<std::uint32_t>(Register::None) +
+                                 1 + number);
+}
+
+[[nodiscard]] inline auto is_virtual(const Register r) -> bool {
+    return r > Register::None;
+}
+
+// The number of a virtual register, counting from 0
+[[nodiscard]] inline auto number(const Register r) -> std::uint32_t {
+    return static_cast<std::uint32_t>(r) -
+           static_cast<std::uint32_t>(virtual_register(0));
+}
+
+enum class Opcode : std::uint8_t {
+    // Defines the label in the first operand
+    Label,
+    Mov,
+    // MOV of a literal into a register, which the listing writes in lower
+    // case
+    Li,
+    Movzx,
+    Lea,
+    Add,
+    Sub,
+    Imul,
+    Neg,
+    Cdq,
+    Idiv,
+    // Divides the first operand by the second, in place. Stands for the
+    // CDQ and IDIV around EAX that allocate_registers writes out once the
+    // registers are known.
+    Divide,
+    Cmp,
+    Push,
+    Pop,
+    Pushad,
+    Popad,
+    Call,
+    Ret,
+    Jmp,
+    Jl,
+    Jg,
+    Je,
+    Jge,
+    Jle,
+    Jne,
+};
+
+[[nodiscard]] inline auto is_conditional(const Opcode opcode) -> bool {
+    return opcode >= Opcode::Jl && opcode <= Opcode::Jne;
+}
+
+// The conditional jump taken exactly when `jump` is not
+[[nodiscard]] auto inverse(const Opcode jump) -> Opcode;
+
+// The instruction writes its first operand.
+[[nodiscard]] inline auto writes_first(const Opcode opcode) -> bool {
+    switch (opcode) {
+    case Opcode::Mov:
+    case Opcode::Li:
+    case Opcode::Movzx:
+    case Opcode::Lea:
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::Imul:
+    case Opcode::Neg:
+    case Opcode::Pop:
+    case Opcode::Divide:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The labels generated for control flow, numbered per routine, and the
+// named ones of procedures, functions and the main program
+enum class LabelKind : std::uint8_t {
+    If,
+    Else,
+    Endif,
+    While,
+    WhileBody,
+    EndWhile,
+    Or,
+    // Given to a block of code that had no label when a jump to it is laid
+    // out
+    Block,
+    // `number` indexes the names of the routine.
+    Named,
+};
+
+struct Label {
+    LabelKind kind;
+    std::uint32_t number;
+
+    friend auto operator==(const Label &, const Label &) -> bool = default;
+};
+
+enum class OperandKind : std::uint8_t {
+    None,
+    Register,
+    // The low byte of a register, such as AL
+    LowByte,
+    Immediate,
+    Real,
+    // [reg + index*scale ± value]
+    Memory,
+    // The same, as BYTE PTR
+    BytePointer,
+    Label,
+};
+
+struct Operand {
+    OperandKind kind = OperandKind::None;
+    // The register, or the base of a memory operand
+    Register reg = Register::None;
+    // Memory operands only: a register added to the base times `scale`, and
+    // the sign of the offset in `value`, or 0 to leave the offset out
+    Register index = Register::None;
+    std::uint8_t scale = 1;
+    char sign = 0;
+    union {
+        std::int64_t value = 0;
+        float real;
+        ::Label label;
+    };
+};
+
+[[nodiscard]] inline auto reg(const Register r) -> Operand {
+    Operand operand;
+    operand.kind = OperandKind::Register;
+    operand.reg = r;
+    return operand;
+}
+
+[[nodiscard]] inline auto low_byte(const Register r) -> Operand {
+    auto operand = reg(r);
+    operand.kind = OperandKind::LowByte;
+    return operand;
+}
+
+[[nodiscard]] inline auto imm(const std::int64_t value) -> Operand {
+    Operand operand;
+    operand.kind = OperandKind::Immediate;
+    operand.value = value;
+    return operand;
+}
+
+[[nodiscard]] inline auto real(const float value) -> Operand {
+    Operand operand;
+    operand.kind = OperandKind::Real;
+    operand.real = value;
+    return operand;
+}
+
+[[nodiscard]] inline auto mem(const Register base, const char sign = 0,
+                              const std::int64_t offset = 0) -> Operand {
+    Operand operand;
+    operand.kind = OperandKind::Memory;
+    operand.reg = base;
+    operand.sign = sign;
+    operand.value = offset;
+    return operand;
+}
+
+[[nodiscard]] inline auto label(const LabelKind kind,
+                                const std::uint64_t number) -> Operand {
+    Operand operand;
+    operand.kind = OperandKind::Label;
+    operand.label = {kind, static_cast<std::uint32_t>(number)};
+    return operand;
+}
+
+struct Instruction {
+    Opcode opcode;
+    Operand operands[3] = {};
+};
+
+using Code = std::vector<Instruction>;
+
+// The code of one top-level procedure or function, or of the main program.
+// Generated labels are printed after `prefix`, so that routines parsed on
+// different threads never define the same one.
+struct Routine {
+    std::string prefix;
+    std::vector<std::string> names;
+    Code code;
+    // Block labels handed out so far
+    std::uint32_t blocks = 0;
+
+    // A label for `name`, printed as it is
+    auto named(const std::string &name) -> Operand;
+
+    // A new label of kind Block
+    auto block() -> Operand;
+};
+
+// Everything the listing holds, in order: how the program starts, its
+// procedures and functions, then from routine `main` on the main program.
+// `complete` once the main program has ended, which closes the assembly block
+// and main(). The listings of the units in `uses` are included after the
+// start. The listing of a unit, which `unit` names, holds only its procedures
+// and functions and the units it uses, for the listings of programs that use
+// it to include.
+struct Listing {
+    std::vector<Routine> routines;
+    bool complete = false;
+    std::size_t main = 0;
+    std::vector<std::string> uses;
+    std::string unit;
+};
+
+// Append the routine, or the whole listing, as text to `out`.
+void print(std::string &out, const Routine &routine);
+void print(std::string &out, const Listing &listing);
@@ -4,19 +4,48 @@
 Lexer::Lexer(const std::string &file) {
     std::ifstream in(file);
     in.exceptions(std::ifstream::badbit);
+    // Read the whole file up front; seeking back one character per token
+    // through the stream costs a system call each time.
+    const std::string source{std::istreambuf_iterator<char>(in),
+                             std::istreambuf_iterator<char>()};
+    this->scan(source, SourcePosition{});
+}
+
+Lexer::Lexer(const std::string_view source, const SourcePosition start) {
+    this->scan(source, start);
+}
+
+void Lexer::scan(const std::string_view source, const SourcePosition start) {
     DfaState prev_state = DfaState::Whitespace;
     DfaState state = DfaState::Whitespace;
     std::string str;
+    std::size_t pos = 0;
+    // Where the next character sits and where the pending token began
+    SourcePosition here = start;
+    SourcePosition token_start = start;
+    bool started = false;
     this->token_count = 0;
     while (true) {
-        auto pos = in.tellg();
-        std::uint8_t c = 0;
-        in >> std::noskipws >> c;
+        const std::uint8_t c = pos < source.size() ? source[pos] : 0;
+        // Two dots make a range, which the table would take for the start of
+        // a real: 1..10 is 1, .. and 10, not 1. and .10.
+        const auto range =
+            c == '.' && pos + 1 < source.size() && source[pos + 1] == '.';
+        if (range && state == DfaState::Whitespace) {
+            Token token;
+            token.emplace<3>("..");
+            this->push_token(token, here);
+            pos += 2;
+            here.offset += 2;
+            here.column += 2;
+            str.clear();
+            started = false;
+            continue;
+        }
         // Figure out what we've got
         if (STATE_TBL[c][static_cast<std::uint64_t>(state)] ==
                 DfaState::Accept ||
-            !c) {
-            in.seekg(pos);
+            !c || range) {
             if (!trim(str).empty()) {
                 Token token;
                 switch (state) {
@@ -47,15 +76,16 @@ Lexer::Lexer(const std::string &file) {
                        << unsigned(STATE_TBL[unsigned(c)][unsigned(state)])
                        << " from state " << unsigned(state) << std::endl
                        << "Character code found: " << unsigned(c);
-                    throw std::runtime_error(ss.str());
+                    throw ParseError(ss.str(), token_start);
                 } break;
                 }
-                this->push_token(token);
+                this->push_token(token, token_start);
             }
             if (c == 0) {
                 break;
             }
             str.clear();
+            started = false;
             prev_state = DfaState::Whitespace;
             state = DfaState::Whitespace;
             continue;
@@ -63,7 +93,7 @@ Lexer::Lexer(const std::string &file) {
         if (STATE_TBL[c][static_cast<std::uint64_t>(state)] ==
             DfaState::Error) {
             std::stringstream ss;
-            ss << "Invalid token at position " << in.tellg()
+            ss << "Invalid token at position " << here.offset + 1
                << ": was parsing char " << unsigned(c) << " in state "
                << unsigned(state) << "; got " << str
                << "\nTransitional state: " << unsigned(c)
@@ -71,15 +101,32 @@ Lexer::Lexer(const std::string &file) {
                << unsigned(STATE_TBL[c][static_cast<std::uint64_t>(state)])
                << " from state " << unsigned(prev_state) << " and "
                << unsigned(state);
-            throw std::runtime_error(ss.str());
+            throw ParseError(ss.str(), here);
         } else {
+            if (!started &&
+                WHITESPACE.find(static_cast<char>(c)) == std::string::npos) {
+                token_start = here;
+                started = true;
+            }
             str += static_cast<unsigned char>(c);
             prev_state = state;
             state = STATE_TBL[c][static_cast<std::uint64_t>(state)];
+            pos++;
+            here.offset++;
+            if (c == '\n') {
+                here.line++;
+                here.column = 0;
+            } else {
+                here.column++;
+            }
         }
     }
 }
 
+Lexer::Lexer(std::deque<Token> tokens, std::deque<SourcePosition> positions)
+    : tokens(std::move(tokens)), positions(std::move(positions)),
+      token_count(this->tokens.size()) {}
+
 auto Lexer::get_token() -> std::optional<Token> {
     if (this->tokens.empty()) {
         return std::nullopt;
@@ -87,6 +134,10 @@ auto Lexer::get_token() -> std::optional<Token> {
 
     auto tok = this->tokens.front();
     this->tokens.pop_front();
+    if (!this->positions.empty()) {
+        this->current = this->positions.front();
+        this->positions.pop_front();
+    }
     return tok;
 }
 
@@ -94,7 +145,14 @@ auto Lexer::number_of_tokens() const -> std::tuple<std::size_t, std::size_t> {
     return {this->token_count, this->tokens.size()};
 }
 
+auto Lexer::position() const -> SourcePosition { return this->current; }
+
 void Lexer::push_token(const Token &tok) {
     this->tokens.push_back(tok);
     this->token_count = this->tokens.size();
 }
+
+void Lexer::push_token(const Token &tok, const SourcePosition position) {
+    this->push_token(tok);
+    this->positions.push_back(position);
+}
@@ -7,16 +7,36 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <variant>
 
 using Token = std::variant<std::string, std::string, std::string, std::string,
                            std::string>;
 
+// Where a token starts in the source. Lines and columns count from zero, the
+// way editors speaking the language server protocol expect them.
+struct SourcePosition {
+    std::size_t offset = 0;
+    std::uint32_t line = 0;
+    std::uint32_t column = 0;
+};
+
+// An error raised while lexing or parsing, tagged with the position of the
+// token that caused it.
+class ParseError : public std::runtime_error {
+  public:
+    ParseError(const std::string &message, const SourcePosition position)
+        : std::runtime_error(message), position(position) {}
+
+    SourcePosition position;
+};
+
 enum class DfaState : std::uint64_t {
     Whitespace,
     Letter,
@@ -38,6 +58,8 @@ enum class DfaState : std::uint64_t {
 class Lexer {
   private:
     std::deque<Token> tokens;
+    std::deque<SourcePosition> positions;
+    SourcePosition current;
     const std::string WHITESPACE = " \n\r\t\f\v";
     std::size_t token_count;
 
@@ -53,9 +75,17 @@ class Lexer {
 
     inline std::string trim(const std::string &s) { return rtrim(ltrim(s)); }
 
+    void scan(const std::string_view source, const SourcePosition start);
+
   public:
     Lexer(const std::string &file);
+    // Lexes text held in memory, numbering positions from `start`
+    Lexer(const std::string_view source, const SourcePosition start);
+    Lexer(std::deque<Token> tokens, std::deque<SourcePosition> positions);
     auto get_token() -> std::optional<Token>;
+    // Position of the token most recently returned by get_token()
+    auto position() const -> SourcePosition;
     auto number_of_tokens() const -> std::tuple<std::size_t, std::size_t>;
     void push_token(const Token &tok);
+    void push_token(const Token &tok, const SourcePosition position);
 };
@@ -0,0 +1,398 @@
+#include "liveness.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <utility>
+#include <vector>
+
+static constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+
+// The instruction can leave its destination unread, which makes it dead
+// with it.
+static auto pure(const Opcode opcode) -> bool {
+    switch (opcode) {
+    case Opcode::Li:
+    case Opcode::Mov:
+    case Opcode::Movzx:
+    case Opcode::Lea:
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::Imul:
+    case Opcode::Neg:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The instruction reads its destination as well as writing it.
+static auto modifies(const Instruction &instruction) -> bool {
+    switch (instruction.opcode) {
+    case Opcode::Neg:
+    case Opcode::Divide:
+        return true;
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::Imul:
+        return instruction.operands[2].kind == OperandKind::None;
+    default:
+        return false;
+    }
+}
+
+// How many bytes a memory operand reads, or a store writes
+static auto width(const Operand &memory, const Operand &value) -> std::int64_t {
+    return memory.kind == OperandKind::BytePointer ||
+                   value.kind == OperandKind::LowByte
+               ? 1
+               : 4;
+}
+
+namespace {
+
+// A set of numbers below some bound, a bit each
+class Bits {
+  public:
+    explicit Bits(const std::size_t size = 0) : words((size + 63) / 64, 0) {}
+
+    [[nodiscard]] auto test(const std::size_t i) const -> bool {
+        return (words[i / 64] >> (i % 64) & 1) != 0;
+    }
+
+    void set(const std::size_t i) {
+        words[i / 64] |= std::uint64_t{1} << (i % 64);
+    }
+
+    void reset(const std::size_t i) {
+        words[i / 64] &= ~(std::uint64_t{1} << (i % 64));
+    }
+
+    // Adds `first` up to `last`.
+    void fill(const std::size_t first, const std::size_t last) {
+        for (auto i = first; i < last && i % 64 != 0; ++i) {
+            set(i);
+        }
+        auto w = (first + 63) / 64;
+        for (; (w + 1) * 64 <= last; ++w) {
+            words[w] = ~std::uint64_t{0};
+        }
+        for (auto i = std::max(first, w * 64); i < last; ++i) {
+            set(i);
+        }
+    }
+
+    // Adds what `other` holds; returns whether that added anything.
+    auto merge(const Bits &other) -> bool {
+        auto grew = false;
+        for (std::size_t w = 0; w < words.size(); ++w) {
+            grew = grew || (other.words[w] & ~words[w]) != 0;
+            words[w] |= other.words[w];
+        }
+        return grew;
+    }
+
+  private:
+    std::vector<std::uint64_t> words;
+};
+
+class Liveness {
+  public:
+    Liveness(FlowGraph &graph, const std::optional<Operand> &result)
+        : graph(graph), code(graph.code), result(result),
+          index(graph.shared.size(), NONE), alive(graph.shared.size(), 0) {}
+
+    auto run() -> std::uint64_t {
+        collect();
+        solve();
+        for (std::size_t b = 0; b < graph.blocks.size(); ++b) {
+            walk(b, out[b], true);
+        }
+        return stores;
+    }
+
+  private:
+    FlowGraph &graph;
+    Code &code;
+    const std::optional<Operand> &result;
+    // The bytes of variables named by a fixed offset, as slot keys in order,
+    // and then the shared registers, each by its place in the bits
+    std::vector<std::uint64_t> bytes;
+    std::vector<std::uint32_t> index;
+    std::size_t size = 0;
+    // Some instruction takes the address of a variable of the frame.
+    bool escapes = false;
+    // What is live where each block ends, and where the body does
+    std::vector<Bits> out;
+    Bits ending;
+    // Registers only one block names that are read after the instruction
+    // being walked, for those stamped with `generation`
+    std::vector<std::uint64_t> alive;
+    std::uint64_t generation = 0;
+    std::uint64_t stores = 0;
+
+    // The places of all the bytes off `base`
+    [[nodiscard]] auto range(const Register base) const
+        -> std::pair<std::size_t, std::size_t> {
+        const auto first = static_cast<std::uint64_t>(base) << 32;
+        const auto at = [&](const std::uint64_t key) {
+            return static_cast<std::size_t>(
+                std::ranges::lower_bound(bytes, key) - bytes.begin());
+        };
+        return {at(first), at(first + (std::uint64_t{1} << 32))};
+    }
+
+    // Calls `visit` with the place of each byte `width` bytes from `memory`
+    // covers that the bits hold.
+    template <typename F>
+    void each_byte(const Operand &memory, const std::int64_t width,
+                   F &&visit) const {
+        // The keys of the bytes of a variable follow each other.
+        const auto key = slot_key(memory.reg, offset(memory));
+        auto p = static_cast<std::size_t>(
+            std::ranges::lower_bound(bytes, key) - bytes.begin());
+        for (; p < bytes.size() &&
+               bytes[p] < key + static_cast<std::uint64_t>(width);
+             ++p) {
+            visit(p);
+        }
+    }
+
+    void collect() {
+        // Each variable named, by the key of its first byte and its width
+        std::vector<std::pair<std::uint64_t, std::int64_t>> named;
+        for (auto p = graph.begin; p < code.size(); ++p) {
+            const auto &instruction = code[p];
+            const auto &[a, b, c] = instruction.operands;
+            for (std::size_t i = 0; i < 3; ++i) {
+                const auto &operand = instruction.operands[i];
+                if (is_slot(operand)) {
+                    named.emplace_back(slot_key(operand.reg, offset(operand)),
+                                       width(operand, i == 0 ? b : Operand{}));
+                }
+                if (i > 0 && operand.kind == OperandKind::Register &&
+                    operand.reg == Register::EDI) {
+                    escapes = true;
+                }
+            }
+            if (instruction.opcode == Opcode::Lea &&
+                b.reg == Register::EDI) {
+                escapes = true;
+            }
+        }
+        std::ranges::sort(named);
+        named.erase(std::ranges::unique(named).begin(), named.end());
+        for (const auto &[key, bytes_named] : named) {
+            for (std::int64_t at = 0; at < bytes_named; ++at) {
+                bytes.push_back(key + static_cast<std::uint64_t>(at));
+            }
+        }
+        // Only where variables of different widths overlap
+        if (!std::ranges::is_sorted(bytes)) {
+            std::ranges::sort(bytes);
+        }
+        bytes.erase(std::ranges::unique(bytes).begin(), bytes.end());
+        size = bytes.size();
+        for (std::uint32_t r = 0; r < graph.shared.size(); ++r) {
+            if (graph.shared[r]) {
+                index[r] = static_cast<std::uint32_t>(size++);
+            }
+        }
+        ending = Bits(size);
+        const auto [first, last] = range(Register::EBP);
+        ending.fill(first, last);
+        if (result) {
+            each_byte(*result, width(*result, {}),
+                      [&](const std::size_t p) { ending.set(p); });
+        }
+    }
+
+    // Finds what is live where each block ends. Each block is walked once,
+    // last to first, and again whenever what is live after it grows.
+    void solve() {
+        const auto count = graph.blocks.size();
+        // The blocks leading to each, block `b` taking those from
+        // `first[b]` up to `first[b + 1]` in `leading`
+        std::vector<std::size_t> first(count + 1, 0);
+        std::vector<std::size_t> leading;
+        const auto successors = [&](const Block &block, auto &&visit) {
+            if (block.next != EXIT) {
+                visit(block.next);
+            }
+            if (block.branch && block.taken != EXIT) {
+                visit(block.taken);
+            }
+        };
+        for (const auto &block : graph.blocks) {
+            successors(block, [&](const std::size_t s) { first[s + 1]++; });
+        }
+        for (std::size_t b = 0; b < count; ++b) {
+            first[b + 1] += first[b];
+        }
+        leading.resize(first[count]);
+        auto filled = first;
+        for (std::size_t b = 0; b < count; ++b) {
+            successors(graph.blocks[b], [&](const std::size_t s) {
+                leading[filled[s]++] = b;
+            });
+        }
+
+        out.assign(count, Bits(size));
+        std::vector<Bits> in(count, Bits(size));
+        std::vector<std::size_t> work(count);
+        std::vector<bool> waiting(count, true);
+        for (std::size_t b = 0; b < count; ++b) {
+            work[b] = b;
+        }
+        Bits live;
+        while (!work.empty()) {
+            const auto b = work.back();
+            work.pop_back();
+            waiting[b] = false;
+            const auto &block = graph.blocks[b];
+            out[b].merge(block.next == EXIT ? ending : in[block.next]);
+            if (block.branch) {
+                out[b].merge(block.taken == EXIT ? ending : in[block.taken]);
+            }
+            live = out[b];
+            walk(b, live, false);
+            if (!in[b].merge(live)) {
+                continue;
+            }
+            for (auto l = first[b]; l < first[b + 1]; ++l) {
+                if (!waiting[leading[l]]) {
+                    waiting[leading[l]] = true;
+                    work.push_back(leading[l]);
+                }
+            }
+        }
+    }
+
+    // Walks block `b` from its end, taking `live` from what is live there
+    // back to what is live where it starts. Leaves out dead instructions if
+    // `eliminating`, and otherwise only passes over them.
+    void walk(const std::size_t b, Bits &live, const bool eliminating) {
+        auto &block = graph.blocks[b];
+        const auto setter = graph.flag_setter(b);
+        generation++;
+        for (auto p = block.last; p-- > block.first;) {
+            if (graph.removed[p - graph.begin]) {
+                continue;
+            }
+            if (dead(p, live, setter)) {
+                if (eliminating) {
+                    graph.remove(block, p);
+                    stores += writes_first(code[p].opcode) &&
+                                      is_slot(code[p].operands[0])
+                                  ? 1
+                                  : 0;
+                }
+                continue;
+            }
+            step(code[p], live);
+        }
+    }
+
+    [[nodiscard]] auto read_later(const Register r, const Bits &live) const
+        -> bool {
+        return index[number(r)] != NONE ? live.test(index[number(r)])
+                                        : alive[number(r)] == generation;
+    }
+
+    // Whether the instruction at `p` only writes what nothing reads
+    [[nodiscard]] auto dead(const std::size_t p, const Bits &live,
+                            const std::size_t setter) const -> bool {
+        const auto &instruction = code[p];
+        const auto &[a, b, c] = instruction.operands;
+        if (!writes_first(instruction.opcode) || p == setter) {
+            return false;
+        }
+        if (a.kind == OperandKind::Register && is_virtual(a.reg)) {
+            return pure(instruction.opcode) && !read_later(a.reg, live);
+        }
+        if (instruction.opcode != Opcode::Mov || !is_slot(a)) {
+            return false;
+        }
+        auto read = false;
+        each_byte(a, width(a, b), [&](const std::size_t byte) {
+            read = read || live.test(byte);
+        });
+        return !read;
+    }
+
+    // Takes what is live after the instruction back to before it.
+    void step(const Instruction &instruction, Bits &live) {
+        const auto &[a, b, c] = instruction.operands;
+        const auto read = [&](const Register r) {
+            if (index[number(r)] != NONE) {
+                live.set(index[number(r)]);
+            } else {
+                alive[number(r)] = generation;
+            }
+        };
+        const auto load = [&](const Operand &memory, const std::int64_t width) {
+            each_virtual(memory, read);
+            if (is_slot(memory)) {
+                each_byte(memory, width,
+                          [&](const std::size_t p) { live.set(p); });
+                return;
+            }
+            // Indexed off a base, which may reach any variable off it, or
+            // through a reference, which only reaches the data segment
+            const auto [first, last] = range(memory.reg == Register::EDI
+                                                 ? Register::EDI
+                                                 : Register::EBP);
+            live.fill(first, last);
+        };
+        const auto memory = [](const Operand &operand) {
+            return operand.kind == OperandKind::Memory ||
+                   operand.kind == OperandKind::BytePointer;
+        };
+
+        if (instruction.opcode == Opcode::Call) {
+            const auto [first, last] = range(Register::EBP);
+            live.fill(first, last);
+            if (escapes) {
+                const auto [low, high] = range(Register::EDI);
+                live.fill(low, high);
+            }
+        }
+        if (writes_first(instruction.opcode) && memory(a)) {
+            // Only a store of a whole variable is sure to overwrite it.
+            if (instruction.opcode == Opcode::Mov && is_slot(a)) {
+                each_byte(a, width(a, b),
+                          [&](const std::size_t p) { live.reset(p); });
+            }
+            each_virtual(a, read);
+        } else if (writes_first(instruction.opcode) &&
+                   a.kind == OperandKind::Register && is_virtual(a.reg) &&
+                   !modifies(instruction)) {
+            if (index[number(a.reg)] != NONE) {
+                live.reset(index[number(a.reg)]);
+            } else {
+                alive[number(a.reg)] = 0;
+            }
+        } else if (memory(a)) {
+            load(a, width(a, b));
+        } else {
+            each_virtual(a, read);
+        }
+        for (const auto &operand : {b, c}) {
+            if (!memory(operand)) {
+                each_virtual(operand, read);
+            } else if (instruction.opcode == Opcode::Lea) {
+                each_virtual(operand, read);
+            } else {
+                load(operand, width(operand, {}));
+            }
+        }
+    }
+};
+
+} // namespace
+
+auto eliminate_dead_code(FlowGraph &graph, const std::optional<Operand> &result)
+    -> std::uint64_t {
+    return Liveness(graph, result).run();
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "cfg.hpp"
+#include <cstdint>
+#include <optional>
+
+// Liveness over the blocks of a body, solved backwards from where it ends:
+// each byte of a variable of the frame or the data segment that an instruction
+// names by a fixed offset, and each virtual register more than one block
+// names, is live where some path still reads it before writing it again. Then:
+//
+// - A store to a variable whose bytes are not live is left out.
+// - So is what computes a register that is not live, as is a register that
+//   only its own block names where nothing after it in the block reads it.
+//
+// An instruction that is left out reads nothing, so what only it read is dead
+// too. Variables of the data segment are live where the body ends, and so is
+// `result`, the variable a function leaves its value in; the rest of the frame
+// goes with it. A call may read any variable of the data segment, and any of
+// the frame once an address of one has been taken. A load through a reference
+// may read any variable of the data segment, never one of this frame.
+//
+// Returns how many stores were left out.
+auto eliminate_dead_code(FlowGraph &graph, const std::optional<Operand> &result)
+    -> std::uint64_t;
@@ -0,0 +1,268 @@
+#include "lsp.hpp"
+#include <algorithm>
+#include <iterator>
+#include <string_view>
+
+using nlohmann::json;
+
+// JSON-RPC error codes from the protocol
+static constexpr int PARSE_ERROR = -32700;
+static constexpr int INVALID_REQUEST = -32600;
+static constexpr int METHOD_NOT_FOUND = -32601;
+static constexpr int INVALID_PARAMS = -32602;
+
+LanguageServer::LanguageServer(const CompileOptions &options)
+    : options(options) {
+    this->options.syntax_only = true;
+}
+
+auto LanguageServer::run(std::istream &in, std::ostream &out) -> int {
+    this->out = &out;
+    while (const auto body = read_message(in)) {
+        json message;
+        try {
+            message = json::parse(*body);
+        } catch (const json::parse_error &e) {
+            reply_error(nullptr, PARSE_ERROR, e.what());
+            continue;
+        }
+        try {
+            if (!handle(message)) {
+                return shutdown_requested ? 0 : 1;
+            }
+        } catch (const json::exception &e) {
+            if (message.contains("id")) {
+                reply_error(message["id"], INVALID_PARAMS, e.what());
+            }
+        }
+    }
+    // The client went away without asking us to exit.
+    return 1;
+}
+
+auto LanguageServer::read_message(std::istream &in)
+    -> std::optional<std::string> {
+    constexpr std::string_view content_length = "Content-Length:";
+    std::optional<std::size_t> length;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            if (length) {
+                break;
+            }
+        } else if (line.starts_with(content_length)) {
+            length = std::stoul(line.substr(content_length.size()));
+        }
+    }
+    if (!length) {
+        return std::nullopt;
+    }
+    std::string body(*length, '\0');
+    if (!in.read(body.data(), static_cast<std::streamsize>(*length))) {
+        return std::nullopt;
+    }
+    return body;
+}
+
+void LanguageServer::send(const json &message) {
+    const auto body =
+        message.dump(-1, ' ', false, json::error_handler_t::replace);
+    *out << "Content-Length: " << body.size() << "\r\n\r\n"
+         << body << std::flush;
+}
+
+void LanguageServer::reply(const json &id, const json &result) {
+    send({{"jsonrpc", "2.0"}, {"id", id}, {"result", result}});
+}
+
+void LanguageServer::reply_error(const json &id, const int code,
+                                 const std::string &message) {
+    send({{"jsonrpc", "2.0"},
+          {"id", id},
+          {"error", {{"code", code}, {"message", message}}}});
+}
+
+auto LanguageServer::handle(const json &message) -> bool {
+    const auto method = message.value("method", std::string());
+    const auto is_request = message.contains("id");
+    if (method == "exit") {
+        return false;
+    }
+    if (shutdown_requested) {
+        if (is_request) {
+            reply_error(message["id"], INVALID_REQUEST,
+                        "Server is shutting down");
+        }
+        return true;
+    }
+    if (method == "initialize") {
+        // Full open and close notifications, incremental changes
+        reply(message["id"],
+              {{"capabilities",
+                {{"textDocumentSync", {{"openClose", true}, {"change", 2}}}}},
+               {"serverInfo", {{"name", "pascal-compiler"}}}});
+    } else if (method == "shutdown") {
+        shutdown_requested = true;
+        reply(message["id"], nullptr);
+    } else if (method == "textDocument/didOpen") {
+        const auto &item = message.at("params").at("textDocument");
+        const auto uri = item.at("uri").get<std::string>();
+        auto &document = documents[uri];
+        document = Document{};
+        document.text = item.at("text").get<std::string>();
+        index_lines(document);
+        parse(document);
+        publish(uri, document);
+    } else if (method == "textDocument/didChange") {
+        const auto &params = message.at("params");
+        const auto uri =
+            params.at("textDocument").at("uri").get<std::string>();
+        if (const auto found = documents.find(uri);
+            found != documents.end()) {
+            for (const auto &content : params.at("contentChanges")) {
+                change(found->second, content);
+            }
+            publish(uri, found->second);
+        }
+    } else if (method == "textDocument/didClose") {
+        const auto uri = message.at("params")
+                             .at("textDocument")
+                             .at("uri")
+                             .get<std::string>();
+        documents.erase(uri);
+        send({{"jsonrpc", "2.0"},
+              {"method", "textDocument/publishDiagnostics"},
+              {"params", {{"uri", uri}, {"diagnostics", json::array()}}}});
+    } else if (is_request) {
+        reply_error(message["id"], METHOD_NOT_FOUND,
+                    "Unsupported method " + method);
+    }
+    return true;
+}
+
+void LanguageServer::index_lines(Document &document) {
+    document.line_starts = {0};
+    for (std::size_t i = 0; i < document.text.size(); ++i) {
+        if (document.text[i] == '\n') {
+            document.line_starts.push_back(i + 1);
+        }
+    }
+}
+
+// Applies one content change. A change that stays inside a top-level body only
+// has that body parsed again.
+void LanguageServer::change(Document &document, const json &content) {
+    const auto text = content.at("text").get<std::string>();
+    if (!content.contains("range")) {
+        document.text = text;
+        index_lines(document);
+        parse(document);
+        return;
+    }
+    const auto start = position_at(document, content["range"].at("start"));
+    const auto old_end = position_at(document, content["range"].at("end"));
+    document.text.replace(start.offset, old_end.offset - start.offset, text);
+
+    std::vector<std::size_t> inserted;
+    auto new_end = start;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\n') {
+            inserted.push_back(start.offset + i + 1);
+            new_end.line++;
+            new_end.column = 0;
+        } else {
+            new_end.column++;
+        }
+    }
+    new_end.offset = start.offset + text.size();
+    auto &starts = document.line_starts;
+    starts.erase(starts.begin() + start.line + 1,
+                 starts.begin() + old_end.line + 1);
+    const auto first =
+        starts.insert(starts.begin() + start.line + 1, inserted.cbegin(),
+                      inserted.cend()) +
+        static_cast<std::ptrdiff_t>(inserted.size());
+    for (auto it = first; it != starts.end(); ++it) {
+        *it = *it - old_end.offset + new_end.offset;
+    }
+
+    if (document.parser) {
+        const auto &bodies = document.parser->bodies();
+        // The last body that starts before the edit, if the edit stops short
+        // of its closing ';'
+        const auto after = std::partition_point(
+            bodies.cbegin(), bodies.cend(), [&](const auto &body) {
+                return body.begin.offset < start.offset;
+            });
+        if (after != bodies.cbegin() &&
+            old_end.offset < std::prev(after)->end.offset &&
+            document.parser->reparse_body(
+                static_cast<std::size_t>(after - bodies.cbegin()) - 1,
+                document.text, old_end, new_end)) {
+            return;
+        }
+    }
+    parse(document);
+}
+
+void LanguageServer::parse(Document &document) {
+    document.parser.reset();
+    document.lex_error.reset();
+    try {
+        document.parser = std::make_unique<Parser>(
+            std::make_unique<Lexer>(std::string_view(document.text),
+                                    SourcePosition{}),
+            options);
+    } catch (const ParseError &e) {
+        document.lex_error = e;
+    }
+}
+
+void LanguageServer::publish(const std::string &uri,
+                             const Document &document) {
+    auto diagnostics = json::array();
+    const auto add = [&](const ParseError &e) {
+        const auto &[_, line, column] = e.position;
+        diagnostics.push_back(
+            {{"range",
+              {{"start", {{"line", line}, {"character", column}}},
+               {"end", {{"line", line}, {"character", column + 1}}}}},
+             {"severity", 1},
+             {"source", "pascal-compiler"},
+             {"message", e.what()}});
+    };
+    if (document.lex_error) {
+        add(*document.lex_error);
+    }
+    if (document.parser) {
+        for (const auto &error : document.parser->diagnostics()) {
+            add(error);
+        }
+        for (const auto &body : document.parser->bodies()) {
+            for (const auto &error : body.errors) {
+                add(error);
+            }
+        }
+    }
+    send({{"jsonrpc", "2.0"},
+          {"method", "textDocument/publishDiagnostics"},
+          {"params", {{"uri", uri}, {"diagnostics", diagnostics}}}});
+}
+
+// Protocol positions count characters; the sources this compiler accepts are
+// plain ASCII, so those are bytes here.
+auto LanguageServer::position_at(const Document &document,
+                                 const json &position) -> SourcePosition {
+    const auto &starts = document.line_starts;
+    const auto line = std::min(position.at("line").get<std::size_t>(),
+                               starts.size() - 1);
+    const auto line_end = line + 1 < starts.size() ? starts[line + 1] - 1
+                                                   : document.text.size();
+    const auto offset = std::min(
+        starts[line] + position.at("character").get<std::size_t>(), line_end);
+    return {offset, static_cast<std::uint32_t>(line),
+            static_cast<std::uint32_t>(offset - starts[line])};
+}
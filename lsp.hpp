@@ -0,0 +1,57 @@
+#pragma once
+#include "json.hpp"
+#include "lexer.h"
+#include "parser.h"
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A language server speaking JSON-RPC over a pair of streams. Open documents
+// stay in memory along with their parser, which holds the scope tree and the
+// extent and result of every top-level procedure and function body. An edit
+// that falls inside one of those bodies re-lexes and re-parses only that body;
+// anything else parses the document again.
+class LanguageServer {
+  public:
+    explicit LanguageServer(const CompileOptions &options);
+
+    // Serves messages from `in` until the client says `exit`, and returns the
+    // exit code the protocol asks for.
+    auto run(std::istream &in, std::ostream &out) -> int;
+
+  private:
+    struct Document {
+        std::string text;
+        // Offset of the first character of every line
+        std::vector<std::size_t> line_starts;
+        std::unique_ptr<Parser> parser;
+        // Set when the text could not even be lexed
+        std::optional<ParseError> lex_error;
+    };
+
+    CompileOptions options;
+    std::unordered_map<std::string, Document> documents;
+    std::ostream *out = nullptr;
+    bool shutdown_requested = false;
+
+    auto read_message(std::istream &in) -> std::optional<std::string>;
+    void send(const nlohmann::json &message);
+    void reply(const nlohmann::json &id, const nlohmann::json &result);
+    void reply_error(const nlohmann::json &id, const int code,
+                     const std::string &message);
+    // Returns false once the client has asked the server to exit.
+    auto handle(const nlohmann::json &message) -> bool;
+    void change(Document &document, const nlohmann::json &content);
+    void parse(Document &document);
+    static void index_lines(Document &document);
+    void publish(const std::string &uri, const Document &document);
+
+    [[nodiscard]] static auto position_at(const Document &document,
+                                          const nlohmann::json &position)
+        -> SourcePosition;
+};
@@ -1,37 +1,199 @@
+#include "cfg.hpp"
 #include "inja.hpp"
 #include "json.hpp"
 #include "lexer.h"
+#include "lsp.hpp"
 #include "parser.h"
 #include "popl.hpp"
+#include "regalloc.hpp"
 #include <algorithm>
+#include <atomic>
 #include <charconv>
 #include <cstdint>
 #include <cstdlib>
 #include <filesystem>
-#include <fstream>
 #include <functional>
 #include <iostream>
 #include <limits>
 #include <memory>
-#include <numeric>
 #include <optional>
 #include <system_error>
+#include <thread>
 #include <tuple>
+#include <utility>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
-Parser::Parser(const std::string_view filename) {
+Parser::Parser(const std::string_view filename, const CompileOptions &options)
+    : options(options) {
     lexer = std::make_unique<Lexer>(filename.data());
     this->filename = filename.data();
-    std::filesystem::path p = filename;
-    p.replace_extension(".lst");
-    asm_output.open(p.string());
-    asm_output.exceptions(std::ofstream::badbit | std::ofstream::failbit);
-    asm_output << "char data_segment[65536] = {0};" << std::endl
-               << "int main() {" << std::endl
-               << "_asm {" << std::endl
-               << "PUSHAD" << std::endl
-               << "LEA EBP, data_segment" << std::endl
-               << "JMP kmain" << std::endl;
-    program();
+    if (options.emit_interface) {
+        listing.unit = std::filesystem::path(filename).stem().string();
+    }
+    listing.routines.emplace_back();
+    emit(Opcode::Pushad);
+    emit(Opcode::Lea, reg(Register::EBP), routine().named("data_segment"));
+    emit(Opcode::Jmp, routine().named("kmain"));
+    parse_program();
+    if (!options.syntax_only) {
+        std::string text;
+        print(text, listing);
+        std::filesystem::path p = filename;
+        p.replace_extension(".lst");
+        write_file(p.string(), text);
+    }
+}
+
+Parser::Parser(std::unique_ptr<Lexer> lexer, const CompileOptions &options)
+    : options(options) {
+    this->lexer = std::move(lexer);
+    listing.routines.emplace_back();
+    retain_bodies = true;
+    parse_program();
+}
+
+Parser::Parser(BodyTask &task, const FrozenScope &globals, TypeTable &types,
+               const CompileOptions &options)
+    : symtab(globals, task.scope, task.horizon, task.scopes, types),
+      options(options) {
+    listing.routines.emplace_back().prefix = task.name + "_";
+    lexer = std::make_unique<Lexer>(std::move(task.tokens),
+                                    std::move(task.positions));
+    try {
+        token = lexer->get_token();
+        if (task.is_function) {
+            function_body();
+        } else {
+            procedure_body(task.name);
+        }
+    } catch (const std::exception &e) {
+        report(located(e));
+    }
+}
+
+void Parser::parse_program() {
+    try {
+        program();
+    } catch (const std::exception &e) {
+        report(located(e));
+        // Bodies set aside before giving up can still be checked.
+        if (!bodies_parsed) {
+            parse_deferred_bodies();
+        }
+    }
+    std::ranges::stable_sort(errors, {}, [](const ParseError &error) {
+        return error.position.offset;
+    });
+    if (options.max_errors != 0 && errors.size() > options.max_errors) {
+        errors.erase(errors.begin() +
+                         static_cast<std::ptrdiff_t>(options.max_errors),
+                     errors.end());
+    }
+}
+
+auto Parser::located(const std::exception &e) const -> ParseError {
+    if (const auto *error = dynamic_cast<const ParseError *>(&e)) {
+        return *error;
+    }
+    return ParseError(e.what(), lexer->position());
+}
+
+auto Parser::report(const ParseError &error) -> bool {
+    // One bad token tends to trip every enclosing construct as well.
+    if (errors.empty() ||
+        errors.back().position.offset != error.position.offset) {
+        errors.push_back(error);
+    }
+    return options.max_errors == 0 || errors.size() < options.max_errors;
+}
+
+void Parser::recoverable(const std::function<void()> &parse,
+                         void (Parser::*skip)()) {
+    const RecoveryPoint point{.values = values.size(),
+                              .temporaries = temporaries.size(),
+                              .conditionals = conditional_stack.size(),
+                              .loops = loop_stack.size(),
+                              .gpr_index = gpr_index,
+                              .grouping_depth = grouping_depth,
+                              .block_depth = block_depth,
+                              .scope = symtab.cur_scope};
+    try {
+        parse();
+    } catch (const std::exception &e) {
+        const auto error = located(e);
+        if (!report(error) || !token) {
+            throw error;
+        }
+        while (values.size() > point.values) {
+            values.pop();
+        }
+        while (temporaries.size() > point.temporaries) {
+            temporaries.pop();
+        }
+        while (conditional_stack.size() > point.conditionals) {
+            conditional_stack.pop();
+        }
+        while (loop_stack.size() > point.loops) {
+            loop_stack.pop();
+        }
+        gpr_index = point.gpr_index;
+        grouping_depth = point.grouping_depth;
+        block_depth = point.block_depth;
+        symtab.unwind(point.scope);
+        or_used = false;
+        for_while = false;
+        (this->*skip)();
+        if (!token) {
+            throw error;
+        }
+    }
+}
+
+void Parser::skip_statement() {
+    while (token) {
+        if (token->index() == Special && std::get<3>(*token) == ";") {
+            return;
+        }
+        if (token->index() == ReservedWord) {
+            if (const auto &word = std::get<4>(*token);
+                word == "end" || word == "procedure" || word == "function") {
+                return;
+            }
+        }
+        token = lexer->get_token();
+    }
+}
+
+void Parser::skip_declaration() {
+    while (token) {
+        if (token->index() == Special && std::get<3>(*token) == ";") {
+            token = lexer->get_token();
+            return;
+        }
+        if (token->index() == ReservedWord) {
+            if (const auto &word = std::get<4>(*token);
+                word == "begin" || word == "var" || word == "procedure" ||
+                word == "function") {
+                return;
+            }
+        }
+        token = lexer->get_token();
+    }
+}
+
+void Parser::skip_subprogram() {
+    BodyScanner scanner;
+    bool closed = false;
+    while (token && !closed) {
+        closed = scanner.feed(*token);
+        token = lexer->get_token();
+    }
+    if (token && token->index() == Special && std::get<3>(*token) == ";") {
+        token = lexer->get_token();
+    }
 }
 
 void Parser::program() {
@@ -53,31 +215,135 @@ void Parser::program() {
     if (std::get<3>(*token) != ";")
         throw std::runtime_error("Bad code: expected ';'");
     token = lexer->get_token();
+    if (token->index() == ReservedWord && std::get<4>(*token) == "uses") {
+        uses();
+    }
     block();
     end_program();
 }
 
+// Whether `symbol` of a unit interface is a procedure or a function, whose
+// code is labelled with its name
+static auto is_routine(const UnitInterface::Symbol &symbol) -> bool {
+    return symbol.kind == static_cast<std::uint8_t>(EntityKind::Procedure) ||
+           symbol.kind == static_cast<std::uint8_t>(EntityKind::Function);
+}
+
+// Throws if unit `name` cannot be linked in with the units in `imports`. The
+// code of every unit has its globals at the start of the data segment, so
+// only one of them may have any, and labels its procedures and functions with
+// their names, so no two may share one.
+static void check_unit(const std::string &name, const UnitInterface &unit,
+                       const std::vector<Import> &imports) {
+    for (const auto &import : imports) {
+        if (import.name == name) {
+            continue;
+        }
+        nlohmann::json data;
+        data["name"] = name;
+        data["other"] = import.name;
+        if (unit.data_size() != 0 && import.unit->data_size() != 0) {
+            throw std::runtime_error(
+                inja::render("Bad code: units {{other}} and {{name}} both "
+                             "have globals",
+                             data));
+        }
+        for (const auto &symbol : unit.declarations()) {
+            const auto other = import.unit->find(unit.text(symbol.name));
+            if (is_routine(symbol) && other && is_routine(*other)) {
+                data["routine"] = unit.text(symbol.name);
+                throw std::runtime_error(
+                    inja::render("Bad code: units {{other}} and {{name}} "
+                                 "both declare {{routine}}",
+                                 data));
+            }
+        }
+    }
+}
+
+void Parser::uses() {
+    do {
+        index++;
+        token = lexer->get_token();
+        if (token->index() != Word) {
+            throw std::runtime_error("Bad code: expected unit name");
+        }
+        const auto name = std::get<0>(*token);
+        // Next to the source, or in the working directory for sources that
+        // are not files
+        const auto path =
+            std::filesystem::path(filename).parent_path() / (name + ".pif");
+        auto unit = std::make_shared<const UnitInterface>(path.string());
+        check_unit(name, *unit, symtab.global_scope().imports);
+        if (!symtab.use(name, std::move(unit))) {
+            nlohmann::json data;
+            data["name"] = name;
+            throw std::runtime_error(
+                inja::render("Bad code: unit {{name}} is already used", data));
+        }
+        listing.uses.push_back(name);
+        index++;
+        token = lexer->get_token();
+    } while (token->index() == Special && std::get<3>(*token) == ",");
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error("Bad code: expected ';' to terminate uses "
+                                 "clause");
+    }
+    index++;
+    token = lexer->get_token();
+}
+
+void Parser::check_unit_routine(const std::string &name) const {
+    // The program's own declarations are checked as they are made.
+    if (symtab.global_scope().table.contains(name)) {
+        return;
+    }
+    if (const auto entity = symtab.resolve(name);
+        entity && entity->kind != EntityKind::Variable) {
+        nlohmann::json data;
+        data["name"] = name;
+        throw std::runtime_error(inja::render(
+            "Bad code: {{name}} is already a procedure or function of a "
+            "unit in use",
+            data));
+    }
+}
+
+void Parser::write_interface() const {
+    std::filesystem::path p = filename;
+    p.replace_extension(".pif");
+    write_unit_interface(p.string(), symtab.global_scope(),
+                         symtab.type_table());
+}
+
+auto Parser::symbol_stats() const -> SymbolStats {
+    auto stats = symtab.stats();
+    stats.merge(body_stats);
+    return stats;
+}
+
 void Parser::block() {
     pfv();
     if (!symtab.cur_scope->name.empty()) {
-        std::vector<std::uint64_t> variables;
-        for (const auto &[_, v] : symtab.cur_scope->table) {
-            if (std::holds_alternative<VarData>(v)) {
-                const auto vdata = std::get<VarData>(v);
-                if (!vdata.is_param) {
-                    variables.push_back(vdata.size);
-                }
-            }
+        symtab.seal_frame();
+        body_begin = routine().code.size();
+        virtuals = 0;
+        emit(Opcode::Push, reg(Register::EDI));
+        emit(Opcode::Mov, reg(Register::EDI), reg(Register::ESP));
+        if (const auto locals_size = symtab.cur_scope->frame.locals_size();
+            locals_size != 0) {
+            emit(Opcode::Sub, reg(Register::ESP),
+                 imm(static_cast<std::int64_t>(locals_size)));
         }
-        asm_output << "PUSH EDI" << std::endl << "MOV EDI, ESP" << std::endl;
-        if (const auto all_variables_size =
-                std::accumulate(variables.cbegin(), variables.cend(), 0);
-            all_variables_size != 0) {
-            asm_output << "SUB ESP, " << all_variables_size << std::endl;
-        }
-        asm_output << "PUSHAD" << std::endl;
+        emit(Opcode::Pushad);
     } else {
-        asm_output << "kmain:" << std::endl;
+        parse_deferred_bodies();
+        // The bodies went in after the code so far.
+        listing.main = listing.routines.size();
+        listing.routines.emplace_back();
+        body_begin = routine().code.size();
+        virtuals = 0;
+        emit(Opcode::Label, routine().named("kmain"));
     }
     if (token->index() == ReservedWord && std::get<4>(*token) == "begin") {
         index++;
@@ -97,7 +363,13 @@ void Parser::block() {
     }
 }
 
+// A statement is the unit of error recovery: a bad one is reported and
+// skipped, and parsing goes on with the next.
 void Parser::statement() {
+    recoverable([this] { statement_body(); }, &Parser::skip_statement);
+}
+
+void Parser::statement_body() {
     if (token->index() == ReservedWord) {
         if (auto tok = std::get<4>(*token); tok == "begin") {
             index++;
@@ -118,75 +390,47 @@ void Parser::statement() {
             token = lexer->get_token();
             conditional_stack.push(if_count);
             if_count++;
-            expression(std::nullopt);
+            expression(nullptr);
             handle_if();
         } else if (tok == "while") {
             index++;
             token = lexer->get_token();
             loop_stack.push(while_count);
             while_count++;
-            asm_output << "while" << loop_stack.top() << ":" << std::endl;
+            emit(Opcode::Label, label(LabelKind::While, loop_stack.top()));
             for_while = true;
-            expression(std::nullopt);
+            expression(nullptr);
             for_while = false;
             handle_while();
         }
     } else if (token->index() == Word) {
         const auto name = std::get<0>(*token);
-        if (const auto var_info = symtab.get_var_info(name); var_info) {
-            values.push({var_info->type, std::nullopt});
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != ":=") {
-                throw std::runtime_error(
-                    "Bad code: expected ':=' for variable assignment");
-            }
+        const auto entity = symtab.resolve(name);
+        if (!entity) {
+            nlohmann::json data;
+            data["name"] = name;
+            throw std::runtime_error(
+                inja::render("Bad code: {{name}} is not declared", data));
+        }
+        if (entity->kind == EntityKind::Variable) {
             index++;
             token = lexer->get_token();
-            expression(std::nullopt);
-            const auto rhs = values.top();
-            values.pop();
-            const auto lhs = values.top();
-            values.pop();
-            if (rhs.type != lhs.type) {
-                throw std::runtime_error("Bad code: type mismatch");
-            }
-            if (!symtab.cur_scope->name.empty()) {
-                if (!var_info->is_param) {
-                    asm_output << "MOV [EDI - " << var_info->offset << "], "
-                               << gprs[gpr_index - 1] << std::endl;
-                    gpr_index--;
-                } else {
-                    if (var_info->pass_by_ref) {
-                        asm_output << "MOV ESI, [EDI + " << var_info->offset
-                                   << "]" << std::endl
-                                   << "MOV [ESI], " << gprs[gpr_index - 1]
-                                   << std::endl;
-                        gpr_index--;
-                    } else {
-                        asm_output << "MOV [EDI + " << var_info->offset << "], "
-                                   << gprs[gpr_index - 1] << std::endl;
-                        gpr_index--;
-                    }
-                }
-            } else {
-                asm_output << "MOV [EBP + " << var_info->offset << "], "
-                           << gprs[gpr_index - 1] << std::endl;
-                gpr_index--;
+            const auto target = select(nullptr, entity->var().type);
+            const auto scalar = symtab.type_table().scalar_of(target.type);
+            if (!scalar) {
+                nlohmann::json data;
+                data["type"] = symtab.type_table().name(target.type);
+                throw std::runtime_error(inja::render(
+                    "Bad code: a whole {{type}} cannot be assigned", data));
             }
-        } else if (const auto global_var_info = symtab.find(name);
-                   global_var_info) {
-            const auto info = std::get<VarData>(*global_var_info);
-            values.push({info.type, std::nullopt});
-            index++;
-            token = lexer->get_token();
+            values.push({*scalar, std::nullopt});
             if (token->index() != Special || std::get<3>(*token) != ":=") {
                 throw std::runtime_error(
                     "Bad code: expected ':=' for variable assignment");
             }
             index++;
             token = lexer->get_token();
-            expression(std::nullopt);
+            expression(nullptr);
             const auto rhs = values.top();
             values.pop();
             const auto lhs = values.top();
@@ -194,49 +438,8 @@ void Parser::statement() {
             if (rhs.type != lhs.type) {
                 throw std::runtime_error("Bad code: type mismatch");
             }
-            asm_output << "MOV [EBP + " << info.offset << "], "
-                       << gprs[gpr_index - 1] << std::endl;
-            gpr_index--;
-        } else if (const auto proc_info = symtab.get_proc_info(name);
-                   proc_info) {
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != "(") {
-                throw std::runtime_error(
-                    "Bad code: procedure requires a call expression");
-            }
-            index++;
-            token = lexer->get_token();
-            consume_params(*proc_info);
-            if (token->index() != Special || std::get<3>(*token) != ")") {
-                throw std::runtime_error(
-                    "Bad code: call expression requires termination");
-            }
-            asm_output << "CALL " << proc_info->name << std::endl;
-            index++;
-            token = lexer->get_token();
-        } else if (const auto global_proc_info =
-                       symtab.find(name, FindType::Procedure);
-                   global_proc_info) {
-            const auto info = std::get<ProcData>(*global_proc_info);
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != "(") {
-                throw std::runtime_error(
-                    "Bad code: procedure requires a call expression");
-            }
-            index++;
-            token = lexer->get_token();
-            consume_params(info);
-            if (token->index() != Special || std::get<3>(*token) != ")") {
-                throw std::runtime_error(
-                    "Bad code: call expression requires termination");
-            }
-            asm_output << "CALL " << proc_info->name << std::endl;
-            index++;
-            token = lexer->get_token();
-        } else if (const auto func_info = symtab.get_func_info(name);
-                   func_info) {
+            store_variable(*entity, target);
+        } else {
             index++;
             token = lexer->get_token();
             if (token->index() != Special || std::get<3>(*token) != "(") {
@@ -245,32 +448,19 @@ void Parser::statement() {
             }
             index++;
             token = lexer->get_token();
-            consume_params(*func_info);
-            if (token->index() != Special || std::get<3>(*token) != ")") {
-                throw std::runtime_error(
-                    "Bad code: call expression requires termination");
-            }
-            asm_output << "CALL " << proc_info->name << std::endl;
-            index++;
-            token = lexer->get_token();
-        } else if (const auto global_func_info =
-                       symtab.find(name, FindType::Function);
-                   global_func_info) {
-            const auto info = std::get<FuncData>(*global_func_info);
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != "(") {
-                throw std::runtime_error(
-                    "Bad code: procedure requires a call expression");
+            if (entity->kind == EntityKind::Procedure) {
+                consume_params(entity->proc());
+            } else {
+                consume_params(entity->func());
             }
-            index++;
-            token = lexer->get_token();
-            consume_params(info);
             if (token->index() != Special || std::get<3>(*token) != ")") {
                 throw std::runtime_error(
                     "Bad code: call expression requires termination");
             }
-            asm_output << "CALL " << proc_info->name << std::endl;
+            emit(Opcode::Call,
+                 routine().named(entity->kind == EntityKind::Procedure
+                                     ? entity->proc().name
+                                     : entity->func().name));
             index++;
             token = lexer->get_token();
         }
@@ -301,29 +491,25 @@ void Parser::mstatement() {
 void Parser::handle_if() {
     if (token->index() == ReservedWord) {
         if (std::get<4>(*token) == "then") {
-            if (last_comparison == '<') {
-                asm_output << "JL if" << conditional_stack.top() << std::endl;
-            } else if (last_comparison == '>') {
-                asm_output << "JG if" << conditional_stack.top() << std::endl;
-            } else if (last_comparison == '=') {
-                asm_output << "JE if" << conditional_stack.top() << std::endl;
+            const auto number = conditional_stack.top();
+            if (const auto jump = comparison_jump(); jump) {
+                emit(*jump, label(LabelKind::If, number));
             }
             if (or_used) {
-                asm_output << "or" << or_count << ":" << std::endl;
+                emit(Opcode::Label, label(LabelKind::Or, or_count));
                 or_used = false;
                 or_count++;
             }
-            asm_output << "JMP else" << conditional_stack.top() << std::endl
-                       << "if" << conditional_stack.top() << ":" << std::endl;
+            emit(Opcode::Jmp, label(LabelKind::Else, number));
+            emit(Opcode::Label, label(LabelKind::If, number));
             index++;
             token = lexer->get_token();
             statement();
-            asm_output << "JMP endif" << conditional_stack.top() << std::endl
-                       << "else" << conditional_stack.top() << ":" << std::endl;
+            emit(Opcode::Jmp, label(LabelKind::Endif, number));
+            emit(Opcode::Label, label(LabelKind::Else, number));
             if_prime();
-            asm_output << "JMP endif" << conditional_stack.top() << std::endl;
-            asm_output << "endif" << conditional_stack.top() << ":"
-                       << std::endl;
+            emit(Opcode::Jmp, label(LabelKind::Endif, number));
+            emit(Opcode::Label, label(LabelKind::Endif, number));
             conditional_stack.pop();
         } else {
             throw std::runtime_error("Bad code: missing required keyword "
@@ -335,31 +521,38 @@ void Parser::handle_if() {
     }
 }
 
+auto Parser::comparison_jump() const -> std::optional<Opcode> {
+    switch (last_comparison) {
+    case '<':
+        return Opcode::Jl;
+    case '>':
+        return Opcode::Jg;
+    case '=':
+        return Opcode::Je;
+    default:
+        return std::nullopt;
+    }
+}
+
 void Parser::handle_while() {
     if (token->index() == ReservedWord) {
         if (std::get<4>(*token) == "do") {
-            if (last_comparison == '<') {
-                asm_output << "JL while" << loop_stack.top() << "inner"
-                           << std::endl;
-            } else if (last_comparison == '>') {
-                asm_output << "JG while" << loop_stack.top() << "inner"
-                           << std::endl;
-            } else if (last_comparison == '=') {
-                asm_output << "JE while" << loop_stack.top() << "inner"
-                           << std::endl;
+            const auto number = loop_stack.top();
+            if (const auto jump = comparison_jump(); jump) {
+                emit(*jump, label(LabelKind::WhileBody, number));
             }
             if (or_used) {
-                asm_output << "or" << or_count << ":" << std::endl;
+                emit(Opcode::Label, label(LabelKind::Or, or_count));
                 or_used = false;
                 or_count++;
             }
-            asm_output << "JMP endwhile" << loop_stack.top() << std::endl;
-            asm_output << "while" << loop_stack.top() << "inner:" << std::endl;
+            emit(Opcode::Jmp, label(LabelKind::EndWhile, number));
+            emit(Opcode::Label, label(LabelKind::WhileBody, number));
             index++;
             token = lexer->get_token();
             statement();
-            asm_output << "JMP while" << loop_stack.top() << std::endl
-                       << "endwhile" << loop_stack.top() << ":" << std::endl;
+            emit(Opcode::Jmp, label(LabelKind::While, number));
+            emit(Opcode::Label, label(LabelKind::EndWhile, number));
             loop_stack.pop();
         } else {
             throw std::runtime_error("Bad code: missing required keyword 'do' "
@@ -375,10 +568,9 @@ void Parser::end_program() {
     if (token->index() == Special) {
         if (std::get<3>(*token) == ".") {
             index++;
-            asm_output << "POPAD" << std::endl
-                       << "}" << std::endl
-                       << "return 0;" << std::endl
-                       << "}" << std::endl;
+            allocate_body_registers();
+            emit(Opcode::Popad);
+            listing.complete = true;
         } else {
             throw std::runtime_error("Bad code: program must be terminated "
                                      "with a full stop ('.')");
@@ -389,24 +581,20 @@ void Parser::end_program() {
     }
 }
 
-void Parser::expression(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
-    s_expression(stream);
+void Parser::expression(Code *code) {
+    s_expression(code);
 }
 
-void Parser::s_expression(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
-    s_expression_r(stream);
-    s_expression_prime(stream);
+void Parser::s_expression(Code *code) {
+    s_expression_r(code);
+    s_expression_prime(code);
 }
 
-void Parser::s_expression_r(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
-    term(stream);
+void Parser::s_expression_r(Code *code) {
+    term(code);
 }
 
-void Parser::s_expression_prime(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
+void Parser::s_expression_prime(Code *code) {
     if (token->index() == Special) {
         if (auto tok = std::get<3>(*token);
             tok == "<" || tok == ">" || tok == "=") {
@@ -419,7 +607,7 @@ void Parser::s_expression_prime(
             }
             index++;
             token = lexer->get_token();
-            s_expression_r(stream);
+            s_expression_r(code);
             const auto rhs = values.top();
             values.pop();
             const auto lhs = values.top();
@@ -451,37 +639,28 @@ void Parser::s_expression_prime(
                 }
                 values.push({VarType::Boolean, std::nullopt});
             }
-            if (!stream) {
-                asm_output << "CMP " << gprs[gpr_index - 2] << ", "
-                           << gprs[gpr_index - 1] << std::endl;
-            } else {
-                stream->get() << "CMP " << gprs[gpr_index - 2] << ", "
-                              << gprs[gpr_index - 1] << std::endl;
-            }
+            emit_to(code, Opcode::Cmp, gpr(gpr_index - 2), gpr(gpr_index - 1));
             gpr_index -= 2;
-            s_expression_prime(stream);
+            s_expression_prime(code);
         }
     }
 }
 
-void Parser::term(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
-    term_r(stream);
-    term_prime(stream);
+void Parser::term(Code *code) {
+    term_r(code);
+    term_prime(code);
 }
 
-void Parser::term_r(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
-    fact(stream);
+void Parser::term_r(Code *code) {
+    fact(code);
 }
 
-void Parser::term_prime(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
+void Parser::term_prime(Code *code) {
     if (token->index() == Special) {
         if (auto tok = std::get<3>(*token); tok == "+" || tok == "-") {
             index++;
             token = lexer->get_token();
-            term_r(stream);
+            term_r(code);
             const auto rhs = values.top();
             values.pop();
             const auto lhs = values.top();
@@ -490,81 +669,31 @@ void Parser::term_prime(
                  rhs.type == VarType::Integer) ||
                 (lhs.type == VarType::Character &&
                  rhs.type == VarType::Character)) {
-                if (lhs.literal && rhs.literal) {
-                    if (tok == "+") {
-                        auto res = std::get<std::int32_t>(*lhs.literal) +
-                                   std::get<std::int32_t>(*rhs.literal);
-                        values.push({VarType::Integer, res});
-                    } else if (tok == "-") {
-                        auto res = std::get<std::int32_t>(*lhs.literal) -
-                                   std::get<std::int32_t>(*rhs.literal);
-                        values.push({VarType::Integer, res});
-                    }
+                if (const auto folded = fold(tok, lhs, rhs)) {
+                    load_folded(code, {VarType::Integer, folded});
                 } else {
-                    if (gpr_index > gprs.size() - 1) {
-                        throw std::runtime_error(
-                            "Bad code: expression is too complicated");
-                    }
+                    order_operands(code);
                     if (tok == "+") {
-                        if (!stream) {
-                            asm_output << "ADD " << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 1] << std::endl;
-                        } else {
-                            stream->get() << "ADD " << gprs[gpr_index - 2]
-                                          << ", " << gprs[gpr_index - 2] << ", "
-                                          << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Add, gpr(gpr_index - 2),
+                                gpr(gpr_index - 2), gpr(gpr_index - 1));
                     } else {
-                        if (!stream) {
-                            asm_output << "SUB " << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 1] << std::endl;
-                        } else {
-                            stream->get() << "SUB " << gprs[gpr_index - 2]
-                                          << ", " << gprs[gpr_index - 2] << ", "
-                                          << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Sub, gpr(gpr_index - 2),
+                                gpr(gpr_index - 2), gpr(gpr_index - 1));
                     }
                     gpr_index--;
                     values.push({VarType::Integer, std::nullopt});
                 }
             } else if (lhs.type == VarType::Real && rhs.type == VarType::Real) {
-                if (lhs.literal && rhs.literal) {
-                    if (tok == "+") {
-                        auto res = std::get<float>(*lhs.literal) +
-                                   std::get<std::int32_t>(*rhs.literal);
-                        values.push({VarType::Real, res});
-                    } else if (tok == "-") {
-                        auto res = std::get<float>(*lhs.literal) -
-                                   std::get<std::int32_t>(*rhs.literal);
-                        values.push({VarType::Real, res});
-                    }
+                if (const auto folded = fold(tok, lhs, rhs)) {
+                    load_folded(code, {VarType::Real, folded});
                 } else {
-                    if (gpr_index > gprs.size() - 1) {
-                        throw std::runtime_error(
-                            "Bad code: expression is too complicated");
-                    }
+                    order_operands(code);
                     if (tok == "+") {
-                        if (!stream) {
-                            asm_output << "ADD " << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 1] << std::endl;
-                        } else {
-                            stream->get() << "ADD " << gprs[gpr_index - 2]
-                                          << ", " << gprs[gpr_index - 2] << ", "
-                                          << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Add, gpr(gpr_index - 2),
+                                gpr(gpr_index - 2), gpr(gpr_index - 1));
                     } else {
-                        if (!stream) {
-                            asm_output << "SUB " << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 1] << std::endl;
-                        } else {
-                            stream->get() << "ADD " << gprs[gpr_index - 2]
-                                          << ", " << gprs[gpr_index - 2] << ", "
-                                          << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Sub, gpr(gpr_index - 2),
+                                gpr(gpr_index - 2), gpr(gpr_index - 1));
                     }
                     gpr_index--;
                     values.push({VarType::Real, std::nullopt});
@@ -574,75 +703,24 @@ void Parser::term_prime(
                     "Bad code: invalid type on left-or right-hand side of "
                     "expression");
             }
-            term_prime(stream);
+            term_prime(code);
         }
     } else if (token->index() == ReservedWord) {
         if (auto tok = std::get<4>(*token); tok == "or") {
             index++;
             token = lexer->get_token();
-            if (!for_while) {
-                if (last_comparison == '<') {
-                    if (!stream) {
-                        asm_output << "JL if" << conditional_stack.top()
-                                   << std::endl;
-                    } else {
-                        stream->get()
-                            << "JL if" << conditional_stack.top() << std::endl;
-                    }
-                } else if (last_comparison == '>') {
-                    if (!stream) {
-                        asm_output << "JG if" << conditional_stack.top()
-                                   << std::endl;
-                    } else {
-                        stream->get()
-                            << "JG if" << conditional_stack.top() << std::endl;
-                    }
-                } else if (last_comparison == '=') {
-                    if (!stream) {
-                        asm_output << "JE if" << conditional_stack.top()
-                                   << std::endl;
-                    } else {
-                        stream->get()
-                            << "JE if" << conditional_stack.top() << std::endl;
-                    }
-                }
-            } else {
-                if (last_comparison == '<') {
-                    if (!stream) {
-                        asm_output << "JL while" << loop_stack.top() << "inner"
-                                   << std::endl;
-                    } else {
-                        stream->get() << "JL while" << loop_stack.top()
-                                      << "inner" << std::endl;
-                    }
-                } else if (last_comparison == '>') {
-                    if (!stream) {
-                        asm_output << "JG while" << loop_stack.top() << "inner"
-                                   << std::endl;
-                    } else {
-                        stream->get() << "JG while" << loop_stack.top()
-                                      << "inner" << std::endl;
-                    }
-                } else if (last_comparison == '=') {
-                    if (!stream) {
-                        asm_output << "JE while" << loop_stack.top() << "inner"
-                                   << std::endl;
-                    } else {
-                        stream->get() << "JE while" << loop_stack.top()
-                                      << "inner" << std::endl;
-                    }
-                }
+            if (const auto jump = comparison_jump(); jump) {
+                emit_to(code, *jump,
+                        for_while
+                            ? label(LabelKind::WhileBody, loop_stack.top())
+                            : label(LabelKind::If, conditional_stack.top()));
             }
             if (or_used) {
-                if (!stream) {
-                    asm_output << "or" << or_count << ":" << std::endl;
-                } else {
-                    stream->get() << "or" << or_count << ":" << std::endl;
-                }
+                emit_to(code, Opcode::Label, label(LabelKind::Or, or_count));
                 or_used = false;
                 or_count++;
             }
-            term_r(stream);
+            term_r(code);
             const auto lhs = values.top();
             values.pop();
             const auto rhs = values.top();
@@ -653,25 +731,25 @@ void Parser::term_prime(
                 throw std::runtime_error("Bad code: expected type boolean "
                                          "for conjunctive 'or'");
             }
-            term_prime(stream);
+            term_prime(code);
         }
     }
 }
 
-void Parser::fact(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
-    fact_r(stream);
-    fact_prime(stream);
+void Parser::fact(Code *code) {
+    fact_r(code);
+    fact_prime(code);
 }
 
-void Parser::fact_r(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
+void Parser::fact_r(Code *code) {
+    const auto begin = target(code).size();
+    const auto depth = gpr_index;
     if (token->index() == Special) {
         if (auto tok = std::get<3>(*token); tok == "(") {
             grouping_depth++;
             index++;
             token = lexer->get_token();
-            expression(stream);
+            expression(code);
             if (token->index() == Special) {
                 if (auto tok = std::get<3>(*token); tok == ")") {
                     grouping_depth--;
@@ -684,17 +762,31 @@ void Parser::fact_r(
                 throw std::runtime_error("Bad code: expected ')'");
             }
         } else if (tok == "+" || tok == "-") {
+            index++;
+            token = lexer->get_token();
+            term_r(code);
             if (tok == "-") {
-                // Do we use the current GPR?
-                if (!stream) {
-                    asm_output << "NEG " << gprs[gpr_index - 1] << std::endl;
+                auto value = values.top();
+                values.pop();
+                // -x is 0 - x, wrapped as NEG leaves it.
+                auto zero = value;
+                zero.literal = std::int32_t{0};
+                if (value.literal &&
+                    std::holds_alternative<float>(*value.literal)) {
+                    zero.literal = 0.0F;
+                }
+                if (const auto folded = fold(tok, zero, value)) {
+                    value.literal = folded;
+                    load_folded(code, value, 1);
                 } else {
-                    stream->get() << "NEG " << gprs[gpr_index - 1] << std::endl;
+                    emit_to(code, Opcode::Neg, gpr(gpr_index - 1));
+                    values.push(value);
                 }
             }
-            index++;
-            token = lexer->get_token();
-            term_r(stream);
+        } else {
+            throw std::runtime_error("Bad code: expected grouped expression, "
+                                     "additive or subtractive "
+                                     "operator, integer, real, or word");
         }
     } else if (token->index() == Integer || token->index() == Real) {
         if (token->index() == Integer) {
@@ -706,17 +798,7 @@ void Parser::fact_r(
                 throw std::runtime_error("Bad code: integer is not valid");
             }
             values.push({VarType::Integer, out});
-            if (gpr_index > gprs.size() - 1) {
-                throw std::runtime_error(
-                    "Bad code: expression is too complicated");
-            }
-            if (!stream) {
-                asm_output << "mov " << gprs[gpr_index] << ", " << out
-                           << std::endl;
-            } else {
-                stream->get()
-                    << "mov " << gprs[gpr_index] << ", " << out << std::endl;
-            }
+            emit_to(code, Opcode::Li, fresh_gpr(), imm(out));
             gpr_index++;
         } else if (token->index() == Real) {
             std::string decimal = std::get<2>(*token);
@@ -727,105 +809,18 @@ void Parser::fact_r(
                 throw std::runtime_error("Bad code: decimal is not valid");
             }
             values.push({VarType::Real, out});
-            if (gpr_index > gprs.size() - 1) {
-                throw std::runtime_error(
-                    "Bad code: expression is too complicated");
-            }
-            if (!stream) {
-                asm_output << "mov " << gprs[gpr_index] << ", " << out
-                           << std::endl;
-            } else {
-                stream->get()
-                    << "mov " << gprs[gpr_index] << ", " << out << std::endl;
-            }
+            emit_to(code, Opcode::Li, fresh_gpr(), real(out));
             gpr_index++;
         }
         index++;
         token = lexer->get_token();
     } else if (token->index() == Word) {
-        if (const auto local_var_data =
-                symtab.get_var_info(std::get<0>(*token));
-            local_var_data) {
-            if (gpr_index > gprs.size() - 1) {
-                throw std::runtime_error(
-                    "Bad code: exceeded available registers");
-            }
-            if (!symtab.cur_scope->name.empty()) {
-                if (!local_var_data->is_param) {
-                    if (!stream) {
-                        asm_output << "MOV " << gprs[gpr_index] << ", [EDI - "
-                                   << local_var_data->offset << "]"
-                                   << std::endl;
-                    } else {
-                        stream->get()
-                            << "MOV " << gprs[gpr_index] << ", [EDI - "
-                            << local_var_data->offset << "]" << std::endl;
-                    }
-                    gpr_index++;
-                } else {
-                    if (!local_var_data->pass_by_ref) {
-                        if (!stream) {
-                            asm_output << "MOV " << gprs[gpr_index]
-                                       << ", [EDI + " << local_var_data->offset
-                                       << "]" << std::endl;
-                        } else {
-                            stream->get()
-                                << "MOV " << gprs[gpr_index] << ", [EDI + "
-                                << local_var_data->offset << "]" << std::endl;
-                        }
-                        gpr_index++;
-                    } else {
-                        if (!stream) {
-                            asm_output << "MOV ESI, [EDI - "
-                                       << local_var_data->offset << "]"
-                                       << std::endl
-                                       << "MOV " << gprs[gpr_index] << ", [ESI]"
-                                       << std::endl;
-                        } else {
-                            stream->get()
-                                << "MOV ESI, [EDI - " << local_var_data->offset
-                                << "]" << std::endl
-                                << "MOV " << gprs[gpr_index] << ", [ESI]"
-                                << std::endl;
-                        }
-                        gpr_index++;
-                    }
-                }
-            } else {
-                if (!stream) {
-                    asm_output << "MOV " << gprs[gpr_index] << ", [EBP + "
-                               << local_var_data->offset << "]" << std::endl;
-                } else {
-                    stream->get() << "MOV " << gprs[gpr_index] << ", [EBP + "
-                                  << local_var_data->offset << "]" << std::endl;
-                }
-                gpr_index++;
-            }
-            values.push({local_var_data->type, std::nullopt});
+        const auto entity = symtab.resolve(std::get<0>(*token));
+        if (entity && entity->kind == EntityKind::Variable) {
             index++;
             token = lexer->get_token();
-        } else if (const auto global_var_data =
-                       symtab.find(std::get<0>(*token));
-                   global_var_data) {
-            const auto vdata = std::get<VarData>(*global_var_data);
-            index++;
-            token = lexer->get_token();
-            values.push({vdata.type, std::nullopt});
-            if (gpr_index > gprs.size() - 1) {
-                throw std::runtime_error(
-                    "Bad code: exceeded available registers");
-            }
-            if (!stream) {
-                asm_output << "MOV " << gprs[gpr_index] << ", [EBP + "
-                           << vdata.offset << "]" << std::endl;
-            } else {
-                stream->get() << "MOV " << gprs[gpr_index] << ", [EBP + "
-                              << vdata.offset << "]" << std::endl;
-            }
-            gpr_index++;
-        } else if (const auto funcdata =
-                       symtab.find(std::get<0>(*token), FindType::Function);
-                   funcdata) {
+            values.push({load_variable(code, *entity), std::nullopt});
+        } else if (entity && entity->kind == EntityKind::Function) {
             index++;
             token = lexer->get_token();
             if (token->index() != Special || std::get<3>(*token) != "(") {
@@ -834,36 +829,110 @@ void Parser::fact_r(
             }
             index++;
             token = lexer->get_token();
-            consume_params(std::get<FuncData>(*funcdata));
+            consume_params(entity->func());
             if (token->index() != Special || std::get<3>(*token) != ")") {
                 throw std::runtime_error(
                     "Bad code: call expression requires termination");
             }
             index++;
             token = lexer->get_token();
-            const auto rhs = values.top();
-            values.pop();
-            const auto lhs = values.top();
-            values.pop();
-            if (lhs.type != rhs.type) {
-                throw std::runtime_error(
-                    "Bad code: return type doesn't match variable type");
-            }
+            fresh_gpr();
+            gpr_index++;
+            values.push({entity->func().result, std::nullopt});
+        } else {
+            nlohmann::json data;
+            data["name"] = std::get<0>(*token);
+            throw std::runtime_error(
+                inja::render("Bad code: {{name}} is not declared", data));
         }
     } else {
         throw std::runtime_error("Bad code: expected grouped expression, "
                                  "additive or subtractive "
                                  "operator, integer, real, or word");
     }
+    if (gpr_index > depth) {
+        gprs[gpr_index - 1].begin = begin;
+    }
+}
+
+auto Parser::fold(const std::string_view op, const VarValue &lhs,
+                  const VarValue &rhs) -> std::optional<Literal> {
+    if (!lhs.literal || !rhs.literal) {
+        return std::nullopt;
+    }
+    if (const auto *const x = std::get_if<float>(&*lhs.literal)) {
+        const auto *const y = std::get_if<float>(&*rhs.literal);
+        if (!y) {
+            return std::nullopt;
+        }
+        return op == "+"   ? *x + *y
+               : op == "-" ? *x - *y
+               : op == "*" ? *x * *y
+                           : *x / *y;
+    }
+    const auto *const x = std::get_if<std::int32_t>(&*lhs.literal);
+    const auto *const y = std::get_if<std::int32_t>(&*rhs.literal);
+    if (!x || !y) {
+        return std::nullopt;
+    }
+    const std::int64_t a = *x;
+    const std::int64_t b = *y;
+    std::int64_t result = 0;
+    if (op == "+") {
+        result = a + b;
+    } else if (op == "-") {
+        result = a - b;
+    } else if (op == "*") {
+        result = a * b;
+    } else if (b == 0 || (a == std::numeric_limits<std::int32_t>::min() &&
+                          b == -1)) {
+        // IDIV faults on these when the program runs.
+        return std::nullopt;
+    } else {
+        result = a / b;
+    }
+    // Wrapped to 32 bits, as the machine would leave it
+    return static_cast<std::int32_t>(static_cast<std::uint32_t>(result));
+}
+
+void Parser::load_folded(Code *code, const VarValue &value,
+                         const std::uint16_t count) {
+    const auto begin = gprs[gpr_index - count].begin;
+    target(code).resize(begin);
+    gpr_index = static_cast<std::uint16_t>(gpr_index - count);
+    if (const auto *const real_value = std::get_if<float>(&*value.literal)) {
+        emit_to(code, Opcode::Li, fresh_gpr(), real(*real_value));
+    } else {
+        emit_to(code, Opcode::Li, fresh_gpr(),
+                imm(std::get<std::int32_t>(*value.literal)));
+    }
+    gprs[gpr_index].begin = begin;
+    gpr_index++;
+    values.push(value);
+}
+
+// Evaluating the operand that needs more registers first means the other one
+// holds no register meanwhile. Every value has a virtual register of its own,
+// so the instruction combining them stays as it is whichever runs first.
+void Parser::order_operands(Code *code) {
+    auto &lhs = gprs[gpr_index - 2];
+    const auto &rhs = gprs[gpr_index - 1];
+    if (rhs.need > lhs.need) {
+        auto &out = target(code);
+        std::rotate(out.begin() + static_cast<std::ptrdiff_t>(lhs.begin),
+                    out.begin() + static_cast<std::ptrdiff_t>(rhs.begin),
+                    out.end());
+    }
+    lhs.need = lhs.need == rhs.need ? static_cast<std::uint16_t>(lhs.need + 1)
+                                    : std::max(lhs.need, rhs.need);
 }
 
-void Parser::fact_prime(
-    std::optional<std::reference_wrapper<std::stringstream>> stream) {
+void Parser::fact_prime(Code *code) {
     if (token->index() == Special) {
         if (auto tok = std::get<3>(*token); tok == "*" || tok == "/") {
             index++;
             token = lexer->get_token();
-            fact_r(stream);
+            fact_r(code);
             const auto rhs = values.top();
             values.pop();
             const auto lhs = values.top();
@@ -872,138 +941,34 @@ void Parser::fact_prime(
                  rhs.type == VarType::Integer) ||
                 (lhs.type == VarType::Character &&
                  rhs.type == VarType::Character)) {
-                if (gpr_index > gprs.size() - 1) {
-                    throw std::runtime_error(
-                        "Bad code: exceeded available registers");
-                }
-                if (lhs.literal && rhs.literal) {
-                    if (tok == "*") {
-                        auto res = std::get<std::int32_t>(*lhs.literal) *
-                                   std::get<std::int32_t>(*rhs.literal);
-                        values.push({VarType::Integer, res});
-                    } else if (tok == "/") {
-                        auto res = std::get<std::int32_t>(*lhs.literal) /
-                                   std::get<std::int32_t>(*rhs.literal);
-                        values.push({VarType::Integer, res});
-                    }
+                if (const auto folded = fold(tok, lhs, rhs)) {
+                    load_folded(code, {VarType::Integer, folded});
                 } else {
-                    if (gpr_index > gprs.size() - 1) {
-                        throw std::runtime_error(
-                            "Bad code: expression is too complicated");
-                    }
+                    order_operands(code);
                     if (tok == "*") {
-                        if (!stream) {
-                            asm_output << "IMUL " << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 1] << std::endl;
-                        } else {
-                            stream->get() << "IMUL " << gprs[gpr_index - 2]
-                                          << ", " << gprs[gpr_index - 2] << ", "
-                                          << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Imul, gpr(gpr_index - 2),
+                                gpr(gpr_index - 2), gpr(gpr_index - 1));
                         gpr_index--;
                     } else if (tok == "/") {
-                        bool do_pop = false;
-                        if (gprs[gpr_index - 2] != "EAX") {
-                            if (!stream) {
-                                asm_output << "PUSH EAX" << std::endl
-                                           << "PUSH EDX" << std::endl
-                                           << "MOV EAX, " << gprs[gpr_index - 2]
-                                           << std::endl;
-                            } else {
-                                stream->get()
-                                    << "PUSH EAX" << std::endl
-                                    << "PUSH EDX" << std::endl
-                                    << "MOV EAX, " << gprs[gpr_index - 2]
-                                    << std::endl;
-                            }
-                            do_pop = !do_pop;
-                        }
-                        if (!stream) {
-                            asm_output << "CDQ" << std::endl
-                                       << "IDIV " << gprs[gpr_index - 1]
-                                       << std::endl;
-                        } else {
-                            stream->get()
-                                << "CDQ" << std::endl
-                                << "IDIV " << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Divide, gpr(gpr_index - 2),
+                                gpr(gpr_index - 1));
                         gpr_index--;
-                        if (do_pop) {
-                            if (!stream) {
-                                asm_output << "POP EDX" << std::endl
-                                           << "POP EAX" << std::endl;
-                            } else {
-                                stream->get() << "POP EDX" << std::endl
-                                              << "POP EAX" << std::endl;
-                            }
-                        }
                     }
                     values.push({VarType::Integer, std::nullopt});
                 }
             } else if (lhs.type == VarType::Real && rhs.type == VarType::Real) {
-                if (lhs.literal && rhs.literal) {
-                    if (tok == "*") {
-                        auto res = std::get<float>(*lhs.literal) *
-                                   std::get<float>(*rhs.literal);
-                        values.push({VarType::Real, res});
-                    } else if (tok == "/") {
-                        auto res = std::get<float>(*lhs.literal) /
-                                   std::get<float>(*rhs.literal);
-                        values.push({VarType::Real, res});
-                    }
+                if (const auto folded = fold(tok, lhs, rhs)) {
+                    load_folded(code, {VarType::Real, folded});
                 } else {
-                    if (gpr_index > gprs.size() - 1) {
-                        throw std::runtime_error(
-                            "Bad code: expression is too complicated");
-                    }
+                    order_operands(code);
                     if (tok == "*") {
-                        if (!stream) {
-                            asm_output << "IMUL " << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 2] << ", "
-                                       << gprs[gpr_index - 1] << std::endl;
-                        } else {
-                            stream->get() << "IMUL " << gprs[gpr_index - 2]
-                                          << ", " << gprs[gpr_index - 2] << ", "
-                                          << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Imul, gpr(gpr_index - 2),
+                                gpr(gpr_index - 2), gpr(gpr_index - 1));
                         gpr_index--;
                     } else if (tok == "/") {
-                        bool do_pop = false;
-                        if (gprs[gpr_index - 2] != "EAX") {
-                            if (!stream) {
-                                asm_output << "PUSH EAX" << std::endl
-                                           << "PUSH EDX" << std::endl
-                                           << "MOV EAX, " << gprs[gpr_index - 2]
-                                           << std::endl;
-                            } else {
-                                stream->get()
-                                    << "PUSH EAX" << std::endl
-                                    << "PUSH EDX" << std::endl
-                                    << "MOV EAX, " << gprs[gpr_index - 2]
-                                    << std::endl;
-                            }
-                            do_pop = !do_pop;
-                        }
-                        if (!stream) {
-                            asm_output << "CDQ" << std::endl
-                                       << "IDIV " << gprs[gpr_index - 1]
-                                       << std::endl;
-                        } else {
-                            stream->get()
-                                << "CDQ" << std::endl
-                                << "IDIV " << gprs[gpr_index - 1] << std::endl;
-                        }
+                        emit_to(code, Opcode::Divide, gpr(gpr_index - 2),
+                                gpr(gpr_index - 1));
                         gpr_index--;
-                        if (do_pop) {
-                            if (!stream) {
-                                asm_output << "POP EDX" << std::endl
-                                           << "POP EAX" << std::endl;
-                            } else {
-                                stream->get() << "POP EDX" << std::endl
-                                              << "POP EAX" << std::endl;
-                            }
-                        }
                     }
                     values.push({VarType::Real, std::nullopt});
                 }
@@ -1012,31 +977,17 @@ void Parser::fact_prime(
                     "Bad code: invalid type on left-or right-hand side of "
                     "expression");
             }
-            fact_prime(stream);
+            fact_prime(code);
         }
     } else if (token->index() == ReservedWord) {
         if (auto tok = std::get<4>(*token); tok == "and") {
             index++;
             token = lexer->get_token();
-            if (!stream) {
-                if (last_comparison == '<') {
-                    asm_output << "JGE or" << or_count << std::endl;
-                } else if (last_comparison == '>') {
-                    asm_output << "JLE or" << or_count << std::endl;
-                } else if (last_comparison == '=') {
-                    asm_output << "JNE or" << or_count << std::endl;
-                }
-            } else {
-                if (last_comparison == '<') {
-                    stream->get() << "JGE or" << or_count << std::endl;
-                } else if (last_comparison == '>') {
-                    stream->get() << "JLE or" << or_count << std::endl;
-                } else if (last_comparison == '=') {
-                    stream->get() << "JNE or" << or_count << std::endl;
-                }
+            if (const auto jump = comparison_jump(); jump) {
+                emit_to(code, inverse(*jump), label(LabelKind::Or, or_count));
             }
             or_used = true;
-            fact_r(stream);
+            fact_r(code);
             const auto lhs = values.top();
             values.pop();
             const auto rhs = values.top();
@@ -1047,7 +998,7 @@ void Parser::fact_prime(
                 throw std::runtime_error("Bad code: expected type boolean "
                                          "for conjunctive 'and'");
             }
-            fact_prime(stream);
+            fact_prime(code);
         }
     }
 }
@@ -1057,200 +1008,446 @@ void Parser::pfv() {
         if (auto tok = std::get<4>(*token); tok == "var") {
             index++;
             token = lexer->get_token();
-            const auto var = std::get<0>(*token);
-            if (token->index() != Word) {
-                throw std::runtime_error(
-                    "Bad code: variable has invalid identifier");
-            }
-            temporaries.push_back(var);
-            index++;
-            token = lexer->get_token();
-            varlist();
-            if (token->index() != Special || std::get<3>(*token) != ":") {
-                throw std::runtime_error(
-                    "Bad code: variable must have datatype-specifier");
-            }
-            index++;
-            token = lexer->get_token();
-            datatype();
-            for (const auto &temporary : temporaries) {
-                std::uint64_t size = 0;
-                VarType vtype;
-                if (std::get<0>(*token) == "integer") {
-                    vtype = VarType::Integer;
-                    size = 4;
-                } else if (std::get<0>(*token) == "boolean") {
-                    vtype = VarType::Boolean;
-                    size = 4;
-                } else if (std::get<0>(*token) == "char") {
-                    vtype = VarType::Character;
-                    size = 4;
-                } else if (std::get<0>(*token) == "real") {
-                    vtype = VarType::Real;
-                    size = 4;
-                } else {
-                    nlohmann::json data;
-                    data["type"] = std::get<0>(*token);
-                    throw std::runtime_error(inja::render(
-                        "Bad code: type {{type}} is not valid", data));
-                }
-                if (!symtab.add_variable(temporary, vtype, size)) {
-                    nlohmann::json data;
-                    data["temporary"] = temporary;
-                    throw std::runtime_error(inja::render(
-                        "Bad code: variable {{temporary}} already defined",
-                        data));
-                }
-            }
-            temporaries.clear();
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != ";") {
-                throw std::runtime_error("Bad code: expected ';' to "
-                                         "terminate variable declaration");
-            }
-            index++;
-            token = lexer->get_token();
+            recoverable([this] { var_declaration(); },
+                        &Parser::skip_declaration);
             mvar();
             pfv();
         } else if (tok == "procedure") {
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Word) {
-                throw std::runtime_error(
-                    "Bad code: procedure has invalid identifier");
-            }
-            if (!symtab.enter_proc_scope(std::get<0>(*token))) {
-                throw std::runtime_error("Bad code: cannot redeclare a "
-                                         "procedure that already exists");
-            }
-            asm_output << std::get<0>(*token) << ":" << std::endl;
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != "(") {
-                throw std::runtime_error("Bad code: missing required "
-                                         "parameter list for procedure");
-            }
-            index++;
-            token = lexer->get_token();
-            param();
-            if (token->index() != Special || std::get<3>(*token) != ")") {
-                throw std::runtime_error(
-                    "Bad code: parameter list must be terminated with ')'");
-            }
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != ";") {
-                throw std::runtime_error("Bad code: procedure declaration must "
-                                         "be terminated with ';'");
-            }
-            index++;
-            token = lexer->get_token();
-            block();
-            if (token->index() != Special || std::get<3>(*token) != ";") {
-                throw std::runtime_error("Bad code: procedure definition must "
-                                         "be terminated with ';'");
-            }
-            std::vector<std::uint64_t> parameters;
-            std::vector<std::uint64_t> variables;
-            for (const auto &[_, v] : symtab.cur_scope->table) {
-                if (std::holds_alternative<VarData>(v)) {
-                    const auto vdata = std::get<VarData>(v);
-                    if (vdata.is_param) {
-                        parameters.push_back(vdata.size);
-                    } else {
-                        variables.push_back(vdata.size);
-                    }
-                }
-            }
-            asm_output << "POPAD" << std::endl;
-            if (const auto all_variables_size =
-                    std::accumulate(variables.cbegin(), variables.cend(), 0);
-                all_variables_size != 0) {
-                asm_output << "ADD ESP, " << all_variables_size << std::endl;
-            }
-            asm_output << "POP EDI" << std::endl;
-            if (const auto all_parameters_size =
-                    std::accumulate(parameters.cbegin(), parameters.cend(), 0);
-                all_parameters_size != 0) {
-                asm_output << "RET " << all_parameters_size << std::endl;
-            } else {
-                asm_output << "RET" << std::endl;
-            }
-            symtab.leave_scope();
-            index++;
-            token = lexer->get_token();
+            recoverable([this] { procedure_declaration(); },
+                        &Parser::skip_subprogram);
             pfv();
         } else if (tok == "function") {
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Word) {
-                throw std::runtime_error(
-                    "Bad code: function has invalid identifier");
-            }
-            const auto func_name = std::get<0>(*token);
-            if (!symtab.enter_func_scope(func_name)) {
-                throw std::runtime_error(
-                    "Bad code: cannot redeclare a function");
-            }
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != "(") {
-                throw std::runtime_error("Bad code: missing required "
-                                         "parameter list for procedure");
-            }
-            index++;
-            token = lexer->get_token();
-            param();
-            if (token->index() != Special || std::get<3>(*token) != ")") {
-                throw std::runtime_error(
-                    "Bad code: parameter list must be terminated with ')'");
-            }
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != ":") {
-                throw std::runtime_error("Bad code: missing datatype "
-                                         "specification indicator ':'");
-            }
-            index++;
-            token = lexer->get_token();
-            datatype();
-            bool success = false;
-            if (auto dtype = std::get<0>(*token); dtype == "integer") {
-                success = symtab.add_variable(func_name, VarType::Integer, 4);
-            } else if (dtype == "boolean") {
-                success = symtab.add_variable(func_name, VarType::Boolean, 1);
-            } else if (dtype == "char") {
-                success = symtab.add_variable(func_name, VarType::Character, 1);
-            } else if (dtype == "real") {
-                success = symtab.add_variable(func_name, VarType::Real, 8);
-            }
-            // This should never, ever happen.
-            if (!success) {
-                nlohmann::json data;
-                data["func_name"] = func_name;
-                throw std::runtime_error(inja::render(
-                    "Bad code: function {{func_name}} already defined", data));
+            recoverable([this] { function_declaration(); },
+                        &Parser::skip_subprogram);
+            pfv();
+        }
+    }
+}
+
+void Parser::var_declaration() {
+    const auto var = std::get<0>(*token);
+    if (token->index() != Word) {
+        throw std::runtime_error("Bad code: variable has invalid identifier");
+    }
+    temporaries.push(var);
+    index++;
+    token = lexer->get_token();
+    varlist();
+    if (token->index() != Special || std::get<3>(*token) != ":") {
+        throw std::runtime_error(
+            "Bad code: variable must have datatype-specifier");
+    }
+    index++;
+    token = lexer->get_token();
+    const auto type = datatype();
+    for (const auto &temporary : temporaries) {
+        if (!symtab.add_variable(temporary, type)) {
+            nlohmann::json data;
+            data["temporary"] = temporary;
+            throw std::runtime_error(inja::render(
+                "Bad code: variable {{temporary}} already defined", data));
+        }
+    }
+    temporaries.clear();
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error("Bad code: expected ';' to "
+                                 "terminate variable declaration");
+    }
+    index++;
+    token = lexer->get_token();
+}
+
+void Parser::procedure_declaration() {
+    const auto top_level = !symtab.cur_scope->previous;
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Word) {
+        throw std::runtime_error("Bad code: procedure has invalid identifier");
+    }
+    const auto proc_name = std::get<0>(*token);
+    if (top_level) {
+        check_unit_routine(proc_name);
+    }
+    if (!symtab.enter_proc_scope(proc_name)) {
+        throw std::runtime_error("Bad code: cannot redeclare a "
+                                 "procedure that already exists");
+    }
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != "(") {
+        throw std::runtime_error("Bad code: missing required "
+                                 "parameter list for procedure");
+    }
+    index++;
+    token = lexer->get_token();
+    param();
+    if (token->index() != Special || std::get<3>(*token) != ")") {
+        throw std::runtime_error(
+            "Bad code: parameter list must be terminated with ')'");
+    }
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error("Bad code: procedure declaration must "
+                                 "be terminated with ';'");
+    }
+    index++;
+    token = lexer->get_token();
+    if (top_level) {
+        defer_body(proc_name, false);
+    } else {
+        procedure_body(proc_name);
+    }
+    symtab.leave_scope();
+    index++;
+    token = lexer->get_token();
+}
+
+void Parser::function_declaration() {
+    const auto top_level = !symtab.cur_scope->previous;
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Word) {
+        throw std::runtime_error("Bad code: function has invalid identifier");
+    }
+    const auto func_name = std::get<0>(*token);
+    if (top_level) {
+        check_unit_routine(func_name);
+    }
+    if (!symtab.enter_func_scope(func_name)) {
+        throw std::runtime_error("Bad code: cannot redeclare a function");
+    }
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != "(") {
+        throw std::runtime_error("Bad code: missing required "
+                                 "parameter list for procedure");
+    }
+    index++;
+    token = lexer->get_token();
+    param();
+    if (token->index() != Special || std::get<3>(*token) != ")") {
+        throw std::runtime_error(
+            "Bad code: parameter list must be terminated with ')'");
+    }
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != ":") {
+        throw std::runtime_error("Bad code: missing datatype "
+                                 "specification indicator ':'");
+    }
+    index++;
+    token = lexer->get_token();
+    const auto type = datatype();
+    const auto result = symtab.type_table().scalar_of(type);
+    if (!result) {
+        throw std::runtime_error(
+            "Bad code: function result must not be an array or record");
+    }
+    // This should never, ever happen.
+    if (!symtab.add_variable(func_name, type)) {
+        nlohmann::json data;
+        data["func_name"] = func_name;
+        throw std::runtime_error(inja::render(
+            "Bad code: function {{func_name}} already defined", data));
+    }
+    symtab.set_result(*result);
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error("Bad code: function declaration must "
+                                 "be terminated with ';'");
+    }
+    index++;
+    token = lexer->get_token();
+    if (top_level) {
+        defer_body(func_name, true);
+    } else {
+        function_body();
+    }
+    symtab.leave_scope();
+    index++;
+    token = lexer->get_token();
+}
+
+void Parser::procedure_body(const std::string &name) {
+    emit(Opcode::Label, routine().named(name));
+    block();
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error("Bad code: procedure definition must "
+                                 "be terminated with ';'");
+    }
+    const auto &frame = symtab.cur_scope->frame;
+    const auto frame_size = frame.locals_size() + allocate_body_registers();
+    emit(Opcode::Popad);
+    if (frame_size != 0) {
+        emit(Opcode::Add, reg(Register::ESP),
+             imm(static_cast<std::int64_t>(frame_size)));
+    }
+    emit(Opcode::Pop, reg(Register::EDI));
+    if (const auto parameters_size = frame.parameters_size();
+        parameters_size != 0) {
+        emit(Opcode::Ret, imm(static_cast<std::int64_t>(parameters_size)));
+    } else {
+        emit(Opcode::Ret);
+    }
+}
+
+void Parser::function_body() {
+    block();
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error("Bad code: function definition must "
+                                 "be terminated with ';'");
+    }
+    allocate_body_registers();
+}
+
+// The main program has every register to itself. A frame keeps EDI, which
+// points at it.
+static constexpr std::array<Register, 6> MAIN_REGISTERS = {
+    Register::EAX, Register::EBX, Register::ECX,
+    Register::EDX, Register::ESI, Register::EDI};
+static constexpr std::array<Register, 5> FRAME_REGISTERS = {
+    Register::EAX, Register::EBX, Register::ECX, Register::EDX,
+    Register::ESI};
+
+// Spilled values go below the locals of a frame, whose prologue then reserves
+// room for them too, or past the globals in the data segment.
+auto Parser::allocate_body_registers() -> std::uint64_t {
+    if (options.syntax_only) {
+        return 0;
+    }
+    // A function leaves its value in the variable named after it.
+    const auto &scope = *symtab.cur_scope;
+    std::optional<Operand> result;
+    if (const auto found = scope.table.find(scope.name);
+        !scope.name.empty() && found != scope.table.end()) {
+        if (const auto *var = std::get_if<VarData>(&found->second);
+            var && !var->is_param) {
+            result = mem(Register::EDI, '-',
+                         static_cast<std::int64_t>(var->offset));
+            if (var->size == 1) {
+                result->kind = OperandKind::BytePointer;
             }
-            index++;
-            token = lexer->get_token();
-            if (token->index() != Special || std::get<3>(*token) != ";") {
-                throw std::runtime_error("Bad code: function declaration must "
-                                         "be terminated with ';'");
+        }
+    }
+    simplify_control_flow(routine(), body_begin, result, flow_counts);
+    auto &code = routine().code;
+    peephole(code, body_begin, peephole_counts);
+    const auto &frame = scope.frame;
+    if (scope.name.empty()) {
+        const auto base = (frame.globals_size() + FrameLayout::SLOT - 1) /
+                          FrameLayout::SLOT * FrameLayout::SLOT;
+        allocate_registers(code, body_begin, MAIN_REGISTERS,
+                           [&](const std::uint32_t n) {
+                               return mem(Register::EBP, '+',
+                                          static_cast<std::int64_t>(
+                                              base + FrameLayout::SLOT * n));
+                           });
+        return 0;
+    }
+    const auto locals_size = frame.locals_size();
+    const auto allocation = allocate_registers(
+        code, body_begin, FRAME_REGISTERS, [&](const std::uint32_t n) {
+            return mem(Register::EDI, '-',
+                       static_cast<std::int64_t>(locals_size +
+                                                 FrameLayout::SLOT * (n + 1)));
+        });
+    if (allocation.slots == 0) {
+        return 0;
+    }
+    // The prologue is PUSH EDI and MOV EDI, ESP, then SUB ESP if there are
+    // locals.
+    const auto spills = FrameLayout::SLOT * allocation.slots;
+    const auto reserve =
+        code.begin() + static_cast<std::ptrdiff_t>(body_begin) + 2;
+    if (locals_size != 0) {
+        reserve->operands[1] =
+            imm(static_cast<std::int64_t>(locals_size + spills));
+    } else {
+        code.insert(reserve, {Opcode::Sub,
+                              {reg(Register::ESP),
+                               imm(static_cast<std::int64_t>(spills))}});
+    }
+    return spills;
+}
+
+auto Parser::BodyScanner::feed(const Token &tok) -> bool {
+    if (tok.index() == ReservedWord) {
+        if (const auto &word = std::get<4>(tok);
+            word == "procedure" || word == "function") {
+            pending_bodies++;
+        } else if (word == "begin") {
+            depth++;
+        } else if (word == "end" && depth > 0) {
+            depth--;
+            if (depth == 0) {
+                pending_bodies--;
             }
-            index++;
-            token = lexer->get_token();
-            block();
-            if (token->index() != Special || std::get<3>(*token) != ";") {
-                throw std::runtime_error("Bad code: function definition must "
-                                         "be terminated with ';'");
+        }
+    }
+    return pending_bodies == 0;
+}
+
+// Sets aside the tokens of a top-level body, through the ';' that ends it,
+// together with a copy of its declaration scope. Nested procedures count as
+// part of the body. Leaves `token` on the terminating ';'.
+void Parser::defer_body(const std::string &name, const bool is_function) {
+    BodyTask task;
+    task.name = name;
+    task.is_function = is_function;
+    task.declaration = symtab.cur_scope;
+    task.scope = task.scopes.make(*symtab.cur_scope);
+    task.horizon = symtab.cur_scope->previous->table.size();
+    task.begin = lexer->position();
+    BodyScanner scanner;
+    bool closed = false;
+    while (token && !closed) {
+        task.tokens.push_back(*token);
+        task.positions.push_back(lexer->position());
+        closed = scanner.feed(*token);
+        token = lexer->get_token();
+    }
+    if (!token) {
+        throw std::runtime_error("Bad code: unterminated block");
+    }
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error(is_function
+                                     ? "Bad code: function definition must "
+                                       "be terminated with ';'"
+                                     : "Bad code: procedure definition must "
+                                       "be terminated with ';'");
+    }
+    task.tokens.push_back(*token);
+    task.positions.push_back(lexer->position());
+    task.end = lexer->position();
+    task.end.offset++;
+    task.end.column++;
+    deferred.push_back(std::move(task));
+}
+
+// Parses every deferred body, spreading them over `options.jobs` threads, and
+// appends their code in source order so the listing does not depend on
+// scheduling. The threads share only the global scope, frozen into a copy
+// that nothing writes to.
+void Parser::parse_deferred_bodies() {
+    bodies_parsed = true;
+    if (deferred.empty()) {
+        return;
+    }
+    // The workers only read the global scope, through a copy that is never
+    // written.
+    globals = symtab.freeze();
+    std::atomic<std::size_t> next_task = 0;
+    const auto work = [&] {
+        for (auto i = next_task++; i < deferred.size(); i = next_task++) {
+            auto &task = deferred[i];
+            Parser body(task, *globals, symtab.type_table(), options);
+            task.code = std::move(body.routine());
+            task.parsed = body.index;
+            task.errors = std::move(body.errors);
+            task.stats = body.symtab.stats();
+            task.peephole = body.peephole_counts;
+            task.flow = body.flow_counts;
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        const auto threads =
+            std::min<std::size_t>(std::max(options.jobs, 1u), deferred.size());
+        for (std::size_t i = 1; i < threads; ++i) {
+            workers.emplace_back(work);
+        }
+        work();
+    }
+    for (const auto &task : deferred) {
+        if constexpr (SYMTAB_COUNTERS) {
+            body_stats.merge(task.stats);
+        }
+        peephole_counts.merge(task.peephole);
+        flow_counts.merge(task.flow);
+    }
+    if (retain_bodies) {
+        return;
+    }
+    for (auto &task : deferred) {
+        errors.insert(errors.end(), task.errors.cbegin(), task.errors.cend());
+        index += task.parsed;
+        listing.routines.push_back(std::move(task.code));
+    }
+    deferred.clear();
+}
+
+// Where `position`, at or after the end of an edited range, ends up once the
+// range that ended at `old_end` ends at `new_end`.
+static auto shifted(SourcePosition position, const SourcePosition old_end,
+                    const SourcePosition new_end) -> SourcePosition {
+    if (position.line == old_end.line) {
+        position.column = position.column - old_end.column + new_end.column;
+    }
+    position.line = position.line - old_end.line + new_end.line;
+    position.offset = position.offset - old_end.offset + new_end.offset;
+    return position;
+}
+
+auto Parser::reparse_body(const std::size_t i, const std::string_view source,
+                          const SourcePosition old_end,
+                          const SourcePosition new_end) -> bool {
+    for (auto later = i + 1; later < deferred.size(); ++later) {
+        auto &task = deferred[later];
+        task.begin = shifted(task.begin, old_end, new_end);
+        task.end = shifted(task.end, old_end, new_end);
+        for (auto &error : task.errors) {
+            error.position = shifted(error.position, old_end, new_end);
+        }
+    }
+    for (auto &error : errors) {
+        if (error.position.offset >= old_end.offset) {
+            error.position = shifted(error.position, old_end, new_end);
+        }
+    }
+    auto &task = deferred[i];
+    task.end = shifted(task.end, old_end, new_end);
+    task.errors.clear();
+    task.tokens.clear();
+    task.positions.clear();
+    try {
+        Lexer relexed(source.substr(task.begin.offset,
+                                    task.end.offset - task.begin.offset),
+                      task.begin);
+        BodyScanner scanner;
+        bool closed = false;
+        bool terminated = false;
+        while (const auto tok = relexed.get_token()) {
+            // Once the body is closed only its ';' may follow.
+            if (terminated) {
+                return false;
+            }
+            if (closed) {
+                if (tok->index() != Special || std::get<3>(*tok) != ";") {
+                    return false;
+                }
+                terminated = true;
+            } else {
+                closed = scanner.feed(*tok);
             }
-            symtab.leave_scope();
-            index++;
-            token = lexer->get_token();
-            pfv();
+            task.tokens.push_back(*tok);
+            task.positions.push_back(relexed.position());
         }
+        if (!terminated) {
+            return false;
+        }
+    } catch (const ParseError &e) {
+        task.errors.push_back(e);
+        return true;
     }
+    task.scopes = ScopeArena();
+    task.scope = task.scopes.make(*task.declaration);
+    Parser body(task, *globals, symtab.type_table(), options);
+    task.errors = std::move(body.errors);
+    return true;
 }
 
 void Parser::varlist() {
@@ -1262,103 +1459,208 @@ void Parser::varlist() {
             throw std::runtime_error(
                 "Bad code: variable has invalid identifier");
         }
-        temporaries.push_back(var);
+        temporaries.push(var);
         index++;
         token = lexer->get_token();
         varlist();
     }
 }
 
-void Parser::datatype() {
+auto Parser::datatype() -> TypeId {
     if (token->index() == Word) {
-        if (auto dtype = std::get<0>(*token);
-            dtype != "integer" && dtype != "char" && dtype != "boolean" &&
-            dtype != "real") {
-            throw std::runtime_error("Bad code: unknown data type");
+        if (const auto &dtype = std::get<0>(*token); dtype == "integer") {
+            return TypeTable::scalar(VarType::Integer);
+        } else if (dtype == "boolean") {
+            return TypeTable::scalar(VarType::Boolean);
+        } else if (dtype == "char") {
+            return TypeTable::scalar(VarType::Character);
+        } else if (dtype == "real") {
+            return TypeTable::scalar(VarType::Real);
         }
-    } else if (token->index() == ReservedWord) {
+        throw std::runtime_error("Bad code: unknown data type");
+    }
+    if (token->index() == Integer ||
+        (token->index() == Special && std::get<3>(*token) == "-")) {
+        return subrange();
+    }
+    if (token->index() != ReservedWord) {
+        throw std::runtime_error(
+            "Bad code: expected valid data type or array specification");
+    }
+    if (std::get<4>(*token) == "record") {
+        return record_type();
+    }
     if (std::get<4>(*token) != "array") {
-throw std::runtime_error("Bad code: expected 'array' keyword or a valid data type");
-}
-index++;
-token = lexer->get_token();
-if (token->index() != Special || std::get<3>(*token) != "[") {
-throw std::runtime_error("Bad code: expected '[' for array specification");
-}
-index++;
-token = lexer->get_token();
-dim();
-if (token->index() != Special || std::get<3>(*token) != "]") {
-throw std::runtime_error("Bad code: expected ']' to end array specification");
-}
-index++;
-token = lexer->get_token();
-if (token->index() != ReservedWord || std::get<4>(*token) == "of") {
-throw std::runtime_error("Bad code: expected 'of' keyword to separate array length specification from data type");
+        throw std::runtime_error(
+            "Bad code: expected 'array' keyword or a valid data type");
+    }
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != "[") {
+        throw std::runtime_error(
+            "Bad code: expected '[' for array specification");
+    }
+    index++;
+    token = lexer->get_token();
+    std::vector<TypeId> indices;
+    dim(indices);
+    if (token->index() != Special || std::get<3>(*token) != "]") {
+        throw std::runtime_error(
+            "Bad code: expected ']' to end array specification");
+    }
+    index++;
+    token = lexer->get_token();
+    if (token->index() != ReservedWord || std::get<4>(*token) != "of") {
+        throw std::runtime_error("Bad code: expected 'of' keyword to separate "
+                                 "array length specification from data type");
+    }
+    index++;
+    token = lexer->get_token();
+    // array[a, b] of t is array[a] of array[b] of t.
+    auto type = datatype();
+    for (auto it = indices.crbegin(); it != indices.crend(); ++it) {
+        type = symtab.type_table().array(*it, type);
+    }
+    return type;
 }
-index++;
-token = lexer->get_token();
-datatype();
-} else {
-throw std::runtime_error("Bad code: expected valid data type or array specification");
+
+auto Parser::subrange() -> TypeId {
+    const auto low = bound();
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != "..") {
+        throw std::runtime_error(
+            "Bad code: expected '..' for array range specifier");
+    }
+    index++;
+    token = lexer->get_token();
+    const auto high = bound();
+    if (low > high) {
+        nlohmann::json data;
+        data["low"] = low;
+        data["high"] = high;
+        throw std::runtime_error(
+            inja::render("Bad code: range {{low}}..{{high}} is empty", data));
+    }
+    return symtab.type_table().subrange(TypeTable::scalar(VarType::Integer),
+                                        low, high);
 }
+
+auto Parser::bound() -> std::int32_t {
+    auto negative = false;
+    if (token->index() == Special && std::get<3>(*token) == "-") {
+        negative = true;
+        index++;
+        token = lexer->get_token();
+    }
+    if (token->index() != Integer) {
+        throw std::runtime_error("Bad code: expected integer for array bounds");
+    }
+    const auto &digits = std::get<1>(*token);
+    std::int64_t value = 0;
+    const auto [ptr, ec] =
+        std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    if (negative) {
+        value = -value;
+    }
+    if (ec != std::errc() || value < std::numeric_limits<std::int32_t>::min() ||
+        value > std::numeric_limits<std::int32_t>::max()) {
+        throw std::runtime_error("Bad code: integer is not valid");
+    }
+    return static_cast<std::int32_t>(value);
 }
 
-void Parser::mvar() {
-    if (token->index() == Word) {
-        const auto var = std::get<0>(*token);
-        temporaries.push_back(var);
+auto Parser::record_type() -> TypeId {
+    std::vector<Field> fields;
+    index++;
+    token = lexer->get_token();
+    while (token->index() == Word) {
+        std::vector<std::string> names{std::get<0>(*token)};
         index++;
         token = lexer->get_token();
-        varlist();
+        while (token->index() == Special && std::get<3>(*token) == ",") {
+            index++;
+            token = lexer->get_token();
+            if (token->index() != Word) {
+                throw std::runtime_error(
+                    "Bad code: field has invalid identifier");
+            }
+            names.push_back(std::get<0>(*token));
+            index++;
+            token = lexer->get_token();
+        }
         if (token->index() != Special || std::get<3>(*token) != ":") {
             throw std::runtime_error(
-                "Bad code: missing datatype specifier ':'");
+                "Bad code: field must have datatype-specifier");
         }
         index++;
         token = lexer->get_token();
-        datatype();
-        for (const auto &temporary : temporaries) {
-            std::uint64_t size = 0;
-            VarType vtype;
-            if (std::get<0>(*token) == "integer") {
-                vtype = VarType::Integer;
-                size = 4;
-            } else if (std::get<0>(*token) == "boolean") {
-                vtype = VarType::Boolean;
-                size = 4;
-            } else if (std::get<0>(*token) == "char") {
-                vtype = VarType::Character;
-                size = 4;
-            } else if (std::get<0>(*token) == "real") {
-                vtype = VarType::Real;
-                size = 4;
-            } else {
+        const auto type = datatype();
+        for (auto &name : names) {
+            if (std::ranges::find(fields, name, &Field::name) !=
+                fields.cend()) {
                 nlohmann::json data;
-                data["type"] = std::get<0>(*token);
-                throw std::runtime_error(
-                    inja::render("Bad code: type {{type}} is not valid", data));
-            }
-            if (!symtab.add_variable(temporary, vtype, size)) {
-                nlohmann::json data;
-                data["temporary"] = temporary;
+                data["name"] = name;
                 throw std::runtime_error(inja::render(
-                    "Bad code: variable {{temporary}} already defined", data));
+                    "Bad code: field {{name}} already defined", data));
             }
+            fields.push_back(
+                {.name = std::move(name), .type = type, .offset = 0});
         }
-        temporaries.clear();
         index++;
         token = lexer->get_token();
         if (token->index() != Special || std::get<3>(*token) != ";") {
-            throw std::runtime_error(
-                "Bad code: variable declaration must end with ';'");
+            break;
         }
         index++;
         token = lexer->get_token();
+    }
+    if (token->index() != ReservedWord || std::get<4>(*token) != "end") {
+        throw std::runtime_error(
+            "Bad code: expected 'end' to terminate record");
+    }
+    return symtab.type_table().record(std::move(fields));
+}
+
+void Parser::mvar() {
+    if (token->index() == Word) {
+        recoverable([this] { variable_declaration(); },
+                    &Parser::skip_declaration);
         mvar();
     }
 }
 
+void Parser::variable_declaration() {
+    const auto var = std::get<0>(*token);
+    temporaries.push(var);
+    index++;
+    token = lexer->get_token();
+    varlist();
+    if (token->index() != Special || std::get<3>(*token) != ":") {
+        throw std::runtime_error("Bad code: missing datatype specifier ':'");
+    }
+    index++;
+    token = lexer->get_token();
+    const auto type = datatype();
+    for (const auto &temporary : temporaries) {
+        if (!symtab.add_variable(temporary, type)) {
+            nlohmann::json data;
+            data["temporary"] = temporary;
+            throw std::runtime_error(inja::render(
+                "Bad code: variable {{temporary}} already defined", data));
+        }
+    }
+    temporaries.clear();
+    index++;
+    token = lexer->get_token();
+    if (token->index() != Special || std::get<3>(*token) != ";") {
+        throw std::runtime_error(
+            "Bad code: variable declaration must end with ';'");
+    }
+    index++;
+    token = lexer->get_token();
+}
+
 void Parser::param() {
     auto pass_by_reference = false;
     if (token->index() == ReservedWord && std::get<4>(*token) == "var") {
@@ -1368,7 +1670,7 @@ void Parser::param() {
     }
     if (token->index() == Word) {
         const auto var = std::get<0>(*token);
-        temporaries.push_back(var);
+        temporaries.push(var);
         index++;
         token = lexer->get_token();
         varlist();
@@ -1379,29 +1681,13 @@ void Parser::param() {
         }
         index++;
         token = lexer->get_token();
-        datatype();
+        const auto type = datatype();
+        if (!pass_by_reference && !symtab.type_table().scalar_of(type)) {
+            throw std::runtime_error("Bad code: arrays and records can only "
+                                     "be passed by reference");
+        }
         for (const auto &temporary : temporaries) {
-            std::uint64_t size = 0;
-            VarType vtype;
-            if (std::get<0>(*token) == "integer") {
-                vtype = VarType::Integer;
-                size = 4;
-            } else if (std::get<0>(*token) == "boolean") {
-                vtype = VarType::Boolean;
-                size = 4;
-            } else if (std::get<0>(*token) == "char") {
-                vtype = VarType::Character;
-                size = 4;
-            } else if (std::get<0>(*token) == "real") {
-                vtype = VarType::Real;
-                size = 4;
-            } else {
-                nlohmann::json data;
-                data["type"] = std::get<0>(*token);
-                throw std::runtime_error(
-                    inja::render("Bad code: type {{type}} is not valid", data));
-            }
-            if (!symtab.add_variable(temporary, vtype, size, pass_by_reference,
+            if (!symtab.add_variable(temporary, type, pass_by_reference,
                                      true)) {
                 nlohmann::json data;
                 data["temporary"] = temporary;
@@ -1431,7 +1717,7 @@ void Parser::mparam() {
                 "Bad code: parameter has invalid identifier");
         }
         const auto var = std::get<0>(*token);
-        temporaries.push_back(var);
+        temporaries.push(var);
         index++;
         token = lexer->get_token();
         varlist();
@@ -1442,29 +1728,13 @@ void Parser::mparam() {
         }
         index++;
         token = lexer->get_token();
-        datatype();
+        const auto type = datatype();
+        if (!pass_by_reference && !symtab.type_table().scalar_of(type)) {
+            throw std::runtime_error("Bad code: arrays and records can only "
+                                     "be passed by reference");
+        }
         for (const auto &temporary : temporaries) {
-            std::uint64_t size = 0;
-            VarType vtype;
-            if (std::get<0>(*token) == "integer") {
-                vtype = VarType::Integer;
-                size = 4;
-            } else if (std::get<0>(*token) == "boolean") {
-                vtype = VarType::Boolean;
-                size = 1;
-            } else if (std::get<0>(*token) == "char") {
-                vtype = VarType::Character;
-                size = 1;
-            } else if (std::get<0>(*token) == "real") {
-                vtype = VarType::Real;
-                size = 4;
-            } else {
-                nlohmann::json data;
-                data["type"] = std::get<0>(*token);
-                throw std::runtime_error(
-                    inja::render("Bad code: type {{type}} is not valid", data));
-            }
-            if (!symtab.add_variable(temporary, vtype, size, pass_by_reference,
+            if (!symtab.add_variable(temporary, type, pass_by_reference,
                                      true)) {
                 nlohmann::json data;
                 data["temporary"] = temporary;
@@ -1479,51 +1749,235 @@ void Parser::mparam() {
     }
 }
 
-void Parser::consume_params(const ProcData proc) {
-    const auto scope = proc.next;
-    std::vector<VarData> parameters;
-    for (const auto &[name, el] : scope->table) {
-        auto var = std::get<VarData>(el);
-        if (var.is_param) {
-            var.name = name;
-            parameters.push_back(var);
+auto Parser::variable_operand(Code *code, const Entity &entity) -> Operand {
+    const auto &var = entity.var();
+    const auto offset = static_cast<std::int64_t>(var.offset);
+    if (entity.depth != symtab.cur_scope->depth ||
+        symtab.cur_scope->name.empty()) {
+        return mem(Register::EBP, '+', offset);
+    }
+    if (!var.is_param) {
+        return mem(Register::EDI, '-', offset);
+    }
+    if (!var.pass_by_ref) {
+        return mem(Register::EDI, '+', offset);
+    }
+    emit_to(code, Opcode::Mov, reg(Register::ESI),
+            mem(Register::EDI, '+', offset));
+    return mem(Register::ESI);
+}
+
+auto Parser::select(Code *code, const TypeId type) -> Selection {
+    const auto &types = symtab.type_table();
+    Selection selection{.type = type};
+    while (token->index() == Special) {
+        if (const auto tok = std::get<3>(*token); tok == "[") {
+            do {
+                const auto &array = types[selection.type];
+                if (array.kind != TypeKind::Array) {
+                    throw std::runtime_error(
+                        "Bad code: subscript of a variable that is not an "
+                        "array");
+                }
+                index++;
+                token = lexer->get_token();
+                expression(code);
+                const auto subscript = values.top();
+                values.pop();
+                if (subscript.type != types.scalar_of(array.index)) {
+                    throw std::runtime_error(
+                        "Bad code: array subscript must be an integer");
+                }
+                // The lower bound goes into the displacement, so only the
+                // subscript itself is scaled.
+                const auto stride = types.size_of(array.element);
+                selection.displacement -=
+                    array.low * static_cast<std::int64_t>(stride);
+                const auto reg = static_cast<std::uint16_t>(gpr_index - 1);
+                if (!selection.index) {
+                    selection.index = reg;
+                } else {
+                    if (*selection.index == reg - 1) {
+                        order_operands(code);
+                    }
+                    // The index so far counts whole rows of this dimension.
+                    const auto row = gpr(*selection.index);
+                    if (selection.scale != stride) {
+                        emit_to(code, Opcode::Imul, row, row,
+                                imm(static_cast<std::int64_t>(
+                                    selection.scale / stride)));
+                    }
+                    emit_to(code, Opcode::Add, row, gpr(reg));
+                    gpr_index--;
+                }
+                selection.scale = stride;
+                selection.type = array.element;
+            } while (token->index() == Special && std::get<3>(*token) == ",");
+            if (token->index() != Special || std::get<3>(*token) != "]") {
+                throw std::runtime_error(
+                    "Bad code: expected ']' to end array subscript");
+            }
+            index++;
+            token = lexer->get_token();
+        } else if (tok == ".") {
+            const auto &record = types[selection.type];
+            if (record.kind != TypeKind::Record) {
+                throw std::runtime_error(
+                    "Bad code: field of a variable that is not a record");
+            }
+            index++;
+            token = lexer->get_token();
+            const auto field = token->index() == Word
+                                   ? record.field(std::get<0>(*token))
+                                   : nullptr;
+            if (!field) {
+                throw std::runtime_error("Bad code: record has no such field");
+            }
+            selection.displacement += static_cast<std::int64_t>(field->offset);
+            selection.type = field->type;
+            index++;
+            token = lexer->get_token();
+        } else {
+            break;
         }
     }
-    std::vector<std::string> assembly;
+    // Addressing modes only scale by these.
+    if (selection.index && selection.scale != 1 && selection.scale != 2 &&
+        selection.scale != 4 && selection.scale != 8) {
+        const auto index = gpr(*selection.index);
+        emit_to(code, Opcode::Imul, index, index,
+                imm(static_cast<std::int64_t>(selection.scale)));
+        selection.scale = 1;
+    }
+    return selection;
+}
+
+auto Parser::element_operand(Code *code, const Entity &entity,
+                             const Selection &selection) -> Operand {
+    auto operand = variable_operand(code, entity);
+    if (!selection.index && selection.displacement == 0) {
+        return operand;
+    }
+    const auto displacement =
+        (operand.sign == '-' ? -1 : 1) * operand.value + selection.displacement;
+    operand.sign = displacement < 0 ? '-' : displacement > 0 ? '+' : 0;
+    operand.value = displacement < 0 ? -displacement : displacement;
+    if (selection.index) {
+        operand.index = gpr(*selection.index).reg;
+        operand.scale = static_cast<std::uint8_t>(selection.scale);
+    }
+    return operand;
+}
+
+// Byte-sized variables are widened on load and stored from the low byte of
+// the register, so that they can be packed next to each other.
+auto Parser::load_variable(Code *code, const Entity &entity) -> VarType {
+    const auto &types = symtab.type_table();
+    const auto selection = select(code, entity.var().type);
+    const auto scalar = types.scalar_of(selection.type);
+    if (!scalar) {
+        nlohmann::json data;
+        data["type"] = types.name(selection.type);
+        throw std::runtime_error(inja::render(
+            "Bad code: a whole {{type}} cannot be used as a value", data));
+    }
+    auto operand = element_operand(code, entity, selection);
+    // The element takes the place of its index on the stack.
+    std::uint16_t need = 1;
+    if (selection.index) {
+        gpr_index--;
+        need = gprs[gpr_index].need;
+    }
+    if (types.size_of(selection.type) == 1) {
+        operand.kind = OperandKind::BytePointer;
+        emit_to(code, Opcode::Movzx, fresh_gpr(), operand);
+    } else {
+        emit_to(code, Opcode::Mov, fresh_gpr(), operand);
+    }
+    gprs[gpr_index].need = need;
+    gpr_index++;
+    return *scalar;
+}
+
+void Parser::store_variable(const Entity &entity, const Selection &selection) {
+    const auto operand = element_operand(nullptr, entity, selection);
+    auto value = gpr(gpr_index - 1);
+    if (symtab.type_table().size_of(selection.type) == 1) {
+        value.kind = OperandKind::LowByte;
+    }
+    emit(Opcode::Mov, operand, value);
+    gpr_index--;
+    if (selection.index) {
+        gpr_index--;
+    }
+}
+
+void Parser::consume_params(const ProcData &proc) {
+    const auto &parameters = proc.signature;
+    std::vector<Code> assembly;
     std::size_t current_param = 0;
     while (current_param < parameters.size()) {
-        const auto parameter = parameters[current_param];
+        const auto &parameter = parameters[current_param];
         if (parameter.pass_by_ref) {
             if (token->index() == Word) {
-                if (const auto variable =
-                        std::get<VarData>(*symtab.find(std::get<0>(*token)));
-                    parameter.type != variable.type) {
+                const auto entity = symtab.resolve(std::get<0>(*token));
+                if (!entity || entity->kind != EntityKind::Variable) {
+                    nlohmann::json data;
+                    data["name"] = std::get<0>(*token);
+                    throw std::runtime_error(inja::render(
+                        "Bad code: identifier {{name}} is not a variable",
+                        data));
+                }
+                index++;
+                token = lexer->get_token();
+                Code push;
+                const auto variable = entity->var();
+                const auto selection = select(&push, variable.type);
+                if (selection.type != parameter.type) {
                     throw std::runtime_error(
                         "Bad code: parameter and variable type are invalid");
+                }
+                if (selection.index || selection.displacement != 0) {
+                    emit_to(&push, Opcode::Lea, reg(Register::EAX),
+                            element_operand(&push, *entity, selection));
+                    if (selection.index) {
+                        gpr_index--;
+                    }
+                } else if (entity->depth == symtab.cur_scope->depth &&
+                           !symtab.cur_scope->name.empty()) {
+                    // A reference parameter already holds the address.
+                    if (variable.pass_by_ref) {
+                        emit_to(&push, Opcode::Mov, reg(Register::EAX),
+                                mem(Register::EDI, '+',
+                                    static_cast<std::int64_t>(
+                                        variable.offset)));
+                    } else {
+                        emit_to(&push, Opcode::Lea, reg(Register::EAX),
+                                variable_operand(&push, *entity));
+                    }
                 } else {
-                    std::stringstream ss;
-                    ss << "MOV EAX, " << variable.offset << std::endl
-                       << "ADD EAX, EBP" << std::endl
-                       << "PUSH EAX";
-                    assembly.push_back(ss.str());
-                    index++;
-                    token = lexer->get_token();
+                    emit_to(&push, Opcode::Mov, reg(Register::EAX),
+                            imm(static_cast<std::int64_t>(variable.offset)));
+                    emit_to(&push, Opcode::Add, reg(Register::EAX),
+                            reg(Register::EBP));
                 }
+                emit_to(&push, Opcode::Push, reg(Register::EAX));
+                assembly.push_back(std::move(push));
             } else {
                 throw std::runtime_error(
                     "Bad code: parameter expected pass-by-reference variable");
             }
         } else {
-            std::stringstream ss;
-            expression(std::ref(ss));
+            Code push;
+            expression(&push);
             const auto rhs = values.top();
             values.pop();
-            if (parameter.type != rhs.type) {
+            if (symtab.type_table().scalar_of(parameter.type) != rhs.type) {
                 throw std::runtime_error(
                     "Bad code: expression did not match expected data type");
             }
-            ss << "PUSH " << gprs[gpr_index - 1] << std::endl;
-            assembly.push_back(ss.str());
+            emit_to(&push, Opcode::Push, gpr(gpr_index - 1));
+            assembly.push_back(std::move(push));
             gpr_index--;
         }
         current_param++;
@@ -1537,56 +1991,40 @@ void Parser::consume_params(const ProcData proc) {
             }
         }
     }
-    // Generate assembly in reverse order
-    for (std::size_t i = 0; i < assembly.size(); ++i) {
-        if (assembly[i].ends_with("\n")) {
-            asm_output << assembly[i];
-        } else {
-            asm_output << assembly[i] << std::endl;
-        }
+    // Generate assembly in reverse order, so that the first parameter ends up
+    // nearest the frame pointer
+    auto &code = routine().code;
+    for (auto it = assembly.rbegin(); it != assembly.rend(); ++it) {
+        code.insert(code.end(), it->cbegin(), it->cend());
     }
 }
 
-void Parser::consume_params(const FuncData func) {
-    const auto scope = func.next;
-    std::vector<VarData> parameters;
-    for (const auto &[_, var] : scope->table) {
-        parameters.push_back(std::get<VarData>(var));
-    }
+void Parser::consume_params(const FuncData &func) {
+    const auto &parameters = func.signature;
     std::size_t current_param = 0;
     while (current_param < parameters.size()) {
-        const auto parameter = parameters[current_param];
+        const auto &parameter = parameters[current_param];
         if (parameter.pass_by_ref) {
             if (token->index() == Word) {
-                const auto varinfo = symtab.find(std::get<0>(*token));
-                if (!varinfo) {
+                const auto entity = symtab.resolve(std::get<0>(*token));
+                if (!entity || entity->kind != EntityKind::Variable) {
                     nlohmann::json data;
                     data["name"] = std::get<0>(*token);
                     throw std::runtime_error(inja::render(
                         "Bad code: identifier {{name}} is not a variable",
                         data));
                 }
-                const auto var = std::get<VarData>(*varinfo);
-                if (var.type != parameter.type) {
+                index++;
+                token = lexer->get_token();
+                const auto selection = select(nullptr, entity->var().type);
+                if (selection.index) {
+                    gpr_index--;
+                }
+                if (selection.type != parameter.type) {
+                    const auto &types = symtab.type_table();
                     nlohmann::json data;
-                    if (var.type == VarType::Integer) {
-                        data["vtype"] = "integer";
-                    } else if (var.type == VarType::Boolean) {
-                        data["vtype"] = "boolean";
-                    } else if (var.type == VarType::Character) {
-                        data["vtype"] = "char";
-                    } else {
-                        data["vtype"] = "real";
-                    }
-                    if (parameter.type == VarType::Integer) {
-                        data["ptype"] = "integer";
-                    } else if (parameter.type == VarType::Boolean) {
-                        data["ptype"] = "boolean";
-                    } else if (parameter.type == VarType::Character) {
-                        data["ptype"] = "char";
-                    } else {
-                        data["ptype"] = "real";
-                    }
+                    data["vtype"] = types.name(selection.type);
+                    data["ptype"] = types.name(parameter.type);
                     data["funcname"] = func.name;
                     throw std::runtime_error(
                         inja::render("Bad code: type of variable ({{vtype}}) "
@@ -1595,8 +2033,6 @@ void Parser::consume_params(const FuncData func) {
                                      "function declaration {{funcname}}",
                                      data));
                 }
-                index++;
-                token = lexer->get_token();
             } else {
                 nlohmann::json data;
                 data["pname"] = parameter.name;
@@ -1604,35 +2040,21 @@ void Parser::consume_params(const FuncData func) {
                     "Bad code: parameter {{pname}} expects reference", data));
             }
         } else {
-            expression(std::nullopt);
+            expression(nullptr);
             const auto rhs = values.top();
             values.pop();
-            if (parameter.type != rhs.type) {
+            const auto &types = symtab.type_table();
+            if (types.scalar_of(parameter.type) != rhs.type) {
                 nlohmann::json data;
                 data["pname"] = parameter.name;
-                if (parameter.type == VarType::Integer) {
-                    data["vtype"] = "integer";
-                } else if (parameter.type == VarType::Boolean) {
-                    data["vtype"] = "boolean";
-                } else if (parameter.type == VarType::Character) {
-                    data["vtype"] = "char";
-                } else {
-                    data["vtype"] = "real";
-                }
-                if (rhs.type == VarType::Integer) {
-                    data["ptype"] = "integer";
-                } else if (rhs.type == VarType::Boolean) {
-                    data["ptype"] = "boolean";
-                } else if (rhs.type == VarType::Character) {
-                    data["ptype"] = "char";
-                } else {
-                    data["ptype"] = "real";
-                }
+                data["vtype"] = types.name(parameter.type);
+                data["ptype"] = types.name(TypeTable::scalar(rhs.type));
                 throw std::runtime_error(
                     inja::render("Bad code: parameter {{pname}} got datatype "
                                  "{{vtype}}, but expected {{ptype}}",
                                  data));
             }
+            gpr_index--;
         }
         current_param += 1;
         if (current_param < parameters.size()) {
@@ -1653,56 +2075,151 @@ void Parser::consume_params(const FuncData func) {
     }
 }
 
-void Parser::dim() {
-if (token->index() != Integer) {
-throw std::runtime_error("Bad code: expected integer for array bounds");
-}
-index++;
-token = lexer->get_token();
-if (token->index() != Special || std::get<3>(*token) != ".") {
-throw std::runtime_error("Bad code: expected '..' for array range specifier");
-}
-index++;
-token = lexer->get_token();
-if (token->index() != Special || std::get<3>(*token) != ".") {
-throw std::runtime_error("Bad code: expected '..' for array range specifier");
+void Parser::dim(std::vector<TypeId> &indices) {
+    indices.push_back(subrange());
+    index++;
+    token = lexer->get_token();
+    mdim(indices);
 }
-index++;
-token = lexer->get_token();
-if (token->index() != Integer) {
-throw std::runtime_error("Bad code: expected integer for array bounds");
+
+void Parser::mdim(std::vector<TypeId> &indices) {
+    if (token->index() == Special && std::get<3>(*token) == ",") {
+        index++;
+        token = lexer->get_token();
+        dim(indices);
+    }
 }
-index++;
-token = lexer->get_token();
-mdim();
+
+static void print_error(const std::string_view file, const ParseError &error) {
+    std::cerr << file << ":" << error.position.line + 1 << ":"
+              << error.position.column + 1 << ": error: " << error.what()
+              << std::endl;
 }
 
-void Parser::mdim() {
-if (token->index() == Special && std::get<3>(*token) == ",") {
-index++;
-token = lexer->get_token();
-dim();
+static auto mean(const double total, const std::uint64_t count) -> double {
+    return count == 0 ? 0.0 : total / static_cast<double>(count);
 }
+
+// One line of JSON with what the symbol tables counted while parsing `file`.
+// The counts are null unless the compiler was built with SYMTAB_STATS.
+static void print_stats(const std::string_view file, const Parser &p) {
+    nlohmann::json stats;
+    stats["file"] = file;
+    stats["symtab"] = nullptr;
+    if constexpr (SYMTAB_COUNTERS) {
+        const auto counts = p.symbol_stats();
+        const auto resolved = counts.lookups[0] + counts.lookups[1] +
+                              counts.lookups[2] + counts.misses;
+        auto &symtab = stats["symtab"];
+        symtab["scopes"] = counts.scopes;
+        symtab["symbols"] = counts.symbols;
+        symtab["lookups"] = {{"variable", counts.lookups[0]},
+                             {"procedure", counts.lookups[1]},
+                             {"function", counts.lookups[2]},
+                             {"missing", counts.misses}};
+        symtab["tables_searched"] = {
+            {"total", counts.tables_searched},
+            {"mean", mean(static_cast<double>(counts.tables_searched),
+                          resolved)},
+            {"max", counts.max_tables_searched}};
+        symtab["chain_depth"] = {
+            {"lookups", counts.chained},
+            {"mean",
+             mean(static_cast<double>(counts.chain_depth), counts.chained)},
+            {"max", counts.max_chain_depth}};
+        symtab["probe_length"] = {
+            {"lookups", counts.probes},
+            {"mean",
+             mean(static_cast<double>(counts.probe_groups), counts.probes)},
+            {"max", counts.max_probe_groups}};
+        symtab["load_factor"] = {
+            {"tables", counts.tables},
+            {"mean", mean(counts.load_factor_sum, counts.tables)},
+            {"min", counts.tables == 0 ? 0.0 : counts.min_load_factor},
+            {"max", counts.max_load_factor}};
+    }
+    auto &peephole = stats["peephole"];
+    peephole = nlohmann::json::object();
+    for (std::size_t rule = 0; rule < PEEPHOLE_RULES; ++rule) {
+        peephole[std::string(peephole_rule_name(rule))] =
+            p.peephole_stats().fired[rule];
+    }
+    stats["flow"] = {{"reused_values", p.flow_stats().reused},
+                     {"dead_stores", p.flow_stats().dead_stores}};
+    std::cout << stats.dump() << std::endl;
 }
 
 auto main(int argc, char **argv) -> int {
     try {
         popl::OptionParser op;
+        const auto syntax_only_option = op.add<popl::Switch>(
+            "s", "syntax-only",
+            "Only lex, parse and type check; do not write a listing");
+        const auto check_option =
+            op.add<popl::Switch>("c", "check", "Same as --syntax-only");
+        const auto jobs_option = op.add<popl::Value<unsigned>>(
+            "j", "jobs",
+            "Number of threads used to parse procedure and function bodies",
+            std::max(std::thread::hardware_concurrency(), 1u));
+        const auto max_errors_option = op.add<popl::Value<std::size_t>>(
+            "", "max-errors",
+            "Stop after this many errors; 0 reports all of them", 20);
+        const auto emit_interface_option = op.add<popl::Switch>(
+            "", "emit-interface",
+            "Also write the declarations of each good program to a .pif unit "
+            "interface");
+        const auto stats_option = op.add<popl::Switch>(
+            "", "stats",
+            "Print what the symbol tables counted for each file as a line of "
+            "JSON; needs a build with SYMTAB_STATS");
+        const auto lsp_option = op.add<popl::Switch>(
+            "", "lsp", "Run as a language server over standard input/output");
         op.parse(argc, argv);
+        CompileOptions options;
+        options.syntax_only =
+            syntax_only_option->is_set() || check_option->is_set();
+        options.jobs = jobs_option->value();
+        options.max_errors = max_errors_option->value();
+        options.emit_interface = emit_interface_option->is_set();
+        if (lsp_option->is_set()) {
+#ifdef _WIN32
+            // Content-Length counts bytes, so no newline translation
+            _setmode(_fileno(stdin), _O_BINARY);
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            return LanguageServer(options).run(std::cin, std::cout);
+        }
         if (op.non_option_args().size() == 0) {
             try {
-                Parser p("code.txt");
+                Parser p("code.txt", options);
                 const auto [total, remaining] = p.lexer->number_of_tokens();
-                if (p.get_index() != total || p.get_grouping_depth() > 0 ||
+                if (stats_option->is_set()) {
+                    print_stats("code.txt", p);
+                }
+                if (const auto &errors = p.diagnostics(); !errors.empty()) {
+                    for (const auto &error : errors) {
+                        print_error("code.txt", error);
+                    }
+                    std::cerr << "code.txt: Bad code (" << errors.size()
+                              << (errors.size() == 1 ? " error)" : " errors)")
+                              << std::endl;
+                    return 1;
+                } else if (p.get_index() != total || p.get_grouping_depth() > 0 ||
                     p.get_block_depth() > 0) {
                     std::cerr << "code.txt: Bad code (parsed " << p.get_index()
                               << "/" << total << " tokens)" << std::endl;
                     return 1;
                 } else {
+                    if (options.emit_interface) {
+                        p.write_interface();
+                    }
                     std::cout << "code.txt: Good code (parsed " << p.get_index()
                               << "/" << total << " tokens)" << std::endl;
                     return 0;
                 }
+            } catch (const ParseError &e) {
+                print_error("code.txt", e);
+                return 1;
             } catch (std::exception &e) {
                 std::cerr << "code.txt: error: " << e.what() << std::endl;
                 return 1;
@@ -1713,16 +2230,31 @@ auto main(int argc, char **argv) -> int {
         }
         for (const auto &arg : op.non_option_args()) {
             try {
-                Parser p(arg);
+                Parser p(arg, options);
                 const auto [total, remaining] = p.lexer->number_of_tokens();
-                if (p.get_index() != total || p.get_grouping_depth() > 0 ||
+                if (stats_option->is_set()) {
+                    print_stats(arg, p);
+                }
+                if (const auto &errors = p.diagnostics(); !errors.empty()) {
+                    for (const auto &error : errors) {
+                        print_error(arg, error);
+                    }
+                    std::cerr << arg << ": Bad code (" << errors.size()
+                              << (errors.size() == 1 ? " error)" : " errors)")
+                              << std::endl;
+                } else if (p.get_index() != total || p.get_grouping_depth() > 0 ||
                     p.get_block_depth() > 0) {
                     std::cerr << arg << ": Bad code (parsed " << p.get_index()
                               << "/" << total << " tokens)" << std::endl;
                 } else {
+                    if (options.emit_interface) {
+                        p.write_interface();
+                    }
                     std::cout << arg << ": Good code (parsed " << p.get_index()
                               << "/" << total << " tokens)" << std::endl;
                 }
+            } catch (const ParseError &e) {
+                print_error(arg, e);
             } catch (std::exception &e) {
                 std::cerr << arg << ": error: " << e.what() << std::endl;
             } catch (...) {
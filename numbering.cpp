@@ -0,0 +1,540 @@
+#include "numbering.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// The variables of the data segment are off EBP and those of the frame off
+// EDI.
+static auto side(const Register base) -> std::size_t {
+    return base == Register::EBP ? 0 : 1;
+}
+
+namespace {
+
+// An operation on value numbers, a constant or a load, as a key
+struct Expression {
+    Opcode opcode = Opcode::Label;
+    // Immediate or Real for a constant, and for a load or LEA the kind of its
+    // memory operand
+    OperandKind kind = OperandKind::None;
+    Register base = Register::None;
+    std::uint8_t scale = 1;
+    // The numbers operated on. For a memory operand the first is its index
+    // plus one, or 0 without one.
+    std::uint32_t x = 0;
+    std::uint32_t y = 0;
+    // A constant, or the offset of a memory operand
+    std::int64_t value = 0;
+    // For a load, when what it reads may last have changed
+    std::uint64_t version = 0;
+
+    friend auto operator==(const Expression &, const Expression &)
+        -> bool = default;
+};
+
+struct ExpressionHash {
+    auto operator()(const Expression &e) const -> std::size_t {
+        std::uint64_t hash = 0;
+        for (const auto part : {static_cast<std::uint64_t>(e.opcode) << 16 |
+                                    static_cast<std::uint64_t>(e.kind) << 8 |
+                                    e.scale,
+                                static_cast<std::uint64_t>(e.base),
+                                static_cast<std::uint64_t>(e.x) << 32 | e.y,
+                                static_cast<std::uint64_t>(e.value),
+                                e.version}) {
+            hash = (std::rotl(hash, 5) ^ part) * 0x9E3779B97F4A7C15;
+        }
+        return static_cast<std::size_t>(hash);
+    }
+};
+
+// The number of an expression, and the register last given its value
+struct Known {
+    std::uint32_t number;
+    Register holder;
+};
+
+class Numbering {
+  public:
+    explicit Numbering(FlowGraph &graph)
+        : graph(graph), code(graph.code),
+          registers(static_cast<std::uint32_t>(graph.shared.size())),
+          numbers(registers + MACHINE, 0), stamps(registers + MACHINE, 0),
+          last(registers, 0), named(registers, EXIT),
+          live(code.size() - graph.begin, 0) {}
+
+    auto run() -> std::uint64_t {
+        for (auto p = graph.begin; p < code.size(); ++p) {
+            each_virtual(code[p],
+                         [&](const Register r) { last[number(r)] = p; });
+        }
+        count_live();
+        // How many blocks lead to each
+        std::vector<std::uint32_t> leading(graph.blocks.size(), 0);
+        for (const auto &block : graph.blocks) {
+            for (const auto s : {block.next, block.taken}) {
+                if (s != EXIT) {
+                    leading[s]++;
+                }
+            }
+        }
+        // A block that only one block before it leads to is walked straight
+        // after that one, and goes on from what it left off with.
+        std::vector<bool> walked(graph.blocks.size(), false);
+        for (std::size_t first = 0; first < graph.blocks.size(); ++first) {
+            if (walked[first]) {
+                continue;
+            }
+            stamp = first + 1;
+            for (auto b = first; b != EXIT;) {
+                walk(b, b == first);
+                walked[b] = true;
+                const auto &block = graph.blocks[b];
+                auto onward = EXIT;
+                for (const auto s : {block.next, block.taken}) {
+                    if (s != EXIT && s > b && leading[s] == 1 && !walked[s]) {
+                        onward = s;
+                        break;
+                    }
+                }
+                b = onward;
+            }
+        }
+        return reused;
+    }
+
+  private:
+    // Cells past the virtual registers for the machine ones, and for None,
+    // which never holds anything
+    static constexpr auto MACHINE =
+        static_cast<std::uint32_t>(Register::None) + 1;
+    // Values live at once past which a register is not held for longer to
+    // save a load, as some body has no more registers to spare for it
+    static constexpr std::uint32_t CROWDED = 2;
+
+    FlowGraph &graph;
+    Code &code;
+    const std::uint32_t registers;
+    std::unordered_map<Expression, Known, ExpressionHash> known;
+    // The number of each virtual register and then of each machine one,
+    // which holds while its stamp is that of the block being walked
+    std::vector<std::uint32_t> numbers;
+    std::vector<std::size_t> stamps;
+    std::size_t stamp = 0;
+    std::uint32_t next = 0;
+    // The last position each register is named at, and the last block it was
+    // named in as far as the walk has come
+    std::vector<std::size_t> last;
+    std::vector<std::size_t> named;
+    std::size_t current = 0;
+    // How many virtual registers hold a value still to be read at each
+    // position of the body
+    std::vector<std::uint32_t> live;
+    // When the variables off each base may last have changed all at once,
+    // when any of them may have, and when each slot may have
+    std::uint64_t clock = 0;
+    std::array<std::uint64_t, 2> everything{};
+    std::array<std::uint64_t, 2> anything{};
+    std::unordered_map<std::uint64_t, std::uint64_t> changed;
+    std::uint64_t reused = 0;
+
+    // Counts the values live at each position, from where the register that
+    // holds each is first named to where it is last.
+    void count_live() {
+        std::vector<std::size_t> first(registers, EXIT);
+        for (auto p = graph.begin; p < code.size(); ++p) {
+            each_virtual(code[p], [&](const Register r) {
+                first[number(r)] = std::min(first[number(r)], p);
+            });
+        }
+        std::vector<std::int32_t> change(live.size() + 1, 0);
+        for (std::uint32_t v = 0; v < registers; ++v) {
+            if (first[v] != EXIT) {
+                change[first[v] - graph.begin]++;
+                change[last[v] - graph.begin]--;
+            }
+        }
+        std::int32_t count = 0;
+        for (std::size_t q = 0; q < live.size(); ++q) {
+            count += change[q];
+            live[q] = static_cast<std::uint32_t>(count);
+        }
+    }
+
+    // Whether some position from `from` up to `to` has as many values live
+    // as holding one more there may have spilled
+    [[nodiscard]] auto crowded(const std::size_t from,
+                               const std::size_t to) const -> bool {
+        for (auto q = from; q < to; ++q) {
+            if (live[q - graph.begin] >= CROWDED) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    [[nodiscard]] auto cell(const Register r) const -> std::uint32_t {
+        return is_virtual(r) ? number(r)
+                             : registers + static_cast<std::uint32_t>(r);
+    }
+
+    // The number of register `r`, which it is given if the block has not
+    // named it yet
+    auto number_of(const Register r) -> std::uint32_t {
+        if (stamps[cell(r)] != stamp) {
+            give(r, next++);
+        }
+        return numbers[cell(r)];
+    }
+
+    void give(const Register r, const std::uint32_t value) {
+        stamps[cell(r)] = stamp;
+        numbers[cell(r)] = value;
+    }
+
+    [[nodiscard]] auto holds(const Register r, const std::uint32_t value) const
+        -> bool {
+        return stamps[cell(r)] == stamp && numbers[cell(r)] == value;
+    }
+
+    // Forgets what machine registers `first` to `last` hold.
+    void forget(const Register first, const Register last) {
+        for (auto r = cell(first); r <= cell(last); ++r) {
+            stamps[r] = 0;
+        }
+    }
+
+    // The number of a constant or of what a register holds
+    auto term(const Operand &operand) -> std::optional<std::uint32_t> {
+        switch (operand.kind) {
+        case OperandKind::Register:
+            if (operand.reg != Register::ESP) {
+                return number_of(operand.reg);
+            }
+            return std::nullopt;
+        case OperandKind::Immediate:
+        case OperandKind::Real: {
+            Expression constant;
+            constant.opcode = Opcode::Li;
+            constant.kind = operand.kind;
+            constant.value = operand.kind == OperandKind::Real
+                                 ? std::bit_cast<std::uint32_t>(operand.real)
+                                 : operand.value;
+            const auto [entry, added] =
+                known.try_emplace(constant, Known{next, Register::None});
+            if (added) {
+                next++;
+            }
+            return entry->second.number;
+        }
+        default:
+            return std::nullopt;
+        }
+    }
+
+    // Arithmetic on two terms, in a fixed order where it does not matter
+    auto operation(const Opcode opcode, const Operand &x, const Operand &y)
+        -> std::optional<Expression> {
+        const auto a = term(x);
+        const auto b = term(y);
+        if (!a || !b) {
+            return std::nullopt;
+        }
+        Expression expression;
+        expression.opcode = opcode;
+        expression.x = *a;
+        expression.y = *b;
+        if ((opcode == Opcode::Add || opcode == Opcode::Imul) &&
+            expression.x > expression.y) {
+            std::swap(expression.x, expression.y);
+        }
+        return expression;
+    }
+
+    // A load or LEA of memory operand `memory`. A base other than EBP or EDI
+    // is a reference, and the number of what it holds is part of the key.
+    auto address(const Opcode opcode, const Operand &memory)
+        -> std::optional<Expression> {
+        if ((memory.kind != OperandKind::Memory &&
+             memory.kind != OperandKind::BytePointer) ||
+            memory.reg == Register::ESP || memory.index == Register::ESP) {
+            return std::nullopt;
+        }
+        Expression expression;
+        expression.opcode = opcode;
+        expression.kind = memory.kind;
+        expression.base = memory.reg;
+        expression.scale = memory.scale;
+        expression.value = offset(memory);
+        if (memory.index != Register::None) {
+            expression.x = number_of(memory.index) + 1;
+        }
+        const auto reference =
+            memory.reg != Register::EBP && memory.reg != Register::EDI;
+        const auto base = side(reference ? Register::EBP : memory.reg);
+        if (reference) {
+            expression.y = number_of(memory.reg);
+        }
+        if (reference || memory.index != Register::None) {
+            expression.version = std::max(everything[base], anything[base]);
+        } else {
+            const auto slot =
+                changed.find(slot_key(memory.reg, expression.value));
+            expression.version =
+                std::max(everything[base],
+                         slot == changed.end() ? 0 : slot->second);
+        }
+        if (opcode == Opcode::Lea) {
+            expression.version = 0;
+        }
+        return expression;
+    }
+
+    // Notes that `width` bytes at memory operand `memory` may have changed.
+    void store(const Operand &memory, const std::int64_t width) {
+        clock++;
+        if (memory.reg != Register::EBP && memory.reg != Register::EDI) {
+            // A reference points into the data segment or into the frame of
+            // a caller, never into this one.
+            everything[side(Register::EBP)] = clock;
+            return;
+        }
+        const auto base = side(memory.reg);
+        anything[base] = clock;
+        if (memory.index != Register::None) {
+            everything[base] = clock;
+            return;
+        }
+        // The slots that overlap the bytes written
+        for (auto at = offset(memory) - 3; at < offset(memory) + width; ++at) {
+            changed[slot_key(memory.reg, at)] = clock;
+        }
+    }
+
+    // Notes that register `r` holds what was just stored to `memory`, so
+    // that a load of it can read `r` instead.
+    void forward(const Operand &memory, const Register r) {
+        if (r == Register::ESP) {
+            return;
+        }
+        if (const auto expression = address(Opcode::Mov, memory)) {
+            known.insert_or_assign(*expression, Known{number_of(r), r});
+        }
+    }
+
+    // Walks block `b`, which goes on from what the block walked before it
+    // left off with unless it is `fresh`; then nothing is known of memory
+    // where it starts.
+    void walk(const std::size_t b, const bool fresh) {
+        auto &block = graph.blocks[b];
+        if (fresh) {
+            clock++;
+            everything.fill(clock);
+        }
+        current = b;
+        const auto setter = graph.flag_setter(b);
+        for (auto p = block.first; p < block.last; ++p) {
+            if (!graph.removed[p - graph.begin]) {
+                step(block, p, p == setter);
+                each_virtual(code[p], [&](const Register r) {
+                    named[number(r)] = b;
+                });
+            }
+        }
+    }
+
+    // Numbers the value of the instruction at `p`, and leaves it out or
+    // copies its value if a register holds that already. The one that sets
+    // the flags a jump reads is left as it is.
+    void step(Block &block, const std::size_t p, const bool sets_flags) {
+        const auto &instruction = code[p];
+        const auto &[a, b, c] = instruction.operands;
+        switch (instruction.opcode) {
+        case Opcode::Call:
+            // The callee may write any variable.
+            clock++;
+            everything.fill(clock);
+            forget(Register::EAX, Register::EBP);
+            return;
+        case Opcode::Popad:
+            forget(Register::EAX, Register::EBP);
+            return;
+        case Opcode::Divide:
+            // Written out through EAX and EDX
+            forget(Register::EAX, Register::EDX);
+            break;
+        default:
+            break;
+        }
+        if (!writes_first(instruction.opcode)) {
+            return;
+        }
+        if (a.kind == OperandKind::Memory ||
+            a.kind == OperandKind::BytePointer) {
+            const auto bytes = b.kind == OperandKind::LowByte ||
+                               a.kind == OperandKind::BytePointer;
+            store(a, bytes ? 1 : 4);
+            if (!bytes && b.kind == OperandKind::Register) {
+                forward(a, b.reg);
+            }
+            return;
+        }
+        if (a.reg == Register::ESP) {
+            return;
+        }
+        if (a.kind != OperandKind::Register) {
+            give(a.reg, next++);
+            return;
+        }
+        std::optional<Expression> expression;
+        switch (instruction.opcode) {
+        case Opcode::Li:
+        case Opcode::Mov:
+            if (const auto value = term(b)) {
+                // A copy, which is only left out when it changes nothing
+                if (is_virtual(a.reg) && holds(a.reg, *value)) {
+                    graph.remove(block, p);
+                    reused++;
+                } else {
+                    give(a.reg, *value);
+                }
+                return;
+            }
+            expression = address(Opcode::Mov, b);
+            break;
+        case Opcode::Movzx:
+        case Opcode::Lea:
+            expression = address(instruction.opcode, b);
+            break;
+        case Opcode::Add:
+        case Opcode::Sub:
+        case Opcode::Imul:
+            expression = c.kind == OperandKind::None
+                             ? operation(instruction.opcode, a, b)
+                             : operation(instruction.opcode, b, c);
+            break;
+        case Opcode::Neg:
+            expression = operation(Opcode::Neg, a, a);
+            break;
+        case Opcode::Divide:
+            expression = operation(Opcode::Divide, a, b);
+            break;
+        default:
+            break;
+        }
+        if (!expression) {
+            give(a.reg, next++);
+            return;
+        }
+        const auto [entry, added] =
+            known.try_emplace(*expression, Known{next, a.reg});
+        if (added) {
+            give(a.reg, next++);
+            return;
+        }
+        auto &[value, holder] = entry->second;
+        // Machine registers are written again rather than kept holding a
+        // value for longer, which would keep them from allocation.
+        if (is_virtual(a.reg) && holds(a.reg, value) && !sets_flags) {
+            graph.remove(block, p);
+            reused++;
+            return;
+        }
+        // Only virtual registers stand in for one another.
+        if (!is_virtual(a.reg) || !is_virtual(holder) ||
+            !holds(holder, value) || sets_flags) {
+            if (is_virtual(a.reg) || !holds(holder, value)) {
+                holder = a.reg;
+            }
+            give(a.reg, value);
+            return;
+        }
+        if (!reuse(block, p, holder)) {
+            holder = a.reg;
+            give(a.reg, value);
+        }
+    }
+
+    // Leaves out the instruction at `p`, whose value `r` holds, and has what
+    // comes after it read `r` instead of its destination, or else makes it a
+    // copy of `r`. An operation that costs no more than a copy is only left
+    // out while `r` is still read after it anyway, as holding a register
+    // longer may have it spilled, or for a load where few values are live
+    // until then; returns false if the instruction stays.
+    auto reuse(Block &block, const std::size_t p, const Register r) -> bool {
+        const auto opcode = code[p].opcode;
+        const auto d = code[p].operands[0].reg;
+        const auto renaming = renamable(p, d, r);
+        const auto load = opcode == Opcode::Mov || opcode == Opcode::Movzx;
+        if (opcode != Opcode::Imul && opcode != Opcode::Divide &&
+            (!load || crowded(last[number(r)], p)) &&
+            (!renaming || last[number(r)] <= p)) {
+            return false;
+        }
+        reused++;
+        if (named[number(r)] != current) {
+            graph.shared[number(r)] = true;
+            graph.crossing = true;
+        }
+        if (renaming) {
+            const auto end = last[number(d)];
+            for (auto q = p + 1; q <= end; ++q) {
+                for (auto &operand : code[q].operands) {
+                    if (operand.kind == OperandKind::Label) {
+                        continue;
+                    }
+                    if (operand.reg == d) {
+                        operand.reg = r;
+                    }
+                    if (operand.index == d) {
+                        operand.index = r;
+                    }
+                }
+            }
+            last[number(r)] = std::max(last[number(r)], end);
+            graph.remove(block, p);
+            return true;
+        }
+        code[p] = {Opcode::Mov, {reg(d), reg(r)}};
+        last[number(r)] = std::max(last[number(r)], p);
+        give(d, numbers[cell(r)]);
+        return true;
+    }
+
+    // Whether `r` can stand for `d` from after `p` to the last instruction
+    // that names `d`: nothing else names `d`, and neither is written before
+    // then.
+    [[nodiscard]] auto renamable(const std::size_t p, const Register d,
+                                 const Register r) const -> bool {
+        if (graph.shared[number(d)]) {
+            return false;
+        }
+        const auto end = last[number(d)];
+        for (auto q = p + 1; q <= end; ++q) {
+            const auto &instruction = code[q];
+            const auto &destination = instruction.operands[0];
+            if (graph.removed[q - graph.begin] ||
+                !writes_first(instruction.opcode) ||
+                (destination.kind != OperandKind::Register &&
+                 destination.kind != OperandKind::LowByte)) {
+                continue;
+            }
+            // The last instruction reads `d` before it writes anything.
+            if (destination.reg == d || (destination.reg == r && q < end)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+} // namespace
+
+auto number_values(FlowGraph &graph) -> std::uint64_t {
+    return Numbering(graph).run();
+}
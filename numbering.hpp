@@ -0,0 +1,24 @@
+#pragma once
+#include "cfg.hpp"
+#include <cstdint>
+
+// Value numbering within each block. The registers a block starts with and
+// the constants it names each get a number, and so does each value computed
+// from numbered operands, the same one for the same operation on the same
+// numbers. An instruction whose value a register of the block still holds is
+// left out, and what comes after it reads that register instead of its
+// destination; where that would not be safe it becomes a copy of the
+// register.
+//
+// A load from a variable of the frame or the data segment is an operation
+// too, until a store may have changed the variable: a store to it, one
+// indexed off the same base, one through a reference, or a call. Storing a
+// register to a variable gives a load of it the register's value, so the
+// load can read the register instead.
+//
+// A block that only one block before it leads to goes on with what that one
+// holds; any other block, as at a label that more than one jump names, starts
+// knowing nothing.
+//
+// Returns how many instructions were left out or became copies.
+auto number_values(FlowGraph &graph) -> std::uint64_t;
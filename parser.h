@@ -1,28 +1,86 @@
 #pragma once
+#include "cfg.hpp"
+#include "ir.hpp"
 #include "lexer.h"
+#include "peephole.hpp"
+#include "small_stack.hpp"
 #include "symtab.hpp"
+#include <array>
 #include <functional>
-#include <sstream>
-#include <stack>
+#include <memory>
+#include <optional>
 #include <string_view>
 #include <vector>
 
+struct CompileOptions {
+    // Only lex, parse and type check; never format or write assembly.
+    bool syntax_only = false;
+    // Number of threads that parse top-level procedure and function bodies.
+    unsigned jobs = 1;
+    // Stop after this many errors; zero means no limit.
+    std::size_t max_errors = 20;
+    // Write the global declarations of a good program to a unit interface.
+    bool emit_interface = false;
+};
+
 class Parser {
+  public:
+    // A top-level procedure or function body whose tokens were set aside
+    // during the declaration pass, to be parsed once every signature and
+    // global is known.
+    struct BodyTask {
+        std::string name;
+        bool is_function = false;
+        std::deque<Token> tokens;
+        std::deque<SourcePosition> positions;
+        // Source extent, from the first token to just past the ';'.
+        SourcePosition begin;
+        SourcePosition end;
+        // The declaration scope in the global table, which stays untouched.
+        Scope *declaration = nullptr;
+        // Private copy of the declaration scope that the body fills in, and
+        // the scopes of everything nested in the body.
+        ScopeArena scopes;
+        Scope *scope = nullptr;
+        std::uint64_t horizon = 0;
+        Routine code;
+        std::uint64_t parsed = 0;
+        std::vector<ParseError> errors;
+        SymbolStats stats;
+        PeepholeStats peephole;
+        FlowStats flow;
+    };
+
   private:
     std::optional<Token> token = std::nullopt;
     std::uint16_t grouping_depth = 0;
     std::uint16_t block_depth = 0;
     std::uint64_t index = 0;
+    using Literal = std::variant<std::int32_t, float, bool>;
     struct VarValue {
         VarType type;
-        std::optional<std::variant<std::int32_t, float, bool>> literal;
+        std::optional<Literal> literal;
     };
-    std::stack<VarValue> values;
+    SmallStack<VarValue, 16> values;
     SymbolTable symtab;
-    std::vector<std::string> temporaries;
-    std::vector<std::string> gprs{"EAX", "EBX", "ECX", "EDX"};
-    std::uint8_t gpr_index = 0;
+    SmallStack<std::string, 8> temporaries;
+    // A value of the expression stack: the virtual register holding it,
+    // where the code computing it starts, and how many registers that code
+    // needs, its Sethi-Ullman number
+    struct StackValue {
+        Register reg = Register::None;
+        std::size_t begin = 0;
+        std::uint16_t need = 1;
+    };
+    // The values of the expression stack, of which there are `gpr_index`
+    std::vector<StackValue> gprs;
+    std::uint16_t gpr_index = 0;
+    std::uint32_t virtuals = 0;
+    // Where the code of the body being parsed starts in its routine; its
+    // virtual registers count from 0
+    std::size_t body_begin = 0;
     std::string filename;
+    const CompileOptions options;
     std::uint64_t offset = 0;
     bool or_used = false;
     bool for_while = false;
@@ -30,16 +88,94 @@ class Parser {
     std::uint64_t if_count = 0;
     std::uint64_t while_count = 0;
     std::uint64_t or_count = 0;
-    std::stack<std::uint64_t> conditional_stack;
-    std::stack<std::uint64_t> loop_stack;
+    SmallStack<std::uint64_t, 16> conditional_stack;
+    SmallStack<std::uint64_t, 16> loop_stack;
+
+    // Follows begin/end nesting through a body, nested procedures and
+    // functions included, to find the `end` that closes it.
+    struct BodyScanner {
+        std::uint64_t depth = 0;
+        std::uint64_t pending_bodies = 1;
+
+        // Takes the next token; returns true once the body is closed.
+        auto feed(const Token &tok) -> bool;
+    };
+
+    std::vector<BodyTask> deferred;
+    // The global scope as the deferred bodies see it
+    std::unique_ptr<const FrozenScope> globals;
+    // Keep bodies, with their extents and errors, after parsing them.
+    bool retain_bodies = false;
+    bool bodies_parsed = false;
+    std::vector<ParseError> errors;
+    // What the tables that parsed the deferred bodies counted
+    SymbolStats body_stats;
+    // How often the peephole rules fired, over every body
+    PeepholeStats peephole_counts;
+    // What simplifying the control flow came to, over every body
+    FlowStats flow_counts;
+
+    // Parser state that a recovery point puts back before skipping ahead.
+    struct RecoveryPoint {
+        std::size_t values;
+        std::size_t temporaries;
+        std::size_t conditionals;
+        std::size_t loops;
+        std::uint16_t gpr_index;
+        std::uint16_t grouping_depth;
+        std::uint16_t block_depth;
+        Scope *scope;
+    };
+    // The code generated so far, printed once the program has been parsed
+    Listing listing;
 
     enum TypeValue { Word, Integer, Real, Special, ReservedWord };
 
   public:
     std::unique_ptr<Lexer> lexer = nullptr;
-    std::ofstream asm_output;
 
-    explicit Parser(const std::string_view filename);
+    explicit Parser(const std::string_view filename,
+                    const CompileOptions &options = {});
+
+    // Parses source that was lexed elsewhere and keeps what the language
+    // server needs: every top-level body with its extent and errors, which
+    // diagnostics() then leaves out.
+    Parser(std::unique_ptr<Lexer> lexer, const CompileOptions &options);
+
+    [[nodiscard]] inline auto bodies() const -> const std::vector<BodyTask> & {
+        return deferred;
+    }
+
+    // Every error found, in source order and at most `max_errors` of them
+    [[nodiscard]] inline auto diagnostics() const
+        -> const std::vector<ParseError> & {
+        return errors;
+    }
+
+    // Lexes and parses body `i` of `source` again after an edit inside it
+    // that ended at `old_end` and now ends at `new_end`; everything after the
+    // edit moves along. Returns false if the text no longer forms one body
+    // ending where this one does, in which case only a full parse will do.
+    auto reparse_body(const std::size_t i, const std::string_view source,
+                      const SourcePosition old_end,
+                      const SourcePosition new_end) -> bool;
+
+    // Writes the global declarations next to the source as a unit interface
+    // with the extension .pif.
+    void write_interface() const;
+
+    // What the symbol tables counted over the whole program
+    [[nodiscard]] auto symbol_stats() const -> SymbolStats;
+
+    // How often each peephole rule fired over the whole program
+    [[nodiscard]] auto peephole_stats() const -> const PeepholeStats & {
+        return peephole_counts;
+    }
+
+    // What simplifying the control flow came to over the whole program
+    [[nodiscard]] auto flow_stats() const -> const FlowStats & {
+        return flow_counts;
+    }
 
     [[nodiscard]] inline auto get_grouping_depth() const -> std::uint16_t {
         return grouping_depth;
@@ -60,40 +196,181 @@ class Parser {
     ~Parser() = default;
 
   private:
+    // Parses a deferred body on its own against the frozen `globals`,
+    // generating its routine and making types in `types`.
+    Parser(BodyTask &task, const FrozenScope &globals, TypeTable &types,
+           const CompileOptions &options);
+
+    // Parses the program, recording errors rather than stopping at them.
+    void parse_program();
+
+    // The error as a ParseError, at the current token unless it is one
+    // already.
+    [[nodiscard]] auto located(const std::exception &e) const -> ParseError;
+
+    // Records an error unless the last one was at the same token; returns
+    // whether there is room for more.
+    auto report(const ParseError &error) -> bool;
+
+    // Runs `parse`. If it fails the error is recorded, the parser state is
+    // put back as it was and `skip` moves past the bad input, unless the
+    // error limit or the end of the input has been reached; then the error
+    // is rethrown for the caller to give up on.
+    void recoverable(const std::function<void()> &parse,
+                     void (Parser::*skip)());
+
+    // Skip to the next ';', 'end', 'procedure' or 'function'.
+    void skip_statement();
+    // Skip past the next ';', or to the next 'begin', 'var', 'procedure' or
+    // 'function'.
+    void skip_declaration();
+    // Skip the rest of a procedure or function through the ';' after its
+    // body.
+    void skip_subprogram();
+
+    // The routine being generated
+    inline auto routine() -> Routine & { return listing.routines.back(); }
+
+    // Where code emitted to `code` goes
+    [[nodiscard]] inline auto target(Code *code) -> Code & {
+        return code ? *code : routine().code;
+    }
+
+    // Appends an instruction to `code`, or to the routine when no code is
+    // given. In syntax-only mode nothing is generated at all.
+    inline void emit_to(Code *code, const Opcode opcode,
+                        const Operand &a = {}, const Operand &b = {},
+                        const Operand &c = {}) {
+        if (options.syntax_only) {
+            return;
+        }
+        target(code).push_back({opcode, {a, b, c}});
+    }
+
+    inline void emit(const Opcode opcode, const Operand &a = {},
+                     const Operand &b = {}, const Operand &c = {}) {
+        emit_to(nullptr, opcode, a, b, c);
+    }
+
+    // The register of value `i` of the expression stack, or no register at
+    // all when the stack has underflowed
+    [[nodiscard]] inline auto gpr(const int i) -> Operand {
+        if (i < 0) {
+            return reg(Register::None);
+        }
+        if (static_cast<std::size_t>(i) >= gprs.size()) {
+            gprs.resize(static_cast<std::size_t>(i) + 1);
+        }
+        return reg(gprs[static_cast<std::size_t>(i)].reg);
+    }
+
+    // A new virtual register for the value about to go on top of the
+    // expression stack
+    inline auto fresh_gpr() -> Operand {
+        if (gpr_index >= gprs.size()) {
+            gprs.resize(gpr_index + 1U);
+        }
+        gprs[gpr_index].reg = virtual_register(virtuals++);
+        gprs[gpr_index].need = 1;
+        return reg(gprs[gpr_index].reg);
+    }
+
+    // What `lhs op rhs` comes to when both are literals of the same type, or
+    // nothing if they are not or the operation faults
+    [[nodiscard]] static auto fold(std::string_view op, const VarValue &lhs,
+                                   const VarValue &rhs)
+        -> std::optional<Literal>;
+
+    // Replaces the code of the top `count` values of the expression stack,
+    // all constants, with a load of `value`, what they fold to
+    void load_folded(Code *code, const VarValue &value,
+                     std::uint16_t count = 2);
+
+    // Moves the code of the top value of the expression stack ahead of the
+    // value under it if it needs more registers, then gives the pair, which
+    // an instruction is about to combine, its Sethi-Ullman number
+    void order_operands(Code *code);
+
+    // Propagates constants through the body that starts at `body_begin` and
+    // simplifies its control flow, runs the peephole pass over it, gives its
+    // virtual registers machine registers, and returns the bytes of frame its
+    // spilled values need below the locals.
+    auto allocate_body_registers() -> std::uint64_t;
+
+    // The jump taken when the last comparison holds, if there was one
+    [[nodiscard]] auto comparison_jump() const -> std::optional<Opcode>;
+
     void program();
+    void uses();
+    // Throws if a used unit declares a procedure or function `name` as well.
+    void check_unit_routine(const std::string &name) const;
     void block();
     void statement();
+    void statement_body();
     void if_prime();
     void mstatement();
-    void
-    expression(std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void s_expression(
-        std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void s_expression_r(
-        std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void s_expression_prime(
-        std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void term(std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void
-    term_r(std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void
-    term_prime(std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void fact(std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void
-    fact_prime(std::optional<std::reference_wrapper<std::stringstream>> stream);
-    void
-    fact_r(std::optional<std::reference_wrapper<std::stringstream>> stream);
+    void expression(Code *code);
+    void s_expression(Code *code);
+    void s_expression_r(Code *code);
+    void s_expression_prime(Code *code);
+    void term(Code *code);
+    void term_r(Code *code);
+    void term_prime(Code *code);
+    void fact(Code *code);
+    void fact_prime(Code *code);
+    void fact_r(Code *code);
     void handle_if();
     void handle_while();
     void end_program();
     void pfv();
+    void var_declaration();
+    void procedure_declaration();
+    void function_declaration();
+    void procedure_body(const std::string &name);
+    void function_body();
+    void defer_body(const std::string &name, const bool is_function);
+    void parse_deferred_bodies();
     void varlist();
-    void datatype();
+    // Parses a type, leaving the current token on its last one.
+    auto datatype() -> TypeId;
+    // Parses `low..high`.
+    auto subrange() -> TypeId;
+    // An array bound: an integer with an optional minus sign.
+    auto bound() -> std::int32_t;
+    // Parses a record type through its `end`.
+    auto record_type() -> TypeId;
     void mvar();
+    void variable_declaration();
     void param();
     void mparam();
-    void consume_params(const FuncData func);
-    void consume_params(const ProcData proc);
-    void dim();
-    void mdim();
+    void consume_params(const FuncData &func);
+    void consume_params(const ProcData &proc);
+    // Returns the memory operand of variable `entity` as seen from the
+    // current scope, first loading its address into ESI if it was passed by
+    // reference.
+    auto variable_operand(Code *code, const Entity &entity) -> Operand;
+    // The part of a variable named by the subscripts and fields that follow
+    // it, relative to the start of the variable
+    struct Selection {
+        TypeId type;
+        std::int64_t displacement = 0;
+        // The register holding the index of the element, in units of
+        // `scale` bytes, while one is taken
+        std::optional<std::uint16_t> index = std::nullopt;
+        std::uint64_t scale = 1;
+    };
+    // Parses the subscripts and fields applied to a variable of type `type`,
+    // computing the index of any element into a register that stays taken.
+    auto select(Code *code, const TypeId type) -> Selection;
+    // The memory operand of `selection` within variable `entity`.
+    auto element_operand(Code *code, const Entity &entity,
+                         const Selection &selection) -> Operand;
+    // Loads variable `entity`, or the element of it its subscripts and
+    // fields select, into the next free register and returns its type.
+    auto load_variable(Code *code, const Entity &entity) -> VarType;
+    // Stores the last register taken into `selection` of variable `entity`
+    // and frees it, along with the index register of the selection.
+    void store_variable(const Entity &entity, const Selection &selection);
+    void dim(std::vector<TypeId> &indices);
+    void mdim(std::vector<TypeId> &indices);
 };
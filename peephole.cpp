@@ -0,0 +1,508 @@
+#include "peephole.hpp"
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The rules, written as the listing reads. `$a` stands for a virtual register,
+// `#k` for an integer immediate, `[m]` for a memory operand and `@x` for a
+// label, and a name used twice stands for the same operand both times.
+// `[m+$a]` is a memory operand indexed by $a, and `[m+#k]` the same operand
+// with the index replaced by k. JCC is any conditional jump and !JCC, in a
+// replacement, the opposite one. Machine registers stand for themselves.
+struct RuleText {
+    std::string_view name;
+    std::string_view pattern;
+    std::string_view replacement;
+    // A register of the pattern that no later instruction may name
+    std::string_view dead = {};
+    // Later instructions name the second register instead of the first.
+    std::string_view rename = {};
+};
+
+static constexpr std::array<RuleText, PEEPHOLE_RULES> RULES = {{
+    {"store-reload", "MOV [m], $a; MOV $b, [m]", "MOV [m], $a; MOV $b, $a"},
+    {"copy", "MOV $b, $a", "", "$a", "$b $a"},
+    {"add-immediate", "LI $a, #k; ADD $d, $d, $a", "ADD $d, $d, #k", "$a"},
+    {"sub-immediate", "LI $a, #k; SUB $d, $d, $a", "SUB $d, $d, #k", "$a"},
+    {"imul-immediate", "LI $a, #k; IMUL $d, $d, $a", "IMUL $d, $d, #k",
+     "$a"},
+    {"cmp-immediate", "LI $a, #k; CMP $d, $a", "CMP $d, #k", "$a"},
+    {"add-memory", "MOV $a, [m]; ADD $d, $d, $a", "ADD $d, $d, [m]", "$a"},
+    {"sub-memory", "MOV $a, [m]; SUB $d, $d, $a", "SUB $d, $d, [m]", "$a"},
+    {"cmp-memory", "MOV $a, [m]; CMP $d, $a", "CMP $d, [m]", "$a"},
+    {"constant-index", "LI $a, #k; MOV $d, [m+$a]", "MOV $d, [m+#k]", "$a"},
+    {"jump-over-jump", "JCC @x; JMP @y; LABEL @x", "!JCC @y; LABEL @x"},
+    {"jump-to-next", "JMP @x; LABEL @x", "LABEL @x"},
+    {"branch-to-next", "JCC @x; LABEL @x", "LABEL @x"},
+}};
+
+static constexpr std::size_t VARIABLES = 8;
+
+// One operand of a compiled pattern or replacement
+struct OperandPattern {
+    // None, a variable, or a machine register
+    OperandKind kind = OperandKind::None;
+    std::uint8_t variable = 0;
+    Register fixed = Register::None;
+    // The variable after the `+` of a memory operand
+    std::optional<std::uint8_t> index;
+};
+
+struct InstructionPattern {
+    Opcode opcode = Opcode::Label;
+    // Any conditional jump, or in a replacement the bound one or its inverse
+    bool conditional = false;
+    bool inverse = false;
+    std::array<OperandPattern, 3> operands{};
+
+    [[nodiscard]] auto fits(const Opcode other) const -> bool {
+        return conditional ? is_conditional(other) : other == opcode;
+    }
+};
+
+struct Rule {
+    std::vector<InstructionPattern> pattern;
+    std::vector<InstructionPattern> replacement;
+    std::optional<std::uint8_t> dead;
+    std::optional<std::pair<std::uint8_t, std::uint8_t>> rename;
+};
+
+// Turns the text of the rules into patterns once, naming each variable of a
+// rule by its position in `names`.
+class RuleCompiler {
+  public:
+    auto compile(const RuleText &text) -> Rule {
+        names.clear();
+        Rule rule;
+        rule.pattern = instructions(text.pattern);
+        rule.replacement = instructions(text.replacement);
+        if (!text.dead.empty()) {
+            rule.dead = variable(text.dead);
+        }
+        if (!text.rename.empty()) {
+            const auto space = text.rename.find(' ');
+            rule.rename = {variable(text.rename.substr(0, space)),
+                           variable(text.rename.substr(space + 1))};
+        }
+        return rule;
+    }
+
+  private:
+    std::vector<std::string_view> names;
+
+    static constexpr std::array<std::pair<std::string_view, Opcode>, 9>
+        MNEMONICS = {{{"LABEL", Opcode::Label},
+                    {"MOV", Opcode::Mov},
+                    {"LI", Opcode::Li},
+                    {"ADD", Opcode::Add},
+                    {"SUB", Opcode::Sub},
+                    {"IMUL", Opcode::Imul},
+                    {"CMP", Opcode::Cmp},
+                    {"JMP", Opcode::Jmp},
+                    {"JCC", Opcode::Jl}}};
+    static constexpr std::array<std::string_view, 8> REGISTERS = {
+        "EAX", "EBX", "ECX", "EDX", "ESI", "EDI", "EBP", "ESP"};
+
+    static auto trim(std::string_view text) -> std::string_view {
+        while (!text.empty() && text.front() == ' ') {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && text.back() == ' ') {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    auto variable(const std::string_view name) -> std::uint8_t {
+        const auto found = std::ranges::find(names, name);
+        if (found != names.end()) {
+            return static_cast<std::uint8_t>(found - names.begin());
+        }
+        if (names.size() == VARIABLES) {
+            throw std::logic_error("peephole rule has too many variables");
+        }
+        names.push_back(name);
+        return static_cast<std::uint8_t>(names.size() - 1);
+    }
+
+    auto operand(const std::string_view text) -> OperandPattern {
+        OperandPattern result;
+        switch (text.front()) {
+        case '$':
+            result.kind = OperandKind::Register;
+            break;
+        case '#':
+            result.kind = OperandKind::Immediate;
+            break;
+        case '[':
+            result.kind = OperandKind::Memory;
+            if (const auto plus = text.find('+'); plus != text.npos) {
+                result.variable = variable(text.substr(0, plus));
+                result.index =
+                    variable(text.substr(plus + 1, text.size() - plus - 2));
+                return result;
+            }
+            break;
+        case '@':
+            result.kind = OperandKind::Label;
+            break;
+        default: {
+            const auto found = std::ranges::find(REGISTERS, text);
+            if (found == REGISTERS.end()) {
+                throw std::logic_error("bad peephole operand " +
+                                       std::string(text));
+            }
+            result.fixed = static_cast<Register>(found - REGISTERS.begin());
+            return result;
+        }
+        }
+        result.variable = variable(text);
+        return result;
+    }
+
+    auto instructions(std::string_view text)
+        -> std::vector<InstructionPattern> {
+        std::vector<InstructionPattern> result;
+        while (!trim(text).empty()) {
+            const auto end = std::min(text.find(';'), text.size());
+            auto line = trim(text.substr(0, end));
+            text.remove_prefix(std::min(end + 1, text.size()));
+
+            InstructionPattern instruction;
+            const auto space = std::min(line.find(' '), line.size());
+            auto mnemonic = line.substr(0, space);
+            line.remove_prefix(space);
+            if (mnemonic.front() == '!') {
+                instruction.inverse = true;
+                mnemonic.remove_prefix(1);
+            }
+            const auto found =
+                std::ranges::find(MNEMONICS, mnemonic,
+                                  &std::pair<std::string_view, Opcode>::first);
+            if (found == MNEMONICS.end()) {
+                throw std::logic_error("bad peephole mnemonic " +
+                                       std::string(mnemonic));
+            }
+            instruction.opcode = found->second;
+            instruction.conditional = mnemonic == "JCC";
+            for (std::size_t i = 0; !trim(line).empty(); ++i) {
+                const auto comma = std::min(line.find(','), line.size());
+                instruction.operands.at(i) =
+                    operand(trim(line.substr(0, comma)));
+                line.remove_prefix(std::min(comma + 1, line.size()));
+            }
+            result.push_back(instruction);
+        }
+        return result;
+    }
+};
+
+static constexpr std::size_t OPCODES =
+    static_cast<std::size_t>(Opcode::Jne) + 1;
+
+// The compiled rules, and for each opcode the rules whose pattern ends with
+// it, which are the only ones to try after an instruction with that opcode
+struct RuleSet {
+    std::vector<Rule> rules;
+    std::array<std::vector<std::uint8_t>, OPCODES> ending;
+};
+
+static auto rules() -> const RuleSet & {
+    static const auto compiled = [] {
+        RuleSet result;
+        RuleCompiler compiler;
+        for (const auto &text : RULES) {
+            result.rules.push_back(compiler.compile(text));
+        }
+        for (std::size_t opcode = 0; opcode < OPCODES; ++opcode) {
+            for (std::size_t r = 0; r < result.rules.size(); ++r) {
+                if (result.rules[r].pattern.back().fits(
+                        static_cast<Opcode>(opcode))) {
+                    result.ending[opcode].push_back(
+                        static_cast<std::uint8_t>(r));
+                }
+            }
+        }
+        return result;
+    }();
+    return compiled;
+}
+
+auto peephole_rule_name(const std::size_t rule) -> std::string_view {
+    return RULES[rule].name;
+}
+
+void PeepholeStats::merge(const PeepholeStats &other) {
+    for (std::size_t i = 0; i < fired.size(); ++i) {
+        fired[i] += other.fired[i];
+    }
+}
+
+static auto same(const Operand &a, const Operand &b) -> bool {
+    if (a.kind != b.kind) {
+        return false;
+    }
+    switch (a.kind) {
+    case OperandKind::None:
+        return true;
+    case OperandKind::Register:
+    case OperandKind::LowByte:
+        return a.reg == b.reg;
+    case OperandKind::Immediate:
+        return a.value == b.value;
+    case OperandKind::Real:
+        return a.real == b.real;
+    case OperandKind::Memory:
+    case OperandKind::BytePointer:
+        return a.reg == b.reg && a.index == b.index && a.scale == b.scale &&
+               a.sign == b.sign && a.value == b.value;
+    case OperandKind::Label:
+        return a.label == b.label;
+    }
+    return false;
+}
+
+template <typename F>
+static void each_register(Instruction &instruction, F &&visit) {
+    for (auto &operand : instruction.operands) {
+        switch (operand.kind) {
+        case OperandKind::Register:
+        case OperandKind::LowByte:
+            visit(operand.reg);
+            break;
+        case OperandKind::Memory:
+        case OperandKind::BytePointer:
+            visit(operand.reg);
+            visit(operand.index);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// The memory operand `memory` with its index replaced by the constant `index`
+static auto constant_index(Operand memory, const std::int64_t index)
+    -> Operand {
+    const auto displacement = (memory.sign == '-' ? -1 : 1) * memory.value +
+                              index * memory.scale;
+    memory.index = Register::None;
+    memory.scale = 1;
+    memory.sign = displacement < 0 ? '-' : displacement > 0 ? '+' : 0;
+    memory.value = displacement < 0 ? -displacement : displacement;
+    return memory;
+}
+
+namespace {
+
+// The operands and jump a window bound to the variables of a rule
+struct Bindings {
+    std::array<Operand, VARIABLES> operands{};
+    std::array<bool, VARIABLES> bound{};
+    Opcode jump = Opcode::Jl;
+
+    auto bind(const std::uint8_t variable, const Operand &operand) -> bool {
+        if (bound[variable]) {
+            return same(operands[variable], operand);
+        }
+        bound[variable] = true;
+        operands[variable] = operand;
+        return true;
+    }
+
+    auto match(const OperandPattern &pattern, const Operand &operand) -> bool {
+        if (pattern.kind == OperandKind::None) {
+            if (pattern.fixed == Register::None) {
+                return operand.kind == OperandKind::None;
+            }
+            return operand.kind == OperandKind::Register &&
+                   operand.reg == pattern.fixed;
+        }
+        if (operand.kind != pattern.kind ||
+            (pattern.kind == OperandKind::Register &&
+             !is_virtual(operand.reg))) {
+            return false;
+        }
+        if (pattern.index) {
+            return is_virtual(operand.index) &&
+                   bind(*pattern.index, reg(operand.index)) &&
+                   bind(pattern.variable, operand);
+        }
+        return bind(pattern.variable, operand);
+    }
+
+    // The opcode has already been found to fit.
+    auto match(const InstructionPattern &pattern,
+               const Instruction &instruction) -> bool {
+        if (pattern.conditional) {
+            jump = instruction.opcode;
+        }
+        for (std::size_t i = 0; i < 3; ++i) {
+            if (!match(pattern.operands[i], instruction.operands[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] auto build(const InstructionPattern &pattern) const
+        -> Instruction {
+        Instruction instruction{
+            pattern.conditional
+                ? (pattern.inverse ? inverse(jump) : jump)
+                : pattern.opcode};
+        for (std::size_t i = 0; i < 3; ++i) {
+            const auto &operand = pattern.operands[i];
+            if (operand.index) {
+                instruction.operands[i] = constant_index(
+                    operands[operand.variable], operands[*operand.index].value);
+            } else if (operand.kind != OperandKind::None) {
+                instruction.operands[i] = operands[operand.variable];
+            } else if (operand.fixed != Register::None) {
+                instruction.operands[i] = reg(operand.fixed);
+            }
+        }
+        return instruction;
+    }
+};
+
+// Rewrites the code of a body in place: the instructions before `end` are
+// the code rewritten so far, which is never longer than what it came from.
+// For each virtual register it keeps the position in the original code past
+// which nothing names it, and what the register was renamed to.
+class Window {
+  public:
+    Window(Code &code, const std::size_t begin)
+        : code(code), begin(begin), end(begin) {
+        for (auto i = begin; i < code.size(); ++i) {
+            each_register(code[i], [&](const Register r) {
+                if (is_virtual(r)) {
+                    if (number(r) >= last.size()) {
+                        last.resize(number(r) + 1, 0);
+                    }
+                    last[number(r)] = i;
+                }
+            });
+        }
+        renamed.resize(last.size());
+        for (std::uint32_t i = 0; i < renamed.size(); ++i) {
+            renamed[i] = virtual_register(i);
+        }
+        origins.resize(code.size() - begin);
+    }
+
+    // Moves the instruction at `position`, past the rewritten code, to its
+    // end.
+    void push(const std::size_t position) {
+        auto instruction = code[position];
+        each_register(instruction, [&](Register &r) {
+            if (is_virtual(r)) {
+                r = find(r);
+            }
+        });
+        code[end] = instruction;
+        origins[end - begin] = position;
+        end++;
+    }
+
+    // Tries the rules on the instructions just pushed; returns the one that
+    // fired.
+    auto rewrite() -> std::optional<std::size_t> {
+        const auto &set = rules();
+        const auto opcode = static_cast<std::size_t>(code[end - 1].opcode);
+        for (const auto r : set.ending[opcode]) {
+            const auto &rule = set.rules[r];
+            const auto size = rule.pattern.size();
+            if (size > end - begin) {
+                continue;
+            }
+            const auto first = end - size;
+            // Most windows fail on their opcodes alone.
+            bool fits = true;
+            for (std::size_t i = 0; i + 1 < size && fits; ++i) {
+                fits = rule.pattern[i].fits(code[first + i].opcode);
+            }
+            if (!fits) {
+                continue;
+            }
+            bindings.bound = {};
+            bool matched = true;
+            for (std::size_t i = 0; i < size && matched; ++i) {
+                matched = bindings.match(rule.pattern[i], code[first + i]);
+            }
+            const auto origin = origins[end - 1 - begin];
+            // The dead register may be bound to another variable too, which
+            // the replacement still names.
+            if (!matched ||
+                (rule.dead &&
+                 (last[number(bindings.operands[*rule.dead].reg)] > origin ||
+                  names(rule.replacement,
+                        bindings.operands[*rule.dead].reg)))) {
+                continue;
+            }
+            if (rule.rename) {
+                const auto from = bindings.operands[rule.rename->first].reg;
+                const auto to = bindings.operands[rule.rename->second].reg;
+                renamed[number(from)] = to;
+                last[number(to)] =
+                    std::max(last[number(to)], last[number(from)]);
+            }
+            end = first;
+            for (const auto &pattern : rule.replacement) {
+                code[end] = bindings.build(pattern);
+                origins[end - begin] = origin;
+                end++;
+            }
+            return r;
+        }
+        return std::nullopt;
+    }
+
+    Code &code;
+    const std::size_t begin;
+    std::size_t end;
+
+  private:
+    // Whether an instruction built from `patterns` names `r`
+    [[nodiscard]] auto names(const std::vector<InstructionPattern> &patterns,
+                             const Register r) const -> bool {
+        bool named = false;
+        for (const auto &pattern : patterns) {
+            auto instruction = bindings.build(pattern);
+            each_register(instruction, [&](const Register other) {
+                named = named || other == r;
+            });
+        }
+        return named;
+    }
+
+    // What `r` was renamed to, through any chain of renames
+    auto find(const Register r) -> Register {
+        auto &to = renamed[number(r)];
+        if (to != r) {
+            to = find(to);
+        }
+        return to;
+    }
+
+    // Reused from window to window, as only `bound` needs clearing
+    Bindings bindings;
+    std::vector<std::size_t> origins;
+    std::vector<std::size_t> last;
+    std::vector<Register> renamed;
+};
+
+} // namespace
+
+void peephole(Code &code, const std::size_t begin, PeepholeStats &stats) {
+    Window window(code, begin);
+    for (auto i = begin; i < code.size(); ++i) {
+        window.push(i);
+        while (const auto fired = window.rewrite()) {
+            stats.fired[*fired]++;
+        }
+    }
+    code.resize(window.end);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "ir.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+static constexpr std::size_t PEEPHOLE_RULES = 13;
+
+// How often each peephole rule fired
+struct PeepholeStats {
+    std::array<std::uint64_t, PEEPHOLE_RULES> fired{};
+
+    void merge(const PeepholeStats &other);
+};
+
+// The name of each rule, in the order of PeepholeStats::fired
+[[nodiscard]] auto peephole_rule_name(std::size_t rule) -> std::string_view;
+
+// Slides a window over the code of one body, from `begin` to the end of
+// `code`, before its registers are allocated, and replaces each run of
+// instructions a rule matches with the rule's shorter one. After a rewrite the
+// window looks back again, so rewrites can enable one another.
+void peephole(Code &code, std::size_t begin, PeepholeStats &stats);
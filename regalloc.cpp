@@ -0,0 +1,396 @@
+#include "regalloc.hpp"
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+static constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+static constexpr std::size_t MACHINE_REGISTERS = 8;
+
+// How an instruction uses one of the registers it names
+struct Access {
+    bool read = false;
+    bool write = false;
+    // Only its low byte
+    bool byte = false;
+};
+
+static auto reads_first(const Opcode opcode) -> bool {
+    switch (opcode) {
+    case Opcode::Mov:
+    case Opcode::Li:
+    case Opcode::Movzx:
+    case Opcode::Lea:
+    case Opcode::Pop:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Calls `visit(reg, access)` for every register slot of the instruction,
+// including the empty ones.
+template <typename I, typename F>
+static void each_register(I &instruction, F &&visit) {
+    for (std::size_t i = 0; i < 3; ++i) {
+        auto &operand = instruction.operands[i];
+        switch (operand.kind) {
+        case OperandKind::Register:
+        case OperandKind::LowByte: {
+            const auto written = i == 0 && writes_first(instruction.opcode);
+            visit(operand.reg,
+                  Access{.read = !written || reads_first(instruction.opcode),
+                         .write = written,
+                         .byte = operand.kind == OperandKind::LowByte});
+            break;
+        }
+        case OperandKind::Memory:
+        case OperandKind::BytePointer:
+            visit(operand.reg, Access{.read = true});
+            visit(operand.index, Access{.read = true});
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static auto has_low_byte(const Register r) -> bool {
+    return r <= Register::EDX;
+}
+
+static auto machine(const Register r) -> std::size_t {
+    return static_cast<std::size_t>(r);
+}
+
+// Positions count two per instruction: reads happen at the first, writes at
+// the second, so a value last read by an instruction is gone by the time the
+// instruction writes its result.
+struct Interval {
+    std::uint32_t start = NONE;
+    std::uint32_t end = 0;
+    // Stored as a byte somewhere
+    bool byte = false;
+    Register assigned = Register::None;
+    std::uint32_t slot = NONE;
+};
+
+struct Range {
+    std::uint32_t start;
+    std::uint32_t end;
+};
+
+struct Lifetimes {
+    // By virtual register number
+    std::vector<Interval> intervals;
+    // Where the code uses each machine register itself, in order
+    std::array<std::vector<Range>, MACHINE_REGISTERS> fixed;
+    // Read before the code writes it
+    std::array<bool, MACHINE_REGISTERS> live_in{};
+    bool divides = false;
+
+    [[nodiscard]] auto of(const Register r) -> Interval & {
+        return intervals[number(r)];
+    }
+
+    // Whether `r` can hold `interval`'s value for all of its life, leaving
+    // aside the other virtual registers
+    [[nodiscard]] auto fits(const Register r, const Interval &interval) const
+        -> bool {
+        if ((interval.byte && !has_low_byte(r)) || live_in[machine(r)]) {
+            return false;
+        }
+        const auto &ranges = fixed[machine(r)];
+        // The first use that ends after the interval starts
+        const auto found =
+            std::ranges::lower_bound(ranges, interval.start, {}, &Range::end);
+        return found == ranges.end() || found->start > interval.end;
+    }
+};
+
+static auto lifetimes(const Code &code, const std::size_t begin)
+    -> Lifetimes {
+    Lifetimes result;
+    for (auto i = begin; i < code.size(); ++i) {
+        const auto at = static_cast<std::uint32_t>(2 * (i - begin));
+        each_register(code[i], [&](const Register r, const Access access) {
+            if (is_virtual(r)) {
+                if (number(r) >= result.intervals.size()) {
+                    result.intervals.resize(number(r) + 1);
+                }
+                auto &interval = result.of(r);
+                interval.start =
+                    std::min(interval.start, access.read ? at : at + 1);
+                interval.end = std::max(interval.end,
+                                        access.write ? at + 1 : at);
+                interval.byte = interval.byte || access.byte;
+            } else if (r < Register::None) {
+                auto &ranges = result.fixed[machine(r)];
+                if (access.read) {
+                    if (ranges.empty()) {
+                        result.live_in[machine(r)] = true;
+                    } else {
+                        ranges.back().end = at;
+                    }
+                }
+                if (access.write) {
+                    ranges.push_back({at + 1, at + 1});
+                }
+            }
+        });
+        // Division goes through EAX and EDX, so nothing the instruction
+        // reads or anything live across it can be there.
+        if (code[i].opcode == Opcode::Divide) {
+            result.divides = true;
+            for (const auto r : {Register::EAX, Register::EDX}) {
+                result.fixed[machine(r)].push_back({at, at + 1});
+            }
+        }
+    }
+    return result;
+}
+
+// Assigns each interval a register from `registers` or a spill slot; returns
+// the number of slots.
+static auto scan(Lifetimes &lifetimes,
+                 const std::span<const Register> registers) -> std::uint32_t {
+    auto &intervals = lifetimes.intervals;
+    std::vector<std::uint32_t> order;
+    for (std::uint32_t i = 0; i < intervals.size(); ++i) {
+        intervals[i].assigned = Register::None;
+        intervals[i].slot = NONE;
+        if (intervals[i].start != NONE) {
+            order.push_back(i);
+        }
+    }
+    std::ranges::stable_sort(
+        order, {}, [&](const std::uint32_t i) { return intervals[i].start; });
+
+    // The intervals holding registers and slots, and for each slot the end
+    // of the last interval that held it, or NONE while one does
+    std::vector<std::uint32_t> active;
+    std::vector<std::uint32_t> spilled;
+    std::vector<std::uint32_t> slots;
+    const auto spill = [&](const std::uint32_t i) {
+        auto &interval = intervals[i];
+        const auto free = std::ranges::find_if(slots, [&](const auto end) {
+            return end != NONE && end < interval.start;
+        });
+        interval.slot = static_cast<std::uint32_t>(free - slots.begin());
+        if (free == slots.end()) {
+            slots.push_back(NONE);
+        } else {
+            *free = NONE;
+        }
+        spilled.push_back(i);
+    };
+
+    for (const auto current : order) {
+        auto &interval = intervals[current];
+        std::erase_if(active, [&](const std::uint32_t i) {
+            return intervals[i].end < interval.start;
+        });
+        std::erase_if(spilled, [&](const std::uint32_t i) {
+            if (intervals[i].end >= interval.start) {
+                return false;
+            }
+            slots[intervals[i].slot] = intervals[i].end;
+            return true;
+        });
+
+        const auto held = [&](const Register r) {
+            return std::ranges::any_of(active, [&](const std::uint32_t i) {
+                return intervals[i].assigned == r;
+            });
+        };
+        const auto free = std::ranges::find_if(registers, [&](const auto r) {
+            return lifetimes.fits(r, interval) && !held(r);
+        });
+        if (free != registers.end()) {
+            interval.assigned = *free;
+            active.push_back(current);
+            continue;
+        }
+
+        auto victim = NONE;
+        for (const auto i : active) {
+            if (lifetimes.fits(intervals[i].assigned, interval) &&
+                (victim == NONE || intervals[i].end > intervals[victim].end)) {
+                victim = i;
+            }
+        }
+        if (victim != NONE && intervals[victim].end > interval.end) {
+            interval.assigned = intervals[victim].assigned;
+            intervals[victim].assigned = Register::None;
+            std::erase(active, victim);
+            active.push_back(current);
+            spill(victim);
+        } else {
+            spill(current);
+        }
+    }
+    return static_cast<std::uint32_t>(slots.size());
+}
+
+// The registers kept back to carry spilled values, which the code must not
+// name itself: one with a low byte, for values stored as bytes, and another.
+static auto scratch_registers(const Lifetimes &lifetimes,
+                              const std::span<const Register> registers)
+    -> std::optional<std::array<Register, 2>> {
+    const auto usable = [&](const Register r) {
+        return std::ranges::find(registers, r) != registers.end() &&
+               !lifetimes.live_in[machine(r)] &&
+               lifetimes.fixed[machine(r)].empty();
+    };
+    // EAX and EDX are left for the values, as division goes through them.
+    static constexpr std::array<Register, 4> BYTES = {
+        Register::ECX, Register::EBX, Register::EDX, Register::EAX};
+    static constexpr std::array<Register, 6> ANY = {
+        Register::EDI, Register::ESI, Register::EBX,
+        Register::ECX, Register::EDX, Register::EAX};
+    const auto byte = std::ranges::find_if(BYTES, usable);
+    if (byte == BYTES.end()) {
+        return std::nullopt;
+    }
+    const auto other = std::ranges::find_if(
+        ANY, [&](const Register r) { return r != *byte && usable(r); });
+    if (other == ANY.end()) {
+        return std::nullopt;
+    }
+    return std::array{*byte, *other};
+}
+
+static void lower_divide(Code &out, const Instruction &instruction) {
+    const auto &dividend = instruction.operands[0];
+    out.push_back({Opcode::Mov, {reg(Register::EAX), dividend}});
+    out.push_back({Opcode::Cdq, {}});
+    out.push_back({Opcode::Idiv, {instruction.operands[1]}});
+    out.push_back({Opcode::Mov, {dividend, reg(Register::EAX)}});
+}
+
+auto allocate_registers(Code &code, const std::size_t begin,
+                        const std::span<const Register> registers,
+                        const std::function<Operand(std::uint32_t)> &slot)
+    -> Allocation {
+    auto lives = lifetimes(code, begin);
+    std::vector<Register> kept(registers.begin(), registers.end());
+    auto slots = scan(lives, kept);
+    std::optional<std::array<Register, 2>> scratch;
+    if (slots != 0) {
+        scratch = scratch_registers(lives, registers);
+        if (!scratch) {
+            throw std::runtime_error(
+                "Bad code: expression is too complicated");
+        }
+        std::erase_if(kept, [&](const Register r) {
+            return r == (*scratch)[0] || r == (*scratch)[1];
+        });
+        slots = scan(lives, kept);
+    }
+
+    Allocation allocation{.slots = slots};
+    for (const auto &interval : lives.intervals) {
+        if (interval.start != NONE) {
+            allocation.virtuals++;
+            allocation.spilled += interval.slot != NONE ? 1 : 0;
+        }
+    }
+
+    // Nothing to add, so the registers can be put in place.
+    if (slots == 0 && !lives.divides) {
+        for (auto i = begin; i < code.size(); ++i) {
+            each_register(code[i], [&](Register &r, const Access) {
+                if (is_virtual(r)) {
+                    r = lives.of(r).assigned;
+                }
+            });
+        }
+        return allocation;
+    }
+
+    Code out;
+    out.reserve(code.size() - begin);
+    for (auto i = begin; i < code.size(); ++i) {
+        auto instruction = code[i];
+        // The spilled values the instruction names, and how
+        struct Carried {
+            Register value;
+            Access access;
+            Register through = Register::None;
+        };
+        std::array<Carried, 2> carried{};
+        std::size_t count = 0;
+        each_register(instruction, [&](const Register r, const Access access) {
+            if (!is_virtual(r) || lives.of(r).slot == NONE) {
+                return;
+            }
+            const auto found =
+                std::find_if(carried.begin(), carried.begin() + count,
+                             [&](const auto &c) { return c.value == r; });
+            if (found != carried.begin() + count) {
+                found->access.read = found->access.read || access.read;
+                found->access.write = found->access.write || access.write;
+                found->access.byte = found->access.byte || access.byte;
+            } else if (count == carried.size()) {
+                throw std::runtime_error(
+                    "Bad code: expression is too complicated");
+            } else {
+                carried[count++] = {r, access};
+            }
+        });
+        // A byte goes through the scratch register that has one.
+        for (std::size_t c = 0; c < count; ++c) {
+            if (carried[c].access.byte) {
+                carried[c].through = (*scratch)[0];
+            }
+        }
+        for (std::size_t c = 0; c < count; ++c) {
+            if (!carried[c].access.byte) {
+                carried[c].through = carried[1 - c].through == (*scratch)[1]
+                                         ? (*scratch)[0]
+                                         : (*scratch)[1];
+            }
+        }
+        if (count == 2 && carried[0].through == carried[1].through) {
+            throw std::runtime_error(
+                "Bad code: expression is too complicated");
+        }
+        each_register(instruction, [&](Register &r, const Access) {
+            if (!is_virtual(r)) {
+                return;
+            }
+            if (const auto &interval = lives.of(r); interval.slot == NONE) {
+                r = interval.assigned;
+                return;
+            }
+            r = std::find_if(carried.begin(), carried.begin() + count,
+                             [&](const auto &c) { return c.value == r; })
+                    ->through;
+        });
+
+        for (std::size_t c = 0; c < count; ++c) {
+            if (carried[c].access.read) {
+                out.push_back({Opcode::Mov,
+                               {reg(carried[c].through),
+                                slot(lives.of(carried[c].value).slot)}});
+            }
+        }
+        if (instruction.opcode == Opcode::Divide) {
+            lower_divide(out, instruction);
+        } else {
+            out.push_back(instruction);
+        }
+        for (std::size_t c = 0; c < count; ++c) {
+            if (carried[c].access.write) {
+                out.push_back({Opcode::Mov,
+                               {slot(lives.of(carried[c].value).slot),
+                                reg(carried[c].through)}});
+            }
+        }
+    }
+    code.resize(begin);
+    code.insert(code.end(), out.cbegin(), out.cend());
+    return allocation;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "ir.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+
+// What allocating the registers of one body came to
+struct Allocation {
+    std::uint32_t virtuals = 0;
+    // Virtual registers kept in spill slots rather than machine registers
+    std::uint32_t spilled = 0;
+    // Spill slots used, 4 bytes each
+    std::uint32_t slots = 0;
+};
+
+// Linear scan over the code of one body, from `begin` to the end of `code`,
+// whose virtual registers are numbered from 0.
+//
+// Each virtual register lives from the first instruction that names it to the
+// last, and is given the first of `registers` that is free for all of that
+// time. A machine register the code names itself is only taken where it is
+// not in use; one the body reads before writing is never taken. Values stored
+// as bytes only get registers with a low byte.
+//
+// When a value finds nothing free, whichever of it and the values holding
+// registers it could use lives longest goes to a spill slot for its whole
+// life. Two registers are then kept back from allocation, and each
+// instruction naming a spilled value loads it into one of them from
+// `slot(n)` and stores it back after writing it.
+//
+// Division is written out last, through EAX and EDX, which nothing else holds
+// across it.
+auto allocate_registers(Code &code, const std::size_t begin,
+                        const std::span<const Register> registers,
+                        const std::function<Operand(std::uint32_t)> &slot)
+    -> Allocation;
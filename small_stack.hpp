@@ -0,0 +1,181 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// A LIFO container that keeps its first N elements in inline storage and only
+// falls back to the heap once it grows past them. The parser's operand,
+// conditional and loop stacks are pushed and popped for every operand but are
+// rarely more than a handful of entries deep, so this keeps them out of the
+// allocator entirely in the common case.
+template <typename T, std::size_t N> class SmallStack {
+    static_assert(N > 0, "SmallStack needs at least one inline slot");
+
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using iterator = T *;
+    using const_iterator = const T *;
+
+    SmallStack() = default;
+
+    SmallStack(const SmallStack &other) {
+        reserve(other.count);
+        std::uninitialized_copy(other.begin(), other.end(), elements);
+        count = other.count;
+    }
+
+    SmallStack(SmallStack &&other) noexcept(
+        std::is_nothrow_move_constructible_v<T>) {
+        steal(std::move(other));
+    }
+
+    auto operator=(const SmallStack &other) -> SmallStack & {
+        if (this != &other) {
+            clear();
+            reserve(other.count);
+            std::uninitialized_copy(other.begin(), other.end(), elements);
+            count = other.count;
+        }
+        return *this;
+    }
+
+    auto operator=(SmallStack &&other) noexcept(
+        std::is_nothrow_move_constructible_v<T>) -> SmallStack & {
+        if (this != &other) {
+            clear();
+            release();
+            steal(std::move(other));
+        }
+        return *this;
+    }
+
+    ~SmallStack() {
+        clear();
+        release();
+    }
+
+    void push(const T &value) { emplace(value); }
+
+    void push(T &&value) { emplace(std::move(value)); }
+
+    template <typename... Args> auto emplace(Args &&...args) -> T & {
+        if (count < capacity) {
+            auto slot = std::construct_at(elements + count,
+                                          std::forward<Args>(args)...);
+            count++;
+            return *slot;
+        }
+        // The arguments may refer to an element, as in push(top()), so the
+        // new element is made before the old ones move out from under them.
+        std::allocator<T> alloc;
+        const auto new_capacity = capacity * 2;
+        T *grown = alloc.allocate(new_capacity);
+        T *slot = nullptr;
+        try {
+            slot = std::construct_at(grown + count,
+                                     std::forward<Args>(args)...);
+        } catch (...) {
+            alloc.deallocate(grown, new_capacity);
+            throw;
+        }
+        adopt(grown, new_capacity);
+        count++;
+        return *slot;
+    }
+
+    void pop() {
+        count--;
+        std::destroy_at(elements + count);
+    }
+
+    [[nodiscard]] inline auto top() -> T & { return elements[count - 1]; }
+
+    [[nodiscard]] inline auto top() const -> const T & {
+        return elements[count - 1];
+    }
+
+    [[nodiscard]] inline auto empty() const -> bool { return count == 0; }
+
+    [[nodiscard]] inline auto size() const -> size_type { return count; }
+
+    [[nodiscard]] inline auto is_inline() const -> bool {
+        return elements == inline_elements();
+    }
+
+    void clear() {
+        std::destroy(elements, elements + count);
+        count = 0;
+    }
+
+    void reserve(const size_type wanted) {
+        if (wanted > capacity) {
+            grow(wanted);
+        }
+    }
+
+    [[nodiscard]] inline auto begin() -> iterator { return elements; }
+
+    [[nodiscard]] inline auto end() -> iterator { return elements + count; }
+
+    [[nodiscard]] inline auto begin() const -> const_iterator {
+        return elements;
+    }
+
+    [[nodiscard]] inline auto end() const -> const_iterator {
+        return elements + count;
+    }
+
+  private:
+    alignas(T) std::byte storage[N * sizeof(T)];
+    T *elements = inline_elements();
+    size_type count = 0;
+    size_type capacity = N;
+
+    [[nodiscard]] inline auto inline_elements() -> T * {
+        return reinterpret_cast<T *>(storage);
+    }
+
+    [[nodiscard]] inline auto inline_elements() const -> const T * {
+        return reinterpret_cast<const T *>(storage);
+    }
+
+    void grow(const size_type new_capacity) {
+        adopt(std::allocator<T>().allocate(new_capacity), new_capacity);
+    }
+
+    // Moves the elements into `grown`, a heap block of `new_capacity`, and
+    // keeps them there from now on.
+    void adopt(T *grown, const size_type new_capacity) {
+        std::uninitialized_move(elements, elements + count, grown);
+        std::destroy(elements, elements + count);
+        release();
+        elements = grown;
+        capacity = new_capacity;
+    }
+
+    // Frees the heap block, if any, without touching the elements in it.
+    void release() {
+        if (!is_inline()) {
+            std::allocator<T>().deallocate(elements, capacity);
+            elements = inline_elements();
+            capacity = N;
+        }
+    }
+
+    void steal(SmallStack &&other) {
+        if (other.is_inline()) {
+            std::uninitialized_move(other.begin(), other.end(), elements);
+            count = other.count;
+            other.clear();
+        } else {
+            elements = other.elements;
+            capacity = other.capacity;
+            count = other.count;
+            other.elements = other.inline_elements();
+            other.capacity = N;
+            other.count = 0;
+        }
+    }
+};
@@ -1,124 +1,409 @@
 #include "symtab.hpp"
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
 
-SymbolTable::SymbolTable() {
-    cur_scope = new Scope;
-    cur_scope->param_offset = 0;
-    cur_scope->var_offset = 0;
-    cur_scope->name = "";
-    cur_scope->previous = nullptr;
+void SymbolStats::merge(const SymbolStats &other) {
+    for (std::size_t kind = 0; kind < lookups.size(); ++kind) {
+        lookups[kind] += other.lookups[kind];
+    }
+    misses += other.misses;
+    tables_searched += other.tables_searched;
+    max_tables_searched =
+        std::max(max_tables_searched, other.max_tables_searched);
+    chained += other.chained;
+    chain_depth += other.chain_depth;
+    max_chain_depth = std::max(max_chain_depth, other.max_chain_depth);
+    probes += other.probes;
+    probe_groups += other.probe_groups;
+    max_probe_groups = std::max(max_probe_groups, other.max_probe_groups);
+    scopes += other.scopes;
+    symbols += other.symbols;
+    tables += other.tables;
+    load_factor_sum += other.load_factor_sum;
+    min_load_factor = std::min(min_load_factor, other.min_load_factor);
+    max_load_factor = std::max(max_load_factor, other.max_load_factor);
+}
+
+static void count_table(SymbolStats &counts, const Scope &scope) {
+    const auto load = scope.table.load_factor();
+    counts.tables++;
+    counts.load_factor_sum += load;
+    counts.min_load_factor = std::min(counts.min_load_factor, load);
+    counts.max_load_factor = std::max(counts.max_load_factor, load);
+}
+
+SymbolTable::SymbolTable()
+    : own_types(std::make_unique<TypeTable>()), types(own_types.get()) {
+    cur_scope = scopes->make();
+    global = cur_scope;
+    root = cur_scope;
+    if constexpr (SYMTAB_COUNTERS) {
+        counts.scopes++;
+    }
+}
+
+FrozenScope::FrozenScope(const Scope &scope) : used(scope.imports) {
+    declarations.reserve(scope.table.size());
+    entries.reserve(scope.table.size());
+    for (const auto &[name, data] : scope.table) {
+        entries.push_back({.hash = hash_of(name),
+                           .name = static_cast<std::uint32_t>(names.size()),
+                           .length = static_cast<std::uint32_t>(name.size())});
+        names += name;
+        declarations.push_back(data);
+    }
+    slots.assign(std::bit_ceil(std::max<std::size_t>(2 * entries.size(), 8)),
+                 0);
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        const auto &entry = entries[i];
+        slots[slot_of({names.data() + entry.name, entry.length}, entry.hash)] =
+            static_cast<std::uint32_t>(i + 1);
+    }
+}
+
+auto FrozenScope::slot_of(const std::string_view name,
+                          const std::size_t hash) const -> std::size_t {
+    const auto mask = slots.size() - 1;
+    for (auto slot = hash & mask;; slot = (slot + 1) & mask) {
+        if (slots[slot] == 0) {
+            return slot;
+        }
+        const auto &entry = entries[slots[slot] - 1];
+        if (entry.hash == hash &&
+            std::string_view(names.data() + entry.name, entry.length) ==
+                name) {
+            return slot;
+        }
+    }
+}
+
+auto FrozenScope::find(const std::string_view name,
+                       const std::uint64_t horizon) const
+    -> const std::variant<VarData, ProcData, FuncData> * {
+    const auto entry = slots[slot_of(name, hash_of(name))];
+    return entry != 0 && entry - 1 < horizon ? &declarations[entry - 1]
+                                             : nullptr;
+}
+
+auto FrozenScope::probe_length(const std::string_view key) const
+    -> std::size_t {
+    const auto hash = hash_of(key);
+    return ((slot_of(key, hash) - hash) & (slots.size() - 1)) + 1;
+}
+
+SymbolTable::SymbolTable(const FrozenScope &globals, Scope *scope,
+                         const std::uint64_t horizon, ScopeArena &scopes,
+                         TypeTable &types)
+    : cur_scope(scope), horizon(horizon), scopes(&scopes), types(&types),
+      frozen(&globals), root(scope) {
+    std::vector<Scope *> open;
+    for (auto trav_scope = scope; trav_scope->previous;
+         trav_scope = trav_scope->previous) {
+        open.push_back(trav_scope);
+    }
+    global = open.empty() ? scope : open.back()->previous;
+    for (auto it = open.rbegin(); it != open.rend(); ++it) {
+        for (std::uint64_t order = 0; order < (*it)->table.size(); ++order) {
+            bindings.try_emplace((*it)->table.begin()[order].first, {})
+                .first->second.push({*it, order});
+        }
+    }
 }
 
 SymbolTable::~SymbolTable() {}
 
+// The declaration of the procedure or function whose scope `scope` is
+static auto owner(const Scope *scope)
+    -> std::variant<VarData, ProcData, FuncData> & {
+    return scope->previous->table.find(scope->name)->second;
+}
+
+template <typename Map>
+void SymbolTable::count_probe(const Map &map,
+                              const std::string_view key) const {
+    const auto groups = map.probe_length(key);
+    counts.probes++;
+    counts.probe_groups += groups;
+    counts.max_probe_groups =
+        std::max<std::uint64_t>(counts.max_probe_groups, groups);
+}
+
+void SymbolTable::bind(const std::string_view name,
+                       const std::uint64_t order) const {
+    if (cur_scope != global) {
+        bindings.try_emplace(name, {}).first->second.push({cur_scope, order});
+    }
+}
+
 [[nodiscard]] auto
-SymbolTable::add_variable(const std::string name, const VarType type,
-                          const std::uint64_t size, const bool pass_by_ref,
-                          const bool is_param) const -> bool {
-    if (cur_scope->table.contains(name)) {
+SymbolTable::add_variable(const std::string_view name, const TypeId type,
+                          const bool pass_by_ref, const bool is_param) const
+    -> bool {
+    const auto order = cur_scope->table.size();
+    const auto size = types->size_of(type);
+    const auto [entry, inserted] =
+        cur_scope->table.try_emplace(name, VarData{.type = type,
+                                                   .pass_by_ref = pass_by_ref,
+                                                   .is_param = is_param,
+                                                   .size = size,
+                                                   .offset = 0,
+                                                   .order = order});
+    if (!inserted) {
         return false;
     }
+    if constexpr (SYMTAB_COUNTERS) {
+        counts.symbols++;
+    }
+    bind(name, order);
+    auto &offset = std::get<VarData>(entry->second).offset;
     if (is_param) {
-        cur_scope->table[name] = VarData{.type = type,
-                                         .size = size,
-                                         .offset = 8 + cur_scope->param_offset,
-                                         .pass_by_ref = pass_by_ref,
-                                         .is_param = is_param,
-                                         .next = nullptr};
-        cur_scope->param_offset += size;
+        // A reference takes one slot whatever it refers to.
+        offset = cur_scope->frame.add_parameter(pass_by_ref ? FrameLayout::SLOT
+                                                            : size);
+        auto parameter = Parameter{.name = std::string(name),
+                                   .type = type,
+                                   .pass_by_ref = pass_by_ref,
+                                   .offset = offset};
+        if (auto &declaration = owner(cur_scope);
+            std::holds_alternative<ProcData>(declaration)) {
+            std::get<ProcData>(declaration)
+                .signature.push_back(std::move(parameter));
+        } else {
+            std::get<FuncData>(declaration)
+                .signature.push_back(std::move(parameter));
+        }
+    } else if (!cur_scope->previous) {
+        offset = cur_scope->frame.add_global(size);
     } else {
-        cur_scope->table[name] = VarData{.type = type,
-                                         .size = size,
-                                         .offset = cur_scope->var_offset,
-                                         .pass_by_ref = pass_by_ref,
-                                         .is_param = is_param,
-                                         .next = nullptr};
-        cur_scope->var_offset += size;
+        // Placed by seal_frame
+        cur_scope->frame.add_local(size);
     }
     return true;
 }
 
-[[nodiscard]] auto SymbolTable::find(const std::string name,
-                                     const FindType type) const
-    -> std::optional<std::variant<VarData, ProcData, FuncData>> {
-    auto trav_scope = cur_scope;
-    while (trav_scope) {
-        if (!trav_scope->table.contains(name)) {
-            trav_scope = trav_scope->previous;
+[[nodiscard]] auto SymbolTable::resolve(const std::string_view name) const
+    -> std::optional<Entity> {
+    const auto searched = counts.tables_searched;
+    const Scope *scope = global;
+    const std::variant<VarData, ProcData, FuncData> *data = nullptr;
+    if constexpr (SYMTAB_COUNTERS) {
+        counts.tables_searched++;
+        count_probe(bindings, name);
+    }
+    if (const auto found = bindings.find(name);
+        found != bindings.end() && !found->second.empty()) {
+        const auto binding = found->second.top();
+        scope = binding.scope;
+        data = &scope->table.begin()[binding.order].second;
+        if constexpr (SYMTAB_COUNTERS) {
+            counts.chained++;
+            counts.chain_depth += found->second.size();
+            counts.max_chain_depth = std::max<std::uint64_t>(
+                counts.max_chain_depth, found->second.size());
+        }
+    } else if (frozen) {
+        if constexpr (SYMTAB_COUNTERS) {
+            counts.tables_searched++;
+            count_probe(*frozen, name);
+        }
+        if (data = frozen->find(name, horizon); !data) {
+            data = find_imported(name);
+        }
+    } else {
+        if constexpr (SYMTAB_COUNTERS) {
+            counts.tables_searched++;
+            count_probe(global->table, name);
+        }
+        const auto entry = global->table.find(name);
+        data = entry != global->table.end() ? &entry->second
+                                            : find_imported(name);
+    }
+    if constexpr (SYMTAB_COUNTERS) {
+        counts.max_tables_searched = std::max(
+            counts.max_tables_searched, counts.tables_searched - searched);
+        if (data) {
+            counts.lookups[data->index()]++;
         } else {
-            if ((type == FindType::Variable &&
-                 std::holds_alternative<VarData>(trav_scope->table[name])) ||
-                (type == FindType::Procedure &&
-                 std::holds_alternative<ProcData>(trav_scope->table[name])) ||
-                (type == FindType::Function &&
-                 std::holds_alternative<FuncData>(trav_scope->table[name]))) {
-                return trav_scope->table[name];
-            } else {
-                return std::nullopt;
+            counts.misses++;
+        }
+    }
+    if (!data) {
+        return std::nullopt;
+    }
+    // The alternatives of the variant come in the same order as EntityKind.
+    return Entity{.kind = static_cast<EntityKind>(data->index()),
+                  .depth = scope->depth,
+                  .data = data};
+}
+
+auto SymbolTable::find_imported(const std::string_view name) const
+    -> const std::variant<VarData, ProcData, FuncData> * {
+    if (imports().empty()) {
+        return nullptr;
+    }
+    if constexpr (SYMTAB_COUNTERS) {
+        counts.tables_searched++;
+        count_probe(imported, name);
+    }
+    if (const auto found = imported.find(name); found != imported.end()) {
+        return found->second;
+    }
+    for (auto it = imports().crbegin(); it != imports().crend(); ++it) {
+        if constexpr (SYMTAB_COUNTERS) {
+            counts.tables_searched++;
+        }
+        const auto &unit = *it->unit;
+        const auto symbol = unit.find(name);
+        if (!symbol) {
+            continue;
+        }
+        const auto damaged = [&] {
+            return std::runtime_error("Bad code: " + unit.path() +
+                                      " is damaged");
+        };
+        const auto type_of = [&](const std::uint32_t type) {
+            return unit.import_type(type, *types);
+        };
+        const auto result_of = [&](const std::uint8_t type) {
+            if (type > static_cast<std::uint8_t>(VarType::Real)) {
+                throw damaged();
             }
+            return static_cast<VarType>(type);
+        };
+        std::vector<Parameter> signature;
+        for (const auto &parameter : unit.parameters(*symbol)) {
+            signature.push_back(
+                {.name = std::string(unit.text(parameter.name)),
+                 .type = type_of(parameter.type),
+                 .pass_by_ref = parameter.pass_by_ref != 0,
+                 .offset = parameter.offset});
         }
+        std::variant<VarData, ProcData, FuncData> data;
+        // Imported declarations come before all of the program's own.
+        switch (static_cast<EntityKind>(symbol->kind)) {
+        case EntityKind::Variable:
+            data = VarData{.type = type_of(symbol->type),
+                           .pass_by_ref = symbol->pass_by_ref != 0,
+                           .is_param = false,
+                           .size = symbol->size,
+                           .offset = symbol->offset,
+                           .order = 0};
+            break;
+        case EntityKind::Procedure:
+            data = ProcData{.name = std::string(name),
+                            .next = nullptr,
+                            .order = 0,
+                            .signature = std::move(signature)};
+            break;
+        case EntityKind::Function:
+            data = FuncData{.name = std::string(name),
+                            .next = nullptr,
+                            .order = 0,
+                            .signature = std::move(signature),
+                            .result = result_of(symbol->result)};
+            break;
+        default:
+            throw damaged();
+        }
+        const auto stored = imported_data.make(std::move(data));
+        imported.try_emplace(name, stored);
+        return stored;
     }
-    return std::nullopt;
+    return nullptr;
 }
 
-[[nodiscard]] auto SymbolTable::enter_proc_scope(const std::string name) const
-    -> bool {
-    if (cur_scope->table.contains(name)) {
+[[nodiscard]] auto
+SymbolTable::use(const std::string_view name,
+                 std::shared_ptr<const UnitInterface> unit) const -> bool {
+    if (std::ranges::any_of(global->imports, [&](const Import &import) {
+            return import.name == name;
+        })) {
         return false;
     }
-    cur_scope->table[name] = ProcData{.name = name, .next = new Scope};
-    auto old_scope = cur_scope;
-    cur_scope = std::get<ProcData>(old_scope->table[name]).next;
-    cur_scope->param_offset = 0;
-    cur_scope->var_offset = 0;
-    cur_scope->name = name;
-    cur_scope->previous = old_scope;
+    global->frame.reserve(unit->data_size());
+    global->imports.push_back(
+        {.name = std::string(name), .unit = std::move(unit)});
     return true;
 }
 
-[[nodiscard]] auto SymbolTable::enter_func_scope(const std::string name) const
-    -> bool {
-    if (cur_scope->table.contains(name)) {
+// Declares a procedure or function in the current scope and enters the scope
+// of its body.
+template <typename Data>
+auto SymbolTable::enter_scope(const std::string_view name) const -> bool {
+    const auto order = cur_scope->table.size();
+    const auto [entry, inserted] = cur_scope->table.try_emplace(
+        name, Data{.name = std::string(name), .next = nullptr, .order = order});
+    if (!inserted) {
         return false;
     }
-    cur_scope->table[name] = FuncData{.name = name, .next = new Scope};
-    auto old_scope = cur_scope;
-    cur_scope = std::get<FuncData>(old_scope->table[name]).next;
-    cur_scope->param_offset = 0;
-    cur_scope->var_offset = 0;
-    cur_scope->name = name;
-    cur_scope->previous = old_scope;
+    if constexpr (SYMTAB_COUNTERS) {
+        counts.symbols++;
+        counts.scopes++;
+    }
+    bind(name, order);
+    auto scope = scopes->make();
+    std::get<Data>(entry->second).next = scope;
+    scope->name = name;
+    scope->previous = cur_scope;
+    scope->depth = cur_scope->depth + 1;
+    cur_scope = scope;
     return true;
 }
 
-void SymbolTable::leave_scope() {
-    if (cur_scope->previous) {
-        cur_scope = cur_scope->previous;
+[[nodiscard]] auto
+SymbolTable::enter_proc_scope(const std::string_view name) const -> bool {
+    return enter_scope<ProcData>(name);
+}
+
+[[nodiscard]] auto
+SymbolTable::enter_func_scope(const std::string_view name) const -> bool {
+    return enter_scope<FuncData>(name);
+}
+
+void SymbolTable::set_result(const VarType type) const {
+    std::get<FuncData>(owner(cur_scope)).result = type;
+}
+
+void SymbolTable::seal_frame() const {
+    for (auto &[_, entry] : cur_scope->table) {
+        if (auto var = std::get_if<VarData>(&entry); var && !var->is_param) {
+            var->offset = cur_scope->frame.place(var->size);
+        }
     }
 }
 
-[[nodiscard]] auto SymbolTable::get_var_info(const std::string name) const
-    -> std::optional<VarData> {
-    if (cur_scope->table.contains(name) &&
-        std::holds_alternative<VarData>(cur_scope->table[name])) {
-        return std::get<VarData>(cur_scope->table[name]);
+auto SymbolTable::stats() const -> SymbolStats {
+    auto result = counts;
+    if constexpr (SYMTAB_COUNTERS) {
+        for (auto scope = cur_scope;; scope = scope->previous) {
+            count_table(result, *scope);
+            if (scope == root || !scope->previous) {
+                break;
+            }
+        }
     }
-    return std::nullopt;
+    return result;
 }
 
-[[nodiscard]] auto SymbolTable::get_func_info(const std::string name) const
-    -> std::optional<FuncData> {
-    if (cur_scope->table.contains(name) &&
-        std::holds_alternative<FuncData>(cur_scope->table[name])) {
-        return std::get<FuncData>(cur_scope->table[name]);
+auto SymbolTable::freeze() const -> std::unique_ptr<const FrozenScope> {
+    return std::make_unique<const FrozenScope>(*global);
+}
+
+void SymbolTable::leave_scope() {
+    if (cur_scope->previous) {
+        if constexpr (SYMTAB_COUNTERS) {
+            count_table(counts, *cur_scope);
+        }
+        for (const auto &[name, _] : cur_scope->table) {
+            bindings.find(name)->second.pop();
+        }
+        cur_scope = cur_scope->previous;
     }
-    return std::nullopt;
 }
 
-[[nodiscard]] auto SymbolTable::get_proc_info(const std::string name) const
-    -> std::optional<ProcData> {
-    if (cur_scope->table.contains(name) &&
-        std::holds_alternative<ProcData>(cur_scope->table[name])) {
-        return std::get<ProcData>(cur_scope->table[name]);
+void SymbolTable::unwind(const Scope *scope) {
+    while (cur_scope != scope && cur_scope->previous) {
+        leave_scope();
     }
-    return std::nullopt;
 }
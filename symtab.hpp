@@ -1,66 +1,300 @@
 #pragma once
+#include "arena.hpp"
+#include "flat_map.hpp"
+#include "frame.hpp"
+#include "interface.hpp"
+#include "small_stack.hpp"
+#include "types.hpp"
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <tuple>
-#include <unordered_map>
 #include <variant>
 #include <vector>
 
-enum class VarType { Integer, Boolean, Character, Real };
-
-enum class FindType { Variable, Procedure, Function };
+enum class EntityKind { Variable, Procedure, Function };
 
 struct Scope;
 
+// `order` is the position of the declaration within its scope, used to keep
+// later global declarations out of sight of procedure bodies that are parsed
+// out of order. The name is the key the record is stored under.
 struct VarData {
-    VarType type;
-    std::string name;
+    TypeId type;
+    bool pass_by_ref;
+    bool is_param;
     std::uint64_t size;
     std::uint64_t offset;
+    std::uint64_t order;
+};
+
+// A formal parameter as a caller sees it
+struct Parameter {
+    std::string name;
+    TypeId type;
     bool pass_by_ref;
-    bool is_param;
-    Scope *next;
+    std::uint64_t offset;
 };
 
+// `signature` lists the parameters in declaration order.
 struct ProcData {
     std::string name;
     Scope *next;
+    std::uint64_t order;
+    std::vector<Parameter> signature = {};
 };
 
 struct FuncData {
     std::string name;
     Scope *next;
+    std::uint64_t order;
+    std::vector<Parameter> signature = {};
+    VarType result = VarType::Integer;
+};
+
+// A unit named in the `uses` clause. Its globals are where its own code has
+// them, at the start of the data segment.
+struct Import {
+    std::string name;
+    std::shared_ptr<const UnitInterface> unit;
 };
 
 struct Scope {
-    std::unordered_map<std::string, std::variant<VarData, ProcData, FuncData>>
-        table;
-    std::uint64_t param_offset;
-    std::uint64_t var_offset;
+    FlatMap<std::variant<VarData, ProcData, FuncData>> table;
+    FrameLayout frame;
     std::string name;
-    Scope *previous;
+    Scope *previous = nullptr;
+    // Number of scopes enclosing this one; the global scope is 0
+    std::uint32_t depth = 0;
+    // Units used by the program; only the global scope has any.
+    std::vector<Import> imports;
+};
+
+using ScopeArena = Arena<Scope>;
+
+// A declaration in effect: the scope it was made in and its `order` there,
+// which is also its position in the scope's table.
+struct Binding {
+    Scope *scope;
+    std::uint64_t order;
+};
+
+// What a name refers to where it is used. Points into the table of the scope
+// at `depth` that declares it, so it is only good until that scope gets its
+// next declaration. Declarations of used units have depth 0 and stay put.
+struct Entity {
+    EntityKind kind;
+    std::uint32_t depth;
+    const std::variant<VarData, ProcData, FuncData> *data;
+
+    [[nodiscard]] inline auto var() const -> const VarData & {
+        return std::get<VarData>(*data);
+    }
+
+    [[nodiscard]] inline auto proc() const -> const ProcData & {
+        return std::get<ProcData>(*data);
+    }
+
+    [[nodiscard]] inline auto func() const -> const FuncData & {
+        return std::get<FuncData>(*data);
+    }
+};
+
+// A read-only copy of the global scope for the tables that parse procedure
+// and function bodies on other threads. It is taken once every global is
+// declared and never changes, so any number of threads can query it without
+// locks, each with the scopes of its own body on top.
+//
+// The declarations sit in one array in declaration order, so a declaration's
+// `order` is its index, and their names in one buffer. An open-addressing
+// index of at least twice as many slots maps hashes to them.
+class FrozenScope {
+  public:
+    explicit FrozenScope(const Scope &scope);
+    FrozenScope(const FrozenScope &) = delete;
+    auto operator=(const FrozenScope &) -> FrozenScope & = delete;
+
+    // The declaration of `name` among the first `horizon`, or nullptr
+    [[nodiscard]] auto find(const std::string_view name,
+                            const std::uint64_t horizon) const
+        -> const std::variant<VarData, ProcData, FuncData> *;
+
+    // Number of index slots a lookup of `key` probes
+    [[nodiscard]] auto probe_length(const std::string_view key) const
+        -> std::size_t;
+
+    [[nodiscard]] inline auto imports() const -> const std::vector<Import> & {
+        return used;
+    }
+
+  private:
+    struct Entry {
+        std::size_t hash;
+        std::uint32_t name;
+        std::uint32_t length;
+    };
+
+    std::string names;
+    std::vector<Entry> entries;
+    std::vector<std::variant<VarData, ProcData, FuncData>> declarations;
+    // One plus the index of an entry, or zero for an empty slot
+    std::vector<std::uint32_t> slots;
+    std::vector<Import> used;
+
+    [[nodiscard]] static inline auto hash_of(const std::string_view key)
+        -> std::size_t {
+        return std::hash<std::string_view>{}(key);
+    }
+
+    // The slot holding the entry for `name`, or the empty one that ends its
+    // probe sequence
+    [[nodiscard]] auto slot_of(const std::string_view name,
+                               const std::size_t hash) const -> std::size_t;
+};
+
+// Define SYMTAB_STATS to have every SymbolTable count what its lookups cost.
+// Without it the counting is compiled out.
+#ifdef SYMTAB_STATS
+inline constexpr bool SYMTAB_COUNTERS = true;
+#else
+inline constexpr bool SYMTAB_COUNTERS = false;
+#endif
+
+// What the lookups and declarations of one or more tables cost, for `--stats`.
+// Totals and maxima only; means are worked out when reporting.
+struct SymbolStats {
+    // Names resolved, by the EntityKind found
+    std::array<std::uint64_t, 3> lookups{};
+    // Names resolved to nothing
+    std::uint64_t misses = 0;
+    // Tables a lookup searched: the binding stacks, then the global scope,
+    // then the declarations imported so far and each used unit
+    std::uint64_t tables_searched = 0;
+    std::uint64_t max_tables_searched = 0;
+    // Names resolved through a binding stack, and the declarations in open
+    // scopes on their stacks, the one found included
+    std::uint64_t chained = 0;
+    std::uint64_t chain_depth = 0;
+    std::uint64_t max_chain_depth = 0;
+    // Hash lookups in the scope, binding and import tables, and how far they
+    // probed: groups of slots in a FlatMap, slots in a FrozenScope
+    std::uint64_t probes = 0;
+    std::uint64_t probe_groups = 0;
+    std::uint64_t max_probe_groups = 0;
+    std::uint64_t scopes = 0;
+    std::uint64_t symbols = 0;
+    // Load factors of scope tables, each taken when its scope is complete
+    std::uint64_t tables = 0;
+    double load_factor_sum = 0;
+    double min_load_factor = 1;
+    double max_load_factor = 0;
+
+    void merge(const SymbolStats &other);
 };
 
 class SymbolTable {
   public:
     mutable Scope *cur_scope;
+    // Frozen global declarations at or past this position are invisible to
+    // `resolve`.
+    std::uint64_t horizon = std::numeric_limits<std::uint64_t>::max();
     explicit SymbolTable();
+    // Works inside an existing scope owned by another table, seeing only the
+    // first `horizon` declarations of `globals`, the frozen global scope.
+    // Scopes entered from there are allocated in `scopes`, and types are
+    // made in `types`.
+    explicit SymbolTable(const FrozenScope &globals, Scope *scope,
+                         const std::uint64_t horizon, ScopeArena &scopes,
+                         TypeTable &types);
+    SymbolTable(const SymbolTable &) = delete;
+    auto operator=(const SymbolTable &) -> SymbolTable & = delete;
     ~SymbolTable();
-    [[nodiscard]] auto add_variable(const std::string name, const VarType type,
-                                    const std::uint64_t size,
+    [[nodiscard]] auto add_variable(const std::string_view name,
+                                    const TypeId type,
                                     const bool pass_by_ref = false,
                                     const bool is_param = false) const -> bool;
-    [[nodiscard]] auto enter_proc_scope(const std::string name) const -> bool;
-    [[nodiscard]] auto enter_func_scope(const std::string name) const -> bool;
-    [[nodiscard]] auto find(const std::string name,
-                            const FindType type = FindType::Variable) const
-        -> std::optional<std::variant<VarData, ProcData, FuncData>>;
+    // Makes the declarations of `unit` visible as globals, behind the
+    // program's own, and reserves room for its globals. Returns false if a
+    // unit of that name is in use already. Must come before any global is
+    // declared.
+    [[nodiscard]] auto use(const std::string_view name,
+                           std::shared_ptr<const UnitInterface> unit) const
+        -> bool;
+    [[nodiscard]] auto enter_proc_scope(const std::string_view name) const
+        -> bool;
+    [[nodiscard]] auto enter_func_scope(const std::string_view name) const
+        -> bool;
+    // Records the result type of the function whose scope is the current one.
+    void set_result(const VarType type) const;
+    // Gives the locals of the current scope their offsets, once all of them
+    // have been declared.
+    void seal_frame() const;
+    // Finds the innermost declaration of `name` in sight, of whatever kind.
+    [[nodiscard]] auto resolve(const std::string_view name) const
+        -> std::optional<Entity>;
     void leave_scope();
-    [[nodiscard]] auto get_var_info(const std::string name) const
-        -> std::optional<VarData>;
-    [[nodiscard]] auto get_func_info(const std::string name) const
-        -> std::optional<FuncData>;
-    [[nodiscard]] auto get_proc_info(const std::string name) const
-        -> std::optional<ProcData>;
+    // Leaves scopes until `scope`, which must enclose the current one, is the
+    // current scope again.
+    void unwind(const Scope *scope);
+
+    [[nodiscard]] inline auto global_scope() const -> const Scope & {
+        return *global;
+    }
+
+    // Copies the global scope as it is now for tables on other threads.
+    [[nodiscard]] auto freeze() const -> std::unique_ptr<const FrozenScope>;
+
+    [[nodiscard]] inline auto type_table() const -> TypeTable & {
+        return *types;
+    }
+
+    // The counts so far, the scopes still open included. All zero unless
+    // SYMTAB_COUNTERS.
+    [[nodiscard]] auto stats() const -> SymbolStats;
+
+  private:
+    // Every scope and type of a table that started its own global scope,
+    // freed along with the table
+    ScopeArena own_scopes;
+    ScopeArena *scopes = &own_scopes;
+    std::unique_ptr<TypeTable> own_types;
+    TypeTable *types;
+    Scope *global;
+    // The global scope as frozen, if this table reads that rather than the
+    // global scope itself
+    const FrozenScope *frozen = nullptr;
+    // The outermost scope this table declares in
+    Scope *root;
+    mutable SymbolStats counts;
+    // For every name declared in an open scope below the global one, its
+    // declarations from outermost to innermost (LeBlanc and Cook), so that
+    // resolving a name does not depend on how deep the current scope is.
+    // Global names are looked up in the global scope itself, which tables
+    // working on other bodies may be reading at the same time.
+    mutable FlatMap<SmallStack<Binding, 2>> bindings;
+    // Declarations of used units read so far, built the first time each name
+    // is resolved. Kept per table so that bodies parsed on other threads
+    // never share them.
+    mutable FlatMap<const std::variant<VarData, ProcData, FuncData> *>
+        imported;
+    mutable Arena<std::variant<VarData, ProcData, FuncData>> imported_data;
+
+    void bind(const std::string_view name, const std::uint64_t order) const;
+    [[nodiscard]] inline auto imports() const -> const std::vector<Import> & {
+        return frozen ? frozen->imports() : global->imports;
+    }
+    // Counts a lookup of `key` in `map`.
+    template <typename Map>
+    void count_probe(const Map &map, const std::string_view key) const;
+    template <typename Data>
+    auto enter_scope(const std::string_view name) const -> bool;
+    // The declaration of `name` in the last used unit that has one
+    auto find_imported(const std::string_view name) const
+        -> const std::variant<VarData, ProcData, FuncData> *;
 };
@@ -232,7 +232,7 @@ static const std::array<const std::array<const DfaState, 13>, 256> STATE_TBL{
      // character 46
      {{DfaState::Dot, DfaState::Accept, DfaState::RealInit, DfaState::Error,
        DfaState::Error, DfaState::Error, DfaState::Error, DfaState::Error,
-       DfaState::Error, DfaState::Error, DfaState::Error, DfaState::Error,
+       DfaState::Error, DfaState::Error, DfaState::Accept, DfaState::Error,
        DfaState::Error}},
      // character 47
      {{DfaState::Special, DfaState::Accept, DfaState::Accept, DfaState::Error,
@@ -0,0 +1,150 @@
+#include "types.hpp"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+
+auto Type::field(const std::string_view name) const -> const Field * {
+    const auto found = std::ranges::find(fields, name, &Field::name);
+    return found == fields.cend() ? nullptr : &*found;
+}
+
+// Appends the bytes of `value` to a key.
+template <typename T> static void append(std::string &key, const T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    key.append(bytes, sizeof(T));
+}
+
+static auto align_up(const std::uint64_t value, const std::uint64_t alignment)
+    -> std::uint64_t {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Sizes are stored in 32 bits in unit interfaces.
+static void check_size(const std::uint64_t size) {
+    if (size > std::numeric_limits<std::uint32_t>::max()) {
+        throw std::runtime_error("Bad code: type is too large");
+    }
+}
+
+TypeTable::TypeTable() {
+    for (TypeId id = 0; id < SCALARS; ++id) {
+        std::string key;
+        append(key, TypeKind::Scalar);
+        append(key, id);
+        intern(key, Type{.kind = TypeKind::Scalar,
+                         .scalar = static_cast<VarType>(id),
+                         .size = SCALAR_SIZES[id],
+                         .alignment = SCALAR_SIZES[id]});
+    }
+}
+
+auto TypeTable::intern(const std::string &key, Type type) -> TypeId {
+    std::unique_lock lock(mutex);
+    const auto [entry, inserted] =
+        interned.try_emplace(key, static_cast<TypeId>(types.size()));
+    if (inserted) {
+        types.push_back(storage.make(std::move(type)));
+    }
+    return entry->second;
+}
+
+auto TypeTable::operator[](const TypeId id) const -> const Type & {
+    // Types never move once made; only the list of them can.
+    std::shared_lock lock(mutex);
+    return *types[id];
+}
+
+auto TypeTable::subrange(const TypeId base, const std::int64_t low,
+                         const std::int64_t high) -> TypeId {
+    const auto scalar = *scalar_of(base);
+    std::string key;
+    append(key, TypeKind::Subrange);
+    append(key, scalar);
+    append(key, low);
+    append(key, high);
+    const auto &of = (*this)[this->scalar(scalar)];
+    return intern(key, Type{.kind = TypeKind::Subrange,
+                            .scalar = scalar,
+                            .size = of.size,
+                            .alignment = of.alignment,
+                            .low = low,
+                            .high = high});
+}
+
+auto TypeTable::array(const TypeId index, const TypeId element) -> TypeId {
+    const auto &range = (*this)[index];
+    const auto &of = (*this)[element];
+    const auto count = static_cast<std::uint64_t>(range.high - range.low) + 1;
+    if (of.size != 0 &&
+        count > std::numeric_limits<std::uint32_t>::max() / of.size) {
+        throw std::runtime_error("Bad code: type is too large");
+    }
+    std::string key;
+    append(key, TypeKind::Array);
+    append(key, index);
+    append(key, element);
+    return intern(key, Type{.kind = TypeKind::Array,
+                            .scalar = std::nullopt,
+                            .size = count * of.size,
+                            .alignment = of.alignment,
+                            .index = index,
+                            .low = range.low,
+                            .high = range.high,
+                            .element = element});
+}
+
+auto TypeTable::record(std::vector<Field> fields) -> TypeId {
+    std::string key;
+    append(key, TypeKind::Record);
+    std::uint64_t size = 0;
+    std::uint64_t alignment = 1;
+    for (auto &field : fields) {
+        const auto &type = (*this)[field.type];
+        field.offset = align_up(size, type.alignment);
+        size = field.offset + type.size;
+        alignment = std::max(alignment, type.alignment);
+        append(key, field.type);
+        append(key, field.name.size());
+        key += field.name;
+    }
+    size = align_up(size, alignment);
+    check_size(size);
+    return intern(key, Type{.kind = TypeKind::Record,
+                            .scalar = std::nullopt,
+                            .size = size,
+                            .alignment = alignment,
+                            .fields = std::move(fields)});
+}
+
+auto TypeTable::name(const TypeId id) const -> std::string {
+    const auto &type = (*this)[id];
+    switch (type.kind) {
+    case TypeKind::Scalar:
+        switch (*type.scalar) {
+        case VarType::Integer:
+            return "integer";
+        case VarType::Boolean:
+            return "boolean";
+        case VarType::Character:
+            return "char";
+        case VarType::Real:
+            return "real";
+        }
+        break;
+    case TypeKind::Subrange:
+        return std::to_string(type.low) + ".." + std::to_string(type.high);
+    case TypeKind::Array:
+        return "array[" + name(type.index) + "] of " + name(type.element);
+    case TypeKind::Record: {
+        std::string text = "record";
+        for (const auto &field : type.fields) {
+            text += " " + field.name + ": " + name(field.type) + ";";
+        }
+        return text + " end";
+    }
+    }
+    return {};
+}
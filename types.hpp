@@ -0,0 +1,106 @@
+#pragma once
+#include "arena.hpp"
+#include "flat_map.hpp"
+#include <cstdint>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class VarType { Integer, Boolean, Character, Real };
+
+// Names a type in a TypeTable. Every type is interned, so two ids are equal
+// exactly when the types are. The scalars come first, each with the id of its
+// VarType.
+using TypeId = std::uint32_t;
+
+enum class TypeKind : std::uint8_t { Scalar, Subrange, Array, Record };
+
+struct Field {
+    std::string name;
+    TypeId type;
+    std::uint64_t offset;
+};
+
+struct Type {
+    TypeKind kind;
+    // What a value of the type is loaded as: the scalar itself, or the one a
+    // subrange is taken from. Arrays and records are never loaded whole.
+    std::optional<VarType> scalar;
+    std::uint64_t size;
+    std::uint64_t alignment;
+    // The subrange, or for an array the subrange of its index
+    TypeId index = 0;
+    std::int64_t low = 0;
+    std::int64_t high = 0;
+    // Arrays only
+    TypeId element = 0;
+    // Records only, in declaration order
+    std::vector<Field> fields = {};
+
+    // The field called `name`, or nullptr
+    [[nodiscard]] auto field(const std::string_view name) const
+        -> const Field *;
+};
+
+// Every type a program uses, each structure stored once. Structural types
+// are hash-consed: building one looks its structure up by the ids of its
+// parts, so equal structures get the same id, and comparing two types is
+// comparing two integers. Bodies parsed on different threads share one
+// table; building types takes a lock, and so does looking up one that is not
+// a scalar.
+class TypeTable {
+  public:
+    static constexpr TypeId SCALARS = 4;
+
+    TypeTable();
+    TypeTable(const TypeTable &) = delete;
+    auto operator=(const TypeTable &) -> TypeTable & = delete;
+
+    [[nodiscard]] static constexpr auto scalar(const VarType type) -> TypeId {
+        return static_cast<TypeId>(type);
+    }
+
+    // The subrange `low..high` of the scalar `base`, or of what `base` is a
+    // subrange of
+    auto subrange(const TypeId base, const std::int64_t low,
+                  const std::int64_t high) -> TypeId;
+    // An array indexed by the subrange `index`
+    auto array(const TypeId index, const TypeId element) -> TypeId;
+    // A record of `fields` in order, each at the next offset aligned for it;
+    // the offsets passed in are ignored.
+    auto record(std::vector<Field> fields) -> TypeId;
+
+    [[nodiscard]] auto operator[](const TypeId id) const -> const Type &;
+
+    // What a value of type `id` is loaded as, if it is loaded at all. Neither
+    // this nor `size_of` takes the lock for a scalar.
+    [[nodiscard]] inline auto scalar_of(const TypeId id) const
+        -> std::optional<VarType> {
+        if (id < SCALARS) {
+            return static_cast<VarType>(id);
+        }
+        return (*this)[id].scalar;
+    }
+
+    [[nodiscard]] inline auto size_of(const TypeId id) const
+        -> std::uint64_t {
+        return id < SCALARS ? SCALAR_SIZES[id] : (*this)[id].size;
+    }
+
+    // The type as it would be written in a declaration
+    [[nodiscard]] auto name(const TypeId id) const -> std::string;
+
+  private:
+    // In the order of VarType
+    static constexpr std::uint64_t SCALAR_SIZES[SCALARS] = {4, 1, 1, 4};
+
+    mutable std::shared_mutex mutex;
+    Arena<Type> storage;
+    std::vector<const Type *> types;
+    // Ids by a key made of the kind and the parts of the type
+    FlatMap<TypeId> interned;
+
+    auto intern(const std::string &key, Type type) -> TypeId;
+};